@@ -0,0 +1,291 @@
+#include "bench.h"
+
+#include <string.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+#include "../common/frame_source.h"
+
+//usage: <width> <height> [results.csv] [sequence.raw]
+//the results are appended to the csv file, a raw rgb sequence at the same resolution replaces the synthetic frames
+int bench_init(bench_t *bench, char *group, int argc, char **argv){
+    if(argc < 3 || atoi(argv[1]) < 64 || atoi(argv[2]) < 64){
+        fprintf(stderr, "usage: %s <width> <height> [results.csv] [sequence.raw]\n\r", argv[0]);
+        return -1;
+    }
+
+    strncpy(bench->group, group, BENCH_MAX_NAME-1);
+    bench->group[BENCH_MAX_NAME-1] = 0;
+    bench->width = atoi(argv[1]);
+    bench->height = atoi(argv[2]);
+    bench->nb_frames = 0;
+    bench->csv = NULL;
+
+    //the device tree gives the board model on the pi, otherwise the architecture
+    bench->machine[0] = 0;
+    FILE *fp_model = fopen("/proc/device-tree/model", "r");
+    if(fp_model != NULL){
+        size_t len = fread(bench->machine, 1, BENCH_MAX_NAME-1, fp_model);
+        bench->machine[len] = 0;
+        fclose(fp_model);
+    }
+    if(bench->machine[0] == 0){
+        struct utsname name;
+        uname(&name);
+        strncpy(bench->machine, name.machine, BENCH_MAX_NAME-1);
+        bench->machine[BENCH_MAX_NAME-1] = 0;
+    }
+    //keep the csv columns intact
+    for (size_t i = 0; bench->machine[i] != 0; i++)
+    {
+        if(bench->machine[i] == ','){
+            bench->machine[i] = ' ';
+        }
+    }
+
+    if(argc > 4){
+        if(bench_load_frames(bench, argv[4]) != 0){
+            return -1;
+        }
+    }
+    else{
+        bench_generate_frames(bench, BENCH_MAX_FRAMES);
+    }
+
+    for (size_t i = 0; i < bench->nb_frames; i++)
+    {
+        image_convert_to_grayscale(&bench->rgb[i], &bench->gray[i]);
+    }
+
+    if(argc > 3){
+        bench->csv = fopen(argv[3], "a");
+        if(bench->csv == NULL){
+            fprintf(stderr, "could not open %s\n\r", argv[3]);
+            return -1;
+        }
+        //header only at the start of a new file, the programs of the suite append to the same one
+        fseek(bench->csv, 0, SEEK_END);
+        if(ftell(bench->csv) == 0){
+            fprintf(bench->csv, "machine,group,kernel,width,height,runs,median_ns,p99_ns,min_ns,unit,nb_units,ns_per_unit,mb_per_s\n");
+        }
+    }
+
+    printf("%s on %s, %dx%d, %d frames\n\r", bench->group, bench->machine, bench->width, bench->height, bench->nb_frames);
+
+    return 0;
+}
+
+void bench_free(bench_t *bench){
+    for (size_t i = 0; i < bench->nb_frames; i++)
+    {
+        free(bench->rgb[i].img);
+        free(bench->gray[i].img);
+    }
+
+    if(bench->csv != NULL){
+        fclose(bench->csv);
+    }
+}
+
+//same scene at any resolution: a colour gradient with flat rectangles and checkerboards (regions, edges, lines
+//and corners) moving by a few pixels per frame, and a little noise, generated with a fixed seed
+void bench_generate_frames(bench_t *bench, uint nb_frames){
+    #define BENCH_NB_SHAPES 12
+    #define BENCH_CHECKER_SIZE 8
+    uint width = bench->width;
+    uint height = bench->height;
+    uint32_t seed = 1;
+
+    int shape_x[BENCH_NB_SHAPES], shape_y[BENCH_NB_SHAPES], shape_w[BENCH_NB_SHAPES], shape_h[BENCH_NB_SHAPES];
+    int shape_dx[BENCH_NB_SHAPES], shape_dy[BENCH_NB_SHAPES];
+    uint8_t shape_colour[BENCH_NB_SHAPES][3];
+
+    for (size_t i = 0; i < BENCH_NB_SHAPES; i++)
+    {
+        seed = seed*1664525+1013904223;
+        shape_x[i] = (seed>>8)%(width*3/4);
+        seed = seed*1664525+1013904223;
+        shape_y[i] = (seed>>8)%(height*3/4);
+        seed = seed*1664525+1013904223;
+        shape_w[i] = width/16+(seed>>8)%(width/5);
+        seed = seed*1664525+1013904223;
+        shape_h[i] = height/16+(seed>>8)%(height/5);
+        seed = seed*1664525+1013904223;
+        shape_dx[i] = (int)((seed>>8)%7)-3;
+        seed = seed*1664525+1013904223;
+        shape_dy[i] = (int)((seed>>8)%5)-2;
+        for (size_t c = 0; c < 3; c++)
+        {
+            seed = seed*1664525+1013904223;
+            shape_colour[i][c] = (seed>>8)%256;
+        }
+    }
+
+    for (size_t f = 0; f < nb_frames; f++)
+    {
+        image_rgb_t *img = &bench->rgb[f];
+        img->width = width;
+        img->height = height;
+        img->img = malloc(width*height*3);
+
+        for (size_t y = 0; y < height; y++)
+        {
+            for (size_t x = 0; x < width; x++)
+            {
+                uint8_t *pix = &img->img[(y*width+x)*3];
+                pix[0] = x*255/width;
+                pix[1] = y*255/height;
+                pix[2] = 96;
+            }
+        }
+
+        //the last shapes are drawn over the first ones, odd shapes are checkerboards
+        for (size_t i = 0; i < BENCH_NB_SHAPES; i++)
+        {
+            int start_x = shape_x[i]+shape_dx[i]*(int)f;
+            int start_y = shape_y[i]+shape_dy[i]*(int)f;
+
+            for (int y = start_y; y < start_y+shape_h[i]; y++)
+            {
+                if(y < 0 || y >= (int)height){
+                    continue;
+                }
+                for (int x = start_x; x < start_x+shape_w[i]; x++)
+                {
+                    if(x < 0 || x >= (int)width){
+                        continue;
+                    }
+
+                    uint8_t *pix = &img->img[(y*width+x)*3];
+                    uint dark = (i%2) && (((x-start_x)/BENCH_CHECKER_SIZE+(y-start_y)/BENCH_CHECKER_SIZE)%2);
+                    for (size_t c = 0; c < 3; c++)
+                    {
+                        pix[c] = dark ? shape_colour[i][c]/4 : shape_colour[i][c];
+                    }
+                }
+            }
+        }
+
+        for (size_t i = 0; i < width*height*3; i++)
+        {
+            seed = seed*1664525+1013904223;
+            int val = img->img[i]+(int)((seed>>24)%7)-3;
+            img->img[i] = val < 0 ? 0 : (val > 255 ? 255 : val);
+        }
+    }
+
+    bench->nb_frames = nb_frames;
+}
+
+//the first BENCH_MAX_FRAMES frames of a raw rgb sequence, copied so the runs don't depend on the page cache
+int bench_load_frames(bench_t *bench, char *filename){
+    frame_source_t source;
+    if(frame_source_replay_init(&source, filename, bench->width, bench->height, 3, 0, 0) != 0){
+        return -1;
+    }
+
+    uint8_t *frame;
+    while(bench->nb_frames < BENCH_MAX_FRAMES && (frame = frame_source_get(&source)) != NULL){
+        image_rgb_t *img = &bench->rgb[bench->nb_frames];
+        img->width = bench->width;
+        img->height = bench->height;
+        img->img = malloc(bench->width*bench->height*3);
+        memcpy(img->img, frame, bench->width*bench->height*3);
+        frame_source_release(&source);
+        bench->nb_frames++;
+    }
+
+    frame_source_free(&source);
+    return 0;
+}
+
+//frames go 0, 1, ..., n-1, n-2, ..., 1, 0, 1, ... so consecutive runs always see a small motion
+uint bench_frame_index(bench_t *bench, uint run){
+    if(bench->nb_frames < 2){
+        return 0;
+    }
+
+    uint period = 2*(bench->nb_frames-1);
+    uint pos = run%period;
+    return pos < bench->nb_frames ? pos : period-pos;
+}
+
+uint64_t bench_time_ns(){
+    struct timespec time_read;
+    clock_gettime(CLOCK_MONOTONIC, &time_read);
+    return (uint64_t)time_read.tv_sec*1000000000ULL+time_read.tv_nsec;
+}
+
+int bench_compare_u64(const void *a, const void *b){
+    uint64_t val_a = *(const uint64_t *)a;
+    uint64_t val_b = *(const uint64_t *)b;
+    return (val_a > val_b)-(val_a < val_b);
+}
+
+//times up to BENCH_NB_RUNS runs of a kernel, one frame per run, slow kernels stop after BENCH_MAX_SECONDS
+//and at least BENCH_MIN_RUNS runs, the p99 of a short series is close to its maximum
+//bytes_per_run is the size of the input read by the kernel, for the throughput
+//kernel working on every pixel of the frame, the cost is given per pixel
+void bench_run(bench_t *bench, char *name, bench_fn_t prepare, bench_fn_t run, void *data, size_t bytes_per_run){
+    bench_run_units(bench, name, prepare, run, data, bytes_per_run, bench->width*bench->height, "px");
+}
+
+//the cost is given per unit of work of the kernel (points, blocks), the median divided by nb_units
+//bytes_per_run is 0 when the input read by a run isn't known (windows around points), no throughput is given
+void bench_run_units(bench_t *bench, char *name, bench_fn_t prepare, bench_fn_t run, void *data, size_t bytes_per_run, uint nb_units, char *unit){
+    uint64_t samples[BENCH_NB_RUNS];
+    uint nb_samples = 0;
+    uint64_t bench_start_time = bench_time_ns();
+    uint64_t timed_start_time = 0;
+
+    for (size_t i = 0; nb_samples < BENCH_NB_RUNS; i++)
+    {
+        bench->prev_frame = bench_frame_index(bench, i == 0 ? 0 : i-1);
+        bench->cur_frame = bench_frame_index(bench, i);
+
+        if(prepare != NULL){
+            prepare(bench, data);
+        }
+
+        uint64_t start_time = bench_time_ns();
+        run(bench, data);
+        uint64_t end_time = bench_time_ns();
+
+        //warmup until BENCH_WARMUP_RUNS runs or a second
+        if(timed_start_time == 0){
+            if(i+1 >= BENCH_WARMUP_RUNS || end_time-bench_start_time > 1000000000ULL){
+                timed_start_time = end_time;
+            }
+            continue;
+        }
+
+        samples[nb_samples] = end_time-start_time;
+        nb_samples++;
+
+        if(nb_samples >= BENCH_MIN_RUNS && end_time-timed_start_time > BENCH_MAX_SECONDS*1000000000ULL){
+            break;
+        }
+    }
+
+    qsort(samples, nb_samples, sizeof(uint64_t), bench_compare_u64);
+
+    uint64_t median_ns = samples[nb_samples/2];
+    uint64_t p99_ns = samples[(nb_samples*99)/100];
+    uint64_t min_ns = samples[0];
+    double ns_per_unit = nb_units > 0 ? (double)median_ns/nb_units : 0;
+    double mb_per_s = median_ns > 0 ? bytes_per_run*1000.0/median_ns : 0;
+
+    //throughput column left empty without bytes_per_run
+    char mb_per_s_str[32] = "";
+    if(bytes_per_run > 0){
+        snprintf(mb_per_s_str, sizeof(mb_per_s_str), "%.1f", mb_per_s);
+    }
+
+    printf("%-28s median %9.3fms  p99 %9.3fms  %8.2fns/%-3s %8sMB/s\n\r", name, median_ns/1e6, p99_ns/1e6, ns_per_unit, unit, bytes_per_run > 0 ? mb_per_s_str : "-");
+
+    if(bench->csv != NULL){
+        fprintf(bench->csv, "%s,%s,%s,%d,%d,%d,%llu,%llu,%llu,%s,%d,%.3f,%s\n", bench->machine, bench->group, name, bench->width, bench->height, nb_samples,
+            (unsigned long long)median_ns, (unsigned long long)p99_ns, (unsigned long long)min_ns, unit, nb_units, ns_per_unit, mb_per_s_str);
+        fflush(bench->csv);
+    }
+}
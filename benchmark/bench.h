@@ -0,0 +1,47 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../common/image.h"
+
+#define BENCH_MAX_FRAMES 8 //fixed input frames, replayed back and forth so the motion between two runs stays small
+#define BENCH_NB_RUNS 200 //timed runs of each kernel
+#define BENCH_MIN_RUNS 20 //for the kernels slower than BENCH_MAX_SECONDS in total
+#define BENCH_MAX_SECONDS 10
+#define BENCH_WARMUP_RUNS 10 //untimed runs before, caches and buffers allocated on the first call
+#define BENCH_MAX_NAME 64
+
+//input frames and output of a benchmark program, one program runs at one resolution
+typedef struct bench_t{
+    char group[BENCH_MAX_NAME]; //app or common, first column of the results
+    char machine[BENCH_MAX_NAME]; //model of the raspberry pi (or cpu architecture), to compare the results of several boards
+    uint width;
+    uint height;
+    uint nb_frames;
+    image_rgb_t rgb[BENCH_MAX_FRAMES];
+    image_grayscale_t gray[BENCH_MAX_FRAMES];
+
+    //frames of the run in progress, the kernels working on two frames use both
+    uint cur_frame;
+    uint prev_frame;
+
+    FILE *csv; //NULL if the results are only printed
+} bench_t;
+
+//prepare is called before each run and isn't timed (e.g. restoring the input of an in place kernel)
+typedef void (*bench_fn_t)(bench_t *bench, void *data);
+
+int bench_init(bench_t *bench, char *group, int argc, char **argv);
+void bench_free(bench_t *bench);
+void bench_generate_frames(bench_t *bench, uint nb_frames);
+int bench_load_frames(bench_t *bench, char *filename);
+uint bench_frame_index(bench_t *bench, uint run);
+uint64_t bench_time_ns();
+void bench_run(bench_t *bench, char *name, bench_fn_t prepare, bench_fn_t run, void *data, size_t bytes_per_run);
+void bench_run_units(bench_t *bench, char *name, bench_fn_t prepare, bench_fn_t run, void *data, size_t bytes_per_run, uint nb_units, char *unit);
+
+#endif
@@ -0,0 +1,169 @@
+//stages of the feature detection app, its main is renamed and never called
+#define main feature_detection_main
+#include "../feature_detection/main.c"
+#undef main
+
+#include "bench.h"
+
+//blurred pyramid of a frame, as built at the start of the main loop of the app, with the buffers of its structure tensors
+typedef struct feature_pyramid_t{
+    image_grayscale_t gray[TOTAL_LEVELS_PYRAMID];
+    image_grayscale_t blurred[TOTAL_LEVELS_PYRAMID];
+    structure_tensor_t tensors[TOTAL_LEVELS_PYRAMID];
+} feature_pyramid_t;
+
+typedef struct features_data_t{
+    feature_pyramid_t pyramids[BENCH_MAX_FRAMES];
+    feature_point_t points[BENCH_MAX_FRAMES][MAX_FEATURE_POINTS];
+    uint nb_points[BENCH_MAX_FRAMES];
+    feature_point_t *fast_points; //every FAST point of the image, not only the strongest ones
+    uint max_fast_points;
+    features_state_t state; //of the app, kept between the runs of the pipeline
+    image_rgb_t scratch; //the points are drawn on a copy of the frame
+} features_data_t;
+
+void build_feature_pyramid(image_rgb_t *img, feature_pyramid_t *pyramid);
+void free_feature_pyramid(feature_pyramid_t *pyramid);
+uint detect_points_pyramid(feature_pyramid_t *pyramid, feature_point_t *points);
+void run_pyramid(bench_t *bench, void *data);
+void run_fast(bench_t *bench, void *data);
+void run_detect(bench_t *bench, void *data);
+void run_track_lk(bench_t *bench, void *data);
+void run_match(bench_t *bench, void *data);
+void run_features_pipeline(bench_t *bench, void *data);
+
+int main(int argc, char **argv){
+    bench_t bench;
+    if(bench_init(&bench, "feature_detection", argc, argv) != 0){
+        return 1;
+    }
+
+    size_t size_gray = bench.width*bench.height;
+    size_t size_rgb = bench.width*bench.height*3;
+
+    init_brief_pattern();
+
+    features_data_t *data = malloc(sizeof(features_data_t));
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        build_feature_pyramid(&bench.rgb[i], &data->pyramids[i]);
+        data->nb_points[i] = detect_points_pyramid(&data->pyramids[i], data->points[i]);
+    }
+    //the number of points changes with the frame, the cost of tracking and matching is given for their mean
+    uint nb_points_mean = 0;
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        nb_points_mean += data->nb_points[i];
+    }
+    nb_points_mean /= bench.nb_frames;
+
+    data->max_fast_points = (bench.width/GRANULARITY_SEARCH+1)*(bench.height/GRANULARITY_SEARCH+1);
+    data->fast_points = malloc(data->max_fast_points*sizeof(feature_point_t));
+    features_state_init(&data->state, bench.width, bench.height);
+    data->scratch.width = bench.width;
+    data->scratch.height = bench.height;
+    data->scratch.img = malloc(size_rgb);
+
+    bench_run(&bench, "pyramid", NULL, run_pyramid, data, size_rgb);
+    bench_run(&bench, "fast", NULL, run_fast, data, size_gray);
+    bench_run(&bench, "detect", NULL, run_detect, data, size_gray);
+    bench_run_units(&bench, "track_lk", NULL, run_track_lk, data, 0, nb_points_mean, "pt");
+    bench_run_units(&bench, "match", NULL, run_match, data, 0, nb_points_mean, "pt");
+    bench_run(&bench, "pipeline", NULL, run_features_pipeline, data, size_rgb);
+
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        free_feature_pyramid(&data->pyramids[i]);
+    }
+    free(data->fast_points);
+    features_state_free(&data->state);
+    free(data->scratch.img);
+    free(data);
+    bench_free(&bench);
+    return 0;
+}
+
+void build_feature_pyramid(image_rgb_t *img, feature_pyramid_t *pyramid){
+    image_convert_to_grayscale(img, &pyramid->gray[0]);
+
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+    {
+        blur_grayscale_image(&pyramid->gray[i], &pyramid->blurred[i], PYRAMID_BLUR);
+
+        if(i < TOTAL_LEVELS_PYRAMID-1){
+            downscale_gray_image(&pyramid->blurred[i], &pyramid->gray[i+1]);
+        }
+
+#if CORNER_RESPONSE != CORNER_RESPONSE_NONE
+        //computed by the detection, on the regions it searches
+        structure_tensor_init(&pyramid->tensors[i], pyramid->blurred[i].width, pyramid->blurred[i].height, CORNER_WINDOW_RADIUS);
+#endif
+    }
+}
+
+void free_feature_pyramid(feature_pyramid_t *pyramid){
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+    {
+        free(pyramid->gray[i].img);
+        free(pyramid->blurred[i].img);
+#if CORNER_RESPONSE != CORNER_RESPONSE_NONE
+        free_structure_tensor(&pyramid->tensors[i]);
+#endif
+    }
+}
+
+//points of a keyframe, on every level of the whole image (the structure tensors are computed on the whole levels)
+uint detect_points_pyramid(feature_pyramid_t *pyramid, feature_point_t *points){
+    uint nb_points = 0;
+
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+    {
+        nb_points += detect_points_level(&pyramid->blurred[i], &pyramid->tensors[i], i, 0, 0, pyramid->blurred[i].width, pyramid->blurred[i].height, &points[nb_points], MAX_POINTS_PER_PYRAMID);
+    }
+
+    return nb_points;
+}
+
+void run_pyramid(bench_t *bench, void *data){
+    feature_pyramid_t pyramid;
+    build_feature_pyramid(&bench->rgb[bench->cur_frame], &pyramid);
+    free_feature_pyramid(&pyramid);
+}
+
+void run_fast(bench_t *bench, void *data){
+    features_data_t *features = data;
+    uint nb_points;
+    find_fast_points(features->pyramids[bench->cur_frame].blurred[0], features->fast_points, &nb_points, GRANULARITY_SEARCH, features->max_fast_points, THRESHOLD_DETECTION);
+}
+
+void run_detect(bench_t *bench, void *data){
+    features_data_t *features = data;
+    feature_point_t points[MAX_FEATURE_POINTS];
+    detect_points_pyramid(&features->pyramids[bench->cur_frame], points);
+}
+
+//the points of the previous frame followed on their pyramid level
+void run_track_lk(bench_t *bench, void *data){
+    features_data_t *features = data;
+    feature_pyramid_t *pyramid_prev = &features->pyramids[bench->prev_frame];
+    feature_pyramid_t *pyramid = &features->pyramids[bench->cur_frame];
+
+    for (size_t ipt = 0; ipt < features->nb_points[bench->prev_frame]; ipt++)
+    {
+        feature_point_t pt = features->points[bench->prev_frame][ipt];
+        track_point_lk(&pyramid_prev->blurred[pt.level], &pyramid->blurred[pt.level], &pt);
+    }
+}
+
+void run_match(bench_t *bench, void *data){
+    features_data_t *features = data;
+    int match_idx[MAX_FEATURE_POINTS];
+    match_feature_points(features->points[bench->prev_frame], features->nb_points[bench->prev_frame], features->points[bench->cur_frame], features->nb_points[bench->cur_frame], bench->width, bench->height, match_idx);
+}
+
+//processing of a frame by the app, without the display
+//its state is kept between the runs, as between the frames: the points are tracked with a keyframe every KEYFRAME_INTERVAL runs
+void run_features_pipeline(bench_t *bench, void *data){
+    features_data_t *features = data;
+    process_frame(&features->state, &bench->rgb[bench->cur_frame], &features->scratch);
+}
@@ -0,0 +1,75 @@
+//stages of the hough line detection app, its main is renamed and never called
+#define main hough_line_detection_main
+#include "../hough_line_detection/main.c"
+#undef main
+
+#include <string.h>
+
+#include "bench.h"
+
+typedef struct hough_data_t{
+    image_grayscale_t canny[BENCH_MAX_FRAMES];
+    image_grayscale32_t hough[BENCH_MAX_FRAMES];
+    image_rgb_t scratch; //the lines are drawn on a copy of the frame
+} hough_data_t;
+
+void prepare_scratch_frame(bench_t *bench, void *data);
+void run_hough_transform(bench_t *bench, void *data);
+void run_inverse_hough_transform(bench_t *bench, void *data);
+void run_hough_pipeline(bench_t *bench, void *data);
+
+int main(int argc, char **argv){
+    bench_t bench;
+    if(bench_init(&bench, "hough_line_detection", argc, argv) != 0){
+        return 1;
+    }
+
+    size_t size_gray = bench.width*bench.height;
+    size_t size_rgb = bench.width*bench.height*3;
+
+    hough_data_t data;
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        get_canny(&bench.gray[i], &data.canny[i]);
+        get_hough_transform(&data.canny[i], &data.hough[i], SIZE_HOUGH_X, SIZE_HOUGH_Y);
+    }
+    data.scratch.width = bench.width;
+    data.scratch.height = bench.height;
+    data.scratch.img = malloc(size_rgb);
+
+    bench_run(&bench, "hough_transform", NULL, run_hough_transform, &data, size_gray);
+    bench_run(&bench, "inverse_hough_transform", prepare_scratch_frame, run_inverse_hough_transform, &data, SIZE_HOUGH_X*SIZE_HOUGH_Y*sizeof(uint32_t));
+    bench_run(&bench, "pipeline", NULL, run_hough_pipeline, &data, size_rgb);
+
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        free(data.canny[i].img);
+        free(data.hough[i].img);
+    }
+    free(data.scratch.img);
+    bench_free(&bench);
+    return 0;
+}
+
+void prepare_scratch_frame(bench_t *bench, void *data){
+    hough_data_t *hough = data;
+    memcpy(hough->scratch.img, bench->rgb[bench->cur_frame].img, bench->width*bench->height*3);
+}
+
+void run_hough_transform(bench_t *bench, void *data){
+    hough_data_t *hough = data;
+    image_grayscale32_t img_hough_trans;
+    get_hough_transform(&hough->canny[bench->cur_frame], &img_hough_trans, SIZE_HOUGH_X, SIZE_HOUGH_Y);
+    free(img_hough_trans.img);
+}
+
+void run_inverse_hough_transform(bench_t *bench, void *data){
+    hough_data_t *hough = data;
+    draw_inverse_hough_transform(&hough->scratch, &hough->hough[bench->cur_frame], bench->height/2);
+}
+
+//processing of a frame by the app, with the copy of the frame the lines are drawn on, without the display
+void run_hough_pipeline(bench_t *bench, void *data){
+    hough_data_t *hough = data;
+    process_frame(&bench->rgb[bench->cur_frame], &hough->scratch);
+}
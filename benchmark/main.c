@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../common/image.h"
+#include "../common/edge_detect.h"
+#include "../common/connected_components.h"
+#include "bench.h"
+
+//kernels of common/, on the input frames converted once to grayscale
+//the intermediate images each kernel starts from are computed before the runs
+
+typedef struct kernels_data_t{
+    image_grayscale_t sobel[BENCH_MAX_FRAMES];
+    image_grayscale_t thin[BENCH_MAX_FRAMES];
+    image_grayscale_t double_thresh[BENCH_MAX_FRAMES];
+    image_grayscale_t canny[BENCH_MAX_FRAMES];
+    image_grayscale_t scratch; //input of the in place kernels, restored before each run
+    uint8_t *block_mask;
+    connected_components_t components;
+} kernels_data_t;
+
+void prepare_scratch_thin(bench_t *bench, void *data);
+void prepare_scratch_double_thresh(bench_t *bench, void *data);
+void run_grayscale(bench_t *bench, void *data);
+void run_grayscale_buffer(bench_t *bench, void *data);
+void run_blur(bench_t *bench, void *data);
+void run_downscale_gaussian(bench_t *bench, void *data);
+void run_integral(bench_t *bench, void *data);
+void run_block_change_mask(bench_t *bench, void *data);
+void run_sobel(bench_t *bench, void *data);
+void run_thinning(bench_t *bench, void *data);
+void run_single_thresholding(bench_t *bench, void *data);
+void run_double_thresholding(bench_t *bench, void *data);
+void run_hysteresis(bench_t *bench, void *data);
+void run_canny(bench_t *bench, void *data);
+void run_connected_components(bench_t *bench, void *data);
+
+int main(int argc, char **argv){
+    bench_t bench;
+    if(bench_init(&bench, "common", argc, argv) != 0){
+        return 1;
+    }
+
+    uint width = bench.width;
+    uint height = bench.height;
+    size_t size_gray = width*height;
+    size_t size_rgb = width*height*3;
+
+    kernels_data_t data;
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        sobel_edge_detect(&bench.gray[i], &data.sobel[i]);
+        edge_thinning(&data.sobel[i], &data.thin[i]);
+
+        data.double_thresh[i] = data.thin[i];
+        data.double_thresh[i].img = malloc(size_gray);
+        memcpy(data.double_thresh[i].img, data.thin[i].img, size_gray);
+        double_thresholding(&data.double_thresh[i], 48, 64, 64, 255);
+
+        get_canny(&bench.gray[i], &data.canny[i]);
+    }
+    data.scratch.width = width;
+    data.scratch.height = height;
+    data.scratch.img = malloc(size_gray);
+    data.block_mask = malloc(((width+31)/32)*((height+31)/32));
+    connected_components_init(&data.components, width, height);
+
+    bench_run(&bench, "grayscale", NULL, run_grayscale, &data, size_rgb);
+    bench_run(&bench, "grayscale_buffer", NULL, run_grayscale_buffer, &data, size_rgb);
+    bench_run(&bench, "blur", NULL, run_blur, &data, size_gray);
+    bench_run(&bench, "downscale_gaussian", NULL, run_downscale_gaussian, &data, size_gray);
+    bench_run(&bench, "integral", NULL, run_integral, &data, size_gray);
+    bench_run(&bench, "block_change_mask", NULL, run_block_change_mask, &data, size_gray*2);
+    bench_run(&bench, "sobel", NULL, run_sobel, &data, size_gray);
+    bench_run(&bench, "thinning", NULL, run_thinning, &data, size_gray);
+    bench_run(&bench, "single_thresholding", prepare_scratch_thin, run_single_thresholding, &data, size_gray);
+    bench_run(&bench, "double_thresholding", prepare_scratch_thin, run_double_thresholding, &data, size_gray);
+    bench_run(&bench, "hysteresis", prepare_scratch_double_thresh, run_hysteresis, &data, size_gray);
+    bench_run(&bench, "canny", NULL, run_canny, &data, size_gray);
+    bench_run(&bench, "connected_components", NULL, run_connected_components, &data, size_gray);
+
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        free(data.sobel[i].img);
+        free(data.thin[i].img);
+        free(data.double_thresh[i].img);
+        free(data.canny[i].img);
+    }
+    free(data.scratch.img);
+    free(data.block_mask);
+    connected_components_free(&data.components);
+    bench_free(&bench);
+    return 0;
+}
+
+void prepare_scratch_thin(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    memcpy(kernels->scratch.img, kernels->thin[bench->cur_frame].img, bench->width*bench->height);
+}
+
+void prepare_scratch_double_thresh(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    memcpy(kernels->scratch.img, kernels->double_thresh[bench->cur_frame].img, bench->width*bench->height);
+}
+
+//the kernels allocating their output are timed with the allocation, as in the apps
+void run_grayscale(bench_t *bench, void *data){
+    image_grayscale_t gray;
+    image_convert_to_grayscale(&bench->rgb[bench->cur_frame], &gray);
+    free(gray.img);
+}
+
+void run_grayscale_buffer(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    image_convert_to_grayscale_buffer(&bench->rgb[bench->cur_frame], &kernels->scratch);
+}
+
+void run_blur(bench_t *bench, void *data){
+    image_grayscale_t blurred;
+    blur_grayscale_image(&bench->gray[bench->cur_frame], &blurred, 1);
+    free(blurred.img);
+}
+
+void run_downscale_gaussian(bench_t *bench, void *data){
+    image_grayscale_t downscaled;
+    downscale_gray_image_gaussian(&bench->gray[bench->cur_frame], &downscaled);
+    free(downscaled.img);
+}
+
+void run_integral(bench_t *bench, void *data){
+    image_integral_t integral;
+    image_integral_compute(&bench->gray[bench->cur_frame], &integral, 1);
+    image_integral_free(&integral);
+}
+
+void run_block_change_mask(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    image_block_change_mask(&bench->gray[bench->cur_frame], &bench->gray[bench->prev_frame], 32, 4, kernels->block_mask);
+}
+
+void run_sobel(bench_t *bench, void *data){
+    image_grayscale_t edges;
+    sobel_edge_detect(&bench->gray[bench->cur_frame], &edges);
+    free(edges.img);
+}
+
+void run_thinning(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    image_grayscale_t thin;
+    edge_thinning(&kernels->sobel[bench->cur_frame], &thin);
+    free(thin.img);
+}
+
+void run_single_thresholding(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    single_thresholding(&kernels->scratch, 48, 255);
+}
+
+void run_double_thresholding(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    double_thresholding(&kernels->scratch, 48, 64, 64, 255);
+}
+
+void run_hysteresis(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    canny_hysteresis(&kernels->scratch, 64, 255);
+}
+
+void run_canny(bench_t *bench, void *data){
+    image_grayscale_t canny;
+    get_canny(&bench->gray[bench->cur_frame], &canny);
+    free(canny.img);
+}
+
+void run_connected_components(bench_t *bench, void *data){
+    kernels_data_t *kernels = data;
+    connected_components_label(&kernels->canny[bench->cur_frame], 0, 8, &kernels->components);
+}
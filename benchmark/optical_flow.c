@@ -0,0 +1,157 @@
+//flow modes of the optical flow app, its main is renamed and never called
+#define main optical_flow_main
+#include "../optical_flow/main.c"
+#undef main
+
+#include "bench.h"
+
+//vectors on the grid of the display of the app
+#define BENCH_GRID_SPACING 10
+
+typedef struct flow_data_t{
+    image_grayscale_t pyramids[BENCH_MAX_FRAMES][PYR_LEVELS];
+    uint nb_grid_points;
+    uint16_t *grid_x;
+    uint16_t *grid_y;
+    float *grid_u_x;
+    float *grid_u_y;
+    motion_vector_t *field;
+    motion_vector_t *prev_field;
+    horn_schunck_t hs;
+    dense_flow_t dense;
+    flow_state_t state; //of the app, kept between the runs of the pipeline
+    image_rgb_t scratch; //the flow is drawn on a copy of the frame
+} flow_data_t;
+
+void run_lk_sparse(bench_t *bench, void *data);
+void run_lk_sparse_batch(bench_t *bench, void *data);
+void run_lk_dense(bench_t *bench, void *data);
+void run_lk_pyramidal(bench_t *bench, void *data);
+void run_block_matching(bench_t *bench, void *data);
+void run_horn_schunck(bench_t *bench, void *data);
+void run_flow_pipeline(bench_t *bench, void *data);
+
+int main(int argc, char **argv){
+    bench_t bench;
+    if(bench_init(&bench, "optical_flow", argc, argv) != 0){
+        return 1;
+    }
+
+    size_t size_gray = bench.width*bench.height;
+    size_t size_rgb = bench.width*bench.height*3;
+
+    flow_data_t *data = malloc(sizeof(flow_data_t));
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        build_gaussian_pyramid(&bench.gray[i], data->pyramids[i], PYR_LEVELS);
+    }
+
+    uint max_grid_points = (bench.width/BENCH_GRID_SPACING)*(bench.height/BENCH_GRID_SPACING);
+    data->grid_x = malloc(max_grid_points*sizeof(uint16_t));
+    data->grid_y = malloc(max_grid_points*sizeof(uint16_t));
+    data->grid_u_x = malloc(max_grid_points*sizeof(float));
+    data->grid_u_y = malloc(max_grid_points*sizeof(float));
+    data->nb_grid_points = 0;
+    for (uint i = BENCH_GRID_SPACING*2; i < bench.width-BENCH_GRID_SPACING*2; i+=BENCH_GRID_SPACING)
+    {
+        for (uint j = BENCH_GRID_SPACING*2; j < bench.height-BENCH_GRID_SPACING*2; j+=BENCH_GRID_SPACING){
+            data->grid_x[data->nb_grid_points] = i;
+            data->grid_y[data->nb_grid_points] = j;
+            data->nb_grid_points++;
+        }
+    }
+
+    uint nb_blocks = (bench.width/BM_BLOCK_SIZE)*(bench.height/BM_BLOCK_SIZE);
+    data->field = calloc(nb_blocks, sizeof(motion_vector_t));
+    data->prev_field = calloc(nb_blocks, sizeof(motion_vector_t));
+    horn_schunck_init(&data->hs, bench.width, bench.height);
+    dense_flow_init(&data->dense, bench.width, bench.height);
+    flow_state_init(&data->state, bench.width, bench.height);
+    data->scratch.width = bench.width;
+    data->scratch.height = bench.height;
+    data->scratch.img = malloc(size_rgb);
+
+    //the sparse modes only read a window around each point of the grid, their cost is given per point
+    //block matching stops its searches early and reads an unknown part of the previous frame, its cost is given per block
+    bench_run_units(&bench, "lk_sparse", NULL, run_lk_sparse, data, 0, data->nb_grid_points, "pt");
+    bench_run_units(&bench, "lk_sparse_batch", NULL, run_lk_sparse_batch, data, 0, data->nb_grid_points, "pt");
+    bench_run(&bench, "lk_dense", NULL, run_lk_dense, data, size_gray*2);
+    bench_run_units(&bench, "lk_pyramidal", NULL, run_lk_pyramidal, data, 0, data->nb_grid_points, "pt");
+    bench_run_units(&bench, "block_matching", NULL, run_block_matching, data, 0, nb_blocks, "blk");
+    bench_run(&bench, "horn_schunck", NULL, run_horn_schunck, data, size_gray*2);
+    bench_run(&bench, "pipeline", NULL, run_flow_pipeline, data, size_rgb);
+
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        free_gaussian_pyramid(data->pyramids[i], PYR_LEVELS);
+    }
+    free(data->grid_x);
+    free(data->grid_y);
+    free(data->grid_u_x);
+    free(data->grid_u_y);
+    free(data->field);
+    free(data->prev_field);
+    dense_flow_free(&data->dense);
+    horn_schunck_free(&data->hs);
+    flow_state_free(&data->state);
+    free(data->scratch.img);
+    free(data);
+    bench_free(&bench);
+    return 0;
+}
+
+void run_lk_sparse(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    for (size_t i = 0; i < flow->nb_grid_points; i++)
+    {
+        calc_optical_flow(&bench->gray[bench->cur_frame], &bench->gray[bench->prev_frame], flow->grid_x[i], flow->grid_y[i], &flow->grid_u_x[i], &flow->grid_u_y[i]);
+    }
+}
+
+void run_lk_sparse_batch(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    calc_optical_flow_batch(&bench->gray[bench->cur_frame], &bench->gray[bench->prev_frame], flow->grid_x, flow->grid_y, flow->nb_grid_points, flow->grid_u_x, flow->grid_u_y);
+}
+
+void run_lk_dense(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    compute_flow_derivatives(&bench->gray[bench->cur_frame], &bench->gray[bench->prev_frame], &flow->dense.deriv);
+    calc_dense_optical_flow(&flow->dense);
+}
+
+//the pyramid of the current frame is built, the one of the previous frame is kept by the app
+void run_lk_pyramidal(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    image_grayscale_t pyramid[PYR_LEVELS];
+    build_gaussian_pyramid(&bench->gray[bench->cur_frame], pyramid, PYR_LEVELS);
+
+    for (size_t i = 0; i < flow->nb_grid_points; i++)
+    {
+        flow_vector_t vector;
+        calc_pyramidal_optical_flow(pyramid, flow->pyramids[bench->prev_frame], PYR_LEVELS, flow->grid_x[i], flow->grid_y[i], &vector);
+    }
+
+    free_gaussian_pyramid(pyramid, PYR_LEVELS);
+}
+
+//the vectors of the previous run are candidates, as between two frames of the app
+void run_block_matching(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    motion_vector_t *field_swap = flow->prev_field;
+    flow->prev_field = flow->field;
+    flow->field = field_swap;
+    block_matching_motion(&bench->gray[bench->cur_frame], &bench->gray[bench->prev_frame], flow->field, flow->prev_field);
+}
+
+//starts from the flow of the previous run
+void run_horn_schunck(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    calc_horn_schunck_flow(&bench->gray[bench->cur_frame], &bench->gray[bench->prev_frame], &flow->hs);
+}
+
+//processing of a frame by the app in its FLOW_MODE, without the display
+//its state is kept between the runs, the flow is computed with the frame of the previous run
+void run_flow_pipeline(bench_t *bench, void *data){
+    flow_data_t *flow = data;
+    process_frame(&flow->state, &bench->rgb[bench->cur_frame], &flow->scratch);
+}
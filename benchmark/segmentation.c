@@ -0,0 +1,112 @@
+//stages of the segmentation app, its main is renamed and never called
+//k-means and slic keep their state between frames, as in the app, and are set up in the warmup runs
+#define main segmentation_main
+#include "../segmentation/main.c"
+#undef main
+
+#include "bench.h"
+
+typedef struct segmentation_data_t{
+    image_rgb_t img_cluster;
+    image_grayscale_t labels[BENCH_MAX_FRAMES];
+    image_grayscale16_t segments[BENCH_MAX_FRAMES];
+    connected_components_t regions;
+} segmentation_data_t;
+
+void run_kmeans(bench_t *bench, void *data);
+void run_slic(bench_t *bench, void *data);
+void run_regions(bench_t *bench, void *data);
+void run_slic_regions(bench_t *bench, void *data);
+void run_segmentation_pipeline(bench_t *bench, void *data);
+
+int main(int argc, char **argv){
+    bench_t bench;
+    if(bench_init(&bench, "segmentation", argc, argv) != 0){
+        return 1;
+    }
+
+    size_t size_gray = bench.width*bench.height;
+    size_t size_rgb = bench.width*bench.height*3;
+
+    segmentation_data_t data;
+    data.img_cluster.width = bench.width;
+    data.img_cluster.height = bench.height;
+    data.img_cluster.img = malloc(size_rgb);
+    connected_components_init(&data.regions, bench.width, bench.height);
+
+    bench_run(&bench, "kmeans", NULL, run_kmeans, &data, size_rgb);
+
+    //the same k-means on a single thread, the labels are the same and the ratio of the medians is the speedup of the threads
+    //with KMEANS_INCREMENTAL most runs are incremental updates, the full updates are timed alone with a full update on every run
+    kmeans_nb_threads = 1;
+    bench_run(&bench, "kmeans_1thread", NULL, run_kmeans, &data, size_rgb);
+    kmeans_incremental_refresh = 0;
+    bench_run(&bench, "kmeans_full_1thread", NULL, run_kmeans, &data, size_rgb);
+    kmeans_nb_threads = KMEANS_NB_THREADS;
+    bench_run(&bench, "kmeans_full", NULL, run_kmeans, &data, size_rgb);
+    kmeans_incremental_refresh = KMEANS_INCREMENTAL_REFRESH;
+
+    //label planes of the k-means after it converged on the frames
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        uint8_t *labels = k_means_clustering(&bench.rgb[i], &data.img_cluster, KMEANS_NB_CLUSTERS, KMEANS_NB_CYCLES);
+        data.labels[i].width = bench.width;
+        data.labels[i].height = bench.height;
+        data.labels[i].img = malloc(size_gray);
+        memcpy(data.labels[i].img, labels, size_gray);
+    }
+
+    bench_run(&bench, "regions", NULL, run_regions, &data, size_gray);
+    bench_run(&bench, "pipeline", NULL, run_segmentation_pipeline, &data, size_rgb);
+    bench_run(&bench, "slic", NULL, run_slic, &data, size_rgb);
+
+    //segment planes of slic after it converged on the frames
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        uint16_t *segments = slic_superpixels(&bench.rgb[i], &data.img_cluster, KMEANS_NB_CYCLES);
+        data.segments[i].width = bench.width;
+        data.segments[i].height = bench.height;
+        data.segments[i].img = malloc(size_gray*sizeof(uint16_t));
+        memcpy(data.segments[i].img, segments, size_gray*sizeof(uint16_t));
+    }
+
+    bench_run(&bench, "slic_regions", NULL, run_slic_regions, &data, size_gray*sizeof(uint16_t));
+
+    for (size_t i = 0; i < bench.nb_frames; i++)
+    {
+        free(data.labels[i].img);
+        free(data.segments[i].img);
+    }
+    free(data.img_cluster.img);
+    connected_components_free(&data.regions);
+    bench_free(&bench);
+    return 0;
+}
+
+void run_kmeans(bench_t *bench, void *data){
+    segmentation_data_t *segmentation = data;
+    k_means_clustering(&bench->rgb[bench->cur_frame], &segmentation->img_cluster, KMEANS_NB_CLUSTERS, KMEANS_NB_CYCLES);
+}
+
+void run_slic(bench_t *bench, void *data){
+    segmentation_data_t *segmentation = data;
+    slic_superpixels(&bench->rgb[bench->cur_frame], &segmentation->img_cluster, KMEANS_NB_CYCLES);
+}
+
+void run_regions(bench_t *bench, void *data){
+    segmentation_data_t *segmentation = data;
+    connected_components_label(&segmentation->labels[bench->cur_frame], COMPONENTS_NO_BACKGROUND, 4, &segmentation->regions);
+    draw_regions(&segmentation->regions, &segmentation->img_cluster, REGION_MIN_AREA);
+}
+
+void run_slic_regions(bench_t *bench, void *data){
+    segmentation_data_t *segmentation = data;
+    connected_components_label16(&segmentation->segments[bench->cur_frame], COMPONENTS_NO_BACKGROUND, 4, &segmentation->regions);
+    draw_regions(&segmentation->regions, &segmentation->img_cluster, SLIC_REGION_MIN_AREA);
+}
+
+//processing of a frame by the app, without the display
+void run_segmentation_pipeline(bench_t *bench, void *data){
+    segmentation_data_t *segmentation = data;
+    process_frame(&bench->rgb[bench->cur_frame], &segmentation->img_cluster, &segmentation->regions);
+}
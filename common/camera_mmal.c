@@ -1,5 +1,8 @@
 #include "camera_mmal.h"
 
+//posted by output_callback for each frame received
+sem_t semaphore_cam_buffer;
+
 void framebuffer_init(char **framebuffer_out, uint *screen_size_x, uint *screen_size_y){
 
     struct fb_var_screeninfo vinfo;
@@ -27,7 +27,7 @@
 //source: https://github.com/raspberrypi/userland/blob/master/interface/mmal/test/examples/example_basic_2.c
 #define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n\r");}
 
-sem_t semaphore_cam_buffer;
+extern sem_t semaphore_cam_buffer;
 
 void framebuffer_init(char **framebuffer_out, uint *screen_size_x, uint *screen_size_y);
 void camera_mmal_init(MMAL_PORT_T **video_port, MMAL_POOL_T **pool, uint camera_resolution_x, uint camera_resolution_y, uint shutter_speed, uint framerate, uint awb_mode);
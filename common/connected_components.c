@@ -0,0 +1,280 @@
+#include "connected_components.h"
+
+#include <stdlib.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+void connected_components_init(connected_components_t *components, int width, int height){
+    uint max_runs = width*height;
+
+    components->width = width;
+    components->height = height;
+    components->nb_runs = 0;
+    components->run_start = malloc(max_runs*sizeof(uint16_t));
+    components->run_end = malloc(max_runs*sizeof(uint16_t));
+    components->run_value = malloc(max_runs*sizeof(uint16_t));
+    components->run_parent = malloc(max_runs*sizeof(uint32_t));
+    components->run_component = malloc(max_runs*sizeof(uint32_t));
+    components->row_first_run = malloc((height+1)*sizeof(uint32_t));
+    components->nb_components = 0;
+    components->components = malloc(max_runs*sizeof(component_t));
+}
+
+void connected_components_free(connected_components_t *components){
+    free(components->run_start);
+    free(components->run_end);
+    free(components->run_value);
+    free(components->run_parent);
+    free(components->run_component);
+    free(components->row_first_run);
+    free(components->components);
+}
+
+//root of a run, with path compression
+uint32_t components_find_root(uint32_t *parent, uint32_t run){
+    uint32_t root = run;
+    while(parent[root] != root){
+        root = parent[root];
+    }
+
+    while(parent[run] != root){
+        uint32_t next = parent[run];
+        parent[run] = root;
+        run = next;
+    }
+
+    return root;
+}
+
+//the lowest run stays the root, so the components come in the raster order of their first pixel
+void components_union_runs(uint32_t *parent, uint32_t run_a, uint32_t run_b){
+    uint32_t root_a = components_find_root(parent, run_a);
+    uint32_t root_b = components_find_root(parent, run_b);
+
+    if(root_a < root_b){
+        parent[root_b] = root_a;
+    }
+    else if(root_b < root_a){
+        parent[root_a] = root_b;
+    }
+}
+
+//runs of a row, the pixels with the background value are skipped (with neon, by blocks of 16)
+void components_extract_row_runs(uint8_t *row, int width, int background, connected_components_t *components){
+    int x = 0;
+    while(x < width){
+        uint8_t value = row[x];
+
+        if(value == background){
+#ifdef __ARM_NEON
+            uint8x16_t background_16 = vdupq_n_u8(background);
+            while(x+16 <= width){
+                uint8x16_t not_background = vmvnq_u8(vceqq_u8(vld1q_u8(&row[x]), background_16));
+                uint64x2_t any = vreinterpretq_u64_u8(not_background);
+                if((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) != 0){
+                    break;
+                }
+                x += 16;
+            }
+#endif
+            while(x < width && row[x] == background){
+                x++;
+            }
+            continue;
+        }
+
+        uint run = components->nb_runs++;
+        components->run_start[run] = x;
+        components->run_value[run] = value;
+        components->run_parent[run] = run;
+
+        while(x < width && row[x] == value){
+            x++;
+        }
+        components->run_end[run] = x;
+    }
+}
+
+//same for a row of a 16bits plane
+void components_extract_row_runs16(uint16_t *row, int width, int background, connected_components_t *components){
+    int x = 0;
+    while(x < width){
+        uint16_t value = row[x];
+
+        if(value == background){
+            while(x < width && row[x] == background){
+                x++;
+            }
+            continue;
+        }
+
+        uint run = components->nb_runs++;
+        components->run_start[run] = x;
+        components->run_value[run] = value;
+        components->run_parent[run] = run;
+
+        while(x < width && row[x] == value){
+            x++;
+        }
+        components->run_end[run] = x;
+    }
+}
+
+//merges the runs of row y with the overlapping runs of the same value in the previous row
+//with diagonal = 1 (8 connectivity), runs touching by a corner are also connected
+void components_merge_row(connected_components_t *components, int y, int diagonal){
+    if(y == 0){
+        return;
+    }
+
+    //both rows are sorted by x, the first run of the previous row that can overlap only moves forward
+    uint prev_run = components->row_first_run[y-1];
+    uint prev_end = components->row_first_run[y];
+    for (uint run = components->row_first_run[y]; run < components->nb_runs; run++)
+    {
+        int start = components->run_start[run];
+        int end = components->run_end[run];
+
+        while(prev_run < prev_end && components->run_end[prev_run]+diagonal <= start){
+            prev_run++;
+        }
+
+        for (uint other = prev_run; other < prev_end && components->run_start[other] < end+diagonal; other++)
+        {
+            if(components->run_value[other] == components->run_value[run]){
+                components_union_runs(components->run_parent, other, run);
+            }
+        }
+    }
+}
+
+//statistics of the components from the merged runs of the rows, returns the number of components
+uint components_from_runs(connected_components_t *components, int height){
+    //the roots become the components, a root always comes before the other runs of its component
+    uint nb_components = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (uint run = components->row_first_run[y]; run < components->row_first_run[y+1]; run++)
+        {
+            uint32_t root = components_find_root(components->run_parent, run);
+            component_t *component;
+
+            if(root == run){
+                components->run_component[run] = nb_components;
+                component = &components->components[nb_components++];
+                component->value = components->run_value[run];
+                component->area = 0;
+                component->min_x = components->run_start[run];
+                component->max_x = components->run_end[run]-1;
+                component->min_y = y;
+                component->max_y = y;
+                component->sum_x = 0;
+                component->sum_y = 0;
+            }
+            else{
+                components->run_component[run] = components->run_component[root];
+                component = &components->components[components->run_component[run]];
+            }
+
+            uint start = components->run_start[run];
+            uint end = components->run_end[run];
+            uint length = end-start;
+
+            component->area += length;
+            //sum of start..end-1
+            component->sum_x += (uint64_t)(start+end-1)*length/2;
+            component->sum_y += (uint64_t)y*length;
+            if(start < component->min_x){
+                component->min_x = start;
+            }
+            if(end-1 > component->max_x){
+                component->max_x = end-1;
+            }
+            component->max_y = y;
+        }
+    }
+
+    for (uint i = 0; i < nb_components; i++)
+    {
+        components->components[i].centroid_x = (float)components->components[i].sum_x/components->components[i].area;
+        components->components[i].centroid_y = (float)components->components[i].sum_y/components->components[i].area;
+    }
+
+    components->nb_components = nb_components;
+    return nb_components;
+}
+
+//labels the connected components of an image (4 or 8 connectivity) with one read of the image:
+//the runs of each row are merged with the overlapping runs of the same value in the previous row,
+//then the statistics of each component are accumulated from its runs
+//with background = COMPONENTS_NO_BACKGROUND every pixel belongs to a component (label planes of a segmentation),
+//otherwise the pixels with that value are ignored (binary masks, edges)
+//returns the number of components
+uint connected_components_label(image_grayscale_t *img, int background, uint connectivity, connected_components_t *components){
+    int width = img->width;
+    int height = img->height;
+    int diagonal = connectivity == 8 ? 1 : 0;
+
+    components->nb_runs = 0;
+
+    for (int y = 0; y < height; y++)
+    {
+        components->row_first_run[y] = components->nb_runs;
+        components_extract_row_runs(&img->img[y*width], width, background, components);
+        components_merge_row(components, y, diagonal);
+    }
+    components->row_first_run[height] = components->nb_runs;
+
+    return components_from_runs(components, height);
+}
+
+//same for a 16bits plane (superpixels)
+uint connected_components_label16(image_grayscale16_t *img, int background, uint connectivity, connected_components_t *components){
+    int width = img->width;
+    int height = img->height;
+    int diagonal = connectivity == 8 ? 1 : 0;
+
+    components->nb_runs = 0;
+
+    for (int y = 0; y < height; y++)
+    {
+        components->row_first_run[y] = components->nb_runs;
+        components_extract_row_runs16(&img->img[y*width], width, background, components);
+        components_merge_row(components, y, diagonal);
+    }
+    components->row_first_run[height] = components->nb_runs;
+
+    return components_from_runs(components, height);
+}
+
+//index of the component of each pixel, the background pixels are set to UINT32_MAX
+//labels must already hold width*height values
+void connected_components_draw(connected_components_t *components, image_grayscale32_t *labels){
+    int width = components->width;
+
+    for (int y = 0; y < components->height; y++)
+    {
+        uint32_t *row = &labels->img[y*width];
+        int x = 0;
+
+        for (uint run = components->row_first_run[y]; run < components->row_first_run[y+1]; run++)
+        {
+            for (; x < components->run_start[run]; x++)
+            {
+                row[x] = UINT32_MAX;
+            }
+            uint32_t component = components->run_component[run];
+            for (; x < components->run_end[run]; x++)
+            {
+                row[x] = component;
+            }
+        }
+
+        for (; x < width; x++)
+        {
+            row[x] = UINT32_MAX;
+        }
+    }
+}
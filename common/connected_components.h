@@ -0,0 +1,49 @@
+#ifndef CONNECTED_COMPONENTS_H
+#define CONNECTED_COMPONENTS_H
+
+#include "image.h"
+
+//pixels of a component all have the same value, and with a background value those pixels are ignored (binary masks)
+#define COMPONENTS_NO_BACKGROUND -1
+
+//statistics of a connected component, the bounding box includes its max coordinates
+typedef struct component_t{
+    uint16_t value;
+    uint area;
+    uint16_t min_x;
+    uint16_t min_y;
+    uint16_t max_x;
+    uint16_t max_y;
+    uint64_t sum_x; //a component covering a 4k frame overflows 32bits
+    uint64_t sum_y;
+    float centroid_x;
+    float centroid_y;
+} component_t;
+
+//rows encoded as runs of pixels with the same value, merged with a union-find on the runs
+//the buffers are allocated once for the worst case (one run per pixel, and one component per run):
+//14 bytes per pixel for the runs and width*height*sizeof(component_t) (40 bytes per pixel) for the components,
+//16MB at 640x480 of which 12MB are the components
+typedef struct connected_components_t{
+    int width;
+    int height;
+
+    uint nb_runs;
+    uint16_t *run_start;
+    uint16_t *run_end; //excluded
+    uint16_t *run_value; //8 or 16bits planes
+    uint32_t *run_parent;
+    uint32_t *run_component;
+    uint32_t *row_first_run; //height+1 entries, the runs of row y are [row_first_run[y], row_first_run[y+1])
+
+    uint nb_components;
+    component_t *components; //in the raster order of their first pixel
+} connected_components_t;
+
+void connected_components_init(connected_components_t *components, int width, int height);
+void connected_components_free(connected_components_t *components);
+uint connected_components_label(image_grayscale_t *img, int background, uint connectivity, connected_components_t *components);
+uint connected_components_label16(image_grayscale16_t *img, int background, uint connectivity, connected_components_t *components);
+void connected_components_draw(connected_components_t *components, image_grayscale32_t *labels);
+
+#endif
@@ -57,9 +57,9 @@ void sobel_edge_detect(image_grayscale_t *img_in, image_grayscale_t *out){
 
     memset(out->img, 0, out->width*out->height);
 
-    //temporary matrices
-    int *temp_mat_x = malloc(out->width*out->height*sizeof(int));
-    int *temp_mat_y = malloc(out->width*out->height*sizeof(int));
+    //temporary matrices, the first slice is accumulated on zeroes
+    int *temp_mat_x = calloc(out->width*out->height, sizeof(int));
+    int *temp_mat_y = calloc(out->width*out->height, sizeof(int));
 
     //calculate first slice of the separated matrix
     for(int j = 1; j < out->height-1; j++)
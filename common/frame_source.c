@@ -0,0 +1,141 @@
+#include "frame_source.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef FRAME_SOURCE_NO_CAMERA
+void frame_source_camera_init(frame_source_t *source, uint width, uint height, uint shutter_speed, uint framerate, uint awb_mode){
+    source->type = FRAME_SOURCE_CAMERA;
+    source->width = width;
+    source->height = height;
+    source->bytes_per_pixel = 3;
+    source->writable = 1;
+    source->buffer = NULL;
+    source->file_data = NULL;
+    source->file_size = 0;
+
+    camera_mmal_init(&source->video_port, &source->pool, width, height, shutter_speed, framerate, awb_mode);
+}
+#endif
+
+//maps a raw sequence, a framerate of 0 gives the frames as fast as the app asks for them
+//returns 0 on success, -1 if the file can't be opened or doesn't hold a single full frame
+int frame_source_replay_init(frame_source_t *source, char *filename, uint width, uint height, uint bytes_per_pixel, float framerate, uint loop){
+    source->type = FRAME_SOURCE_REPLAY;
+    source->width = width;
+    source->height = height;
+    source->bytes_per_pixel = bytes_per_pixel;
+    source->writable = 0;
+    source->file_data = NULL;
+    source->file_size = 0;
+    source->nb_frames = 0;
+    source->cur_frame = 0;
+    source->loop = loop;
+    source->frame_period_ns = framerate > 0.0f ? (long)(1e9f/framerate) : 0;
+#ifndef FRAME_SOURCE_NO_CAMERA
+    source->buffer = NULL;
+#endif
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "could not open %s\n\r", filename);
+        return -1;
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0){
+        fprintf(stderr, "could not stat %s\n\r", filename);
+        close(fd);
+        return -1;
+    }
+
+    size_t frame_size = (size_t)width*height*bytes_per_pixel;
+    uint nb_frames = file_stat.st_size/frame_size;
+    if(nb_frames == 0){
+        fprintf(stderr, "%s is smaller than a %dx%dx%d frame\n\r", filename, width, height, bytes_per_pixel);
+        close(fd);
+        return -1;
+    }
+
+    //read only mapping, a frame written by an app would keep its drawings when the sequence loops
+    uint8_t *file_data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file_data == MAP_FAILED){
+        fprintf(stderr, "could not map %s\n\r", filename);
+        return -1;
+    }
+    madvise(file_data, file_stat.st_size, MADV_SEQUENTIAL);
+
+    source->file_data = file_data;
+    source->file_size = file_stat.st_size;
+    source->nb_frames = nb_frames;
+    clock_gettime(CLOCK_MONOTONIC, &source->next_frame_time);
+
+    return 0;
+}
+
+//blocks until the next frame is available, the frame stays valid until frame_source_release
+//a replayed frame must not be written (read only mapping), the apps draw on a copy when the source isn't writable
+//returns NULL at the end of a sequence which doesn't loop
+uint8_t *frame_source_get(frame_source_t *source){
+#ifndef FRAME_SOURCE_NO_CAMERA
+    if(source->type == FRAME_SOURCE_CAMERA){
+        //wait until a buffer has been received
+        sem_wait(&semaphore_cam_buffer);
+        source->buffer = mmal_queue_get(source->pool->queue);
+        return source->buffer->data;
+    }
+#endif
+
+    if(source->cur_frame == source->nb_frames){
+        if(!source->loop){
+            return NULL;
+        }
+        source->cur_frame = 0;
+    }
+
+    //absolute deadlines so the rate doesn't drift, an app slower than the rate isn't given the missed frames
+    //in a burst, the period restarts from now like a camera dropping frames
+    if(source->frame_period_ns > 0){
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &source->next_frame_time, NULL);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long late_ns = (now.tv_sec - source->next_frame_time.tv_sec)*1000000000L + (now.tv_nsec - source->next_frame_time.tv_nsec);
+        if(late_ns > source->frame_period_ns){
+            source->next_frame_time = now;
+        }
+        source->next_frame_time.tv_nsec += source->frame_period_ns;
+        while(source->next_frame_time.tv_nsec >= 1000000000L){
+            source->next_frame_time.tv_nsec -= 1000000000L;
+            source->next_frame_time.tv_sec++;
+        }
+    }
+
+    size_t frame_size = (size_t)source->width*source->height*source->bytes_per_pixel;
+    uint8_t *frame = source->file_data + (size_t)source->cur_frame*frame_size;
+    source->cur_frame++;
+
+    return frame;
+}
+
+//gives the frame back to the source, the camera can fill its buffer again
+void frame_source_release(frame_source_t *source){
+#ifndef FRAME_SOURCE_NO_CAMERA
+    if(source->type == FRAME_SOURCE_CAMERA){
+        if(source->buffer != NULL){
+            mmal_port_send_buffer(source->video_port, source->buffer);
+            source->buffer = NULL;
+        }
+        return;
+    }
+#endif
+}
+
+void frame_source_free(frame_source_t *source){
+    if(source->type == FRAME_SOURCE_REPLAY && source->file_data != NULL){
+        munmap(source->file_data, source->file_size);
+        source->file_data = NULL;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+//the camera backend needs the mmal libraries, build with -DFRAME_SOURCE_NO_CAMERA to only keep the replay backend
+//so the apps and the benchmarks can run off the raspberry pi
+#ifndef FRAME_SOURCE_NO_CAMERA
+#include "camera_mmal.h"
+#endif
+
+#define FRAME_SOURCE_CAMERA 0
+#define FRAME_SOURCE_REPLAY 1
+
+//where the frames of an app come from, either the camera or a recorded raw sequence
+//raw sequences are frames of width*height*bytes_per_pixel bytes without header put one after the other,
+//as written by save_image_rgb_to_file/save_image_grayscale_to_file, and are read through a read only mapping of the file
+typedef struct frame_source_t{
+    uint type;
+    uint width;
+    uint height;
+    uint bytes_per_pixel;
+    uint writable; //the frames can be drawn on in place (camera buffers), a replayed frame is read only
+
+#ifndef FRAME_SOURCE_NO_CAMERA
+    MMAL_PORT_T *video_port;
+    MMAL_POOL_T *pool;
+    MMAL_BUFFER_HEADER_T *buffer; //buffer given to the app, until released
+#endif
+
+    uint8_t *file_data;
+    size_t file_size;
+    uint nb_frames;
+    uint cur_frame;
+    uint loop; //restarts from the first frame at the end of the sequence
+    long frame_period_ns; //0 to give the frames as fast as possible
+    struct timespec next_frame_time;
+} frame_source_t;
+
+#ifndef FRAME_SOURCE_NO_CAMERA
+void frame_source_camera_init(frame_source_t *source, uint width, uint height, uint shutter_speed, uint framerate, uint awb_mode);
+#endif
+int frame_source_replay_init(frame_source_t *source, char *filename, uint width, uint height, uint bytes_per_pixel, float framerate, uint loop);
+uint8_t *frame_source_get(frame_source_t *source);
+void frame_source_release(frame_source_t *source);
+void frame_source_free(frame_source_t *source);
+
+#endif
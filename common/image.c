@@ -4,6 +4,12 @@
 #include <string.h>
 #include <stdio.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 inline uint8_t image_get(image_rgb_t *img, int x, int y, int channel){
     return img->img[ (y*img->width+x)*3+channel ];
 }
@@ -90,24 +96,107 @@ void image_draw_grayscale(image_grayscale_t *img, char *framebuffer, uint frameb
 }
 
 void image_convert_to_grayscale(image_rgb_t *source, image_grayscale_t *dest){
+    dest->img = malloc(source->width*source->height);
+
+    image_convert_to_grayscale_buffer(source, dest);
+}
+
+//same as image_convert_to_grayscale, without allocation, dest->img must already hold width*height pixels
+void image_convert_to_grayscale_buffer(image_rgb_t *source, image_grayscale_t *dest){
     dest->width = source->width;
     dest->height = source->height;
 
-    dest->img = malloc(dest->width*dest->width);
-
     for (size_t i = 0; i < source->height; i++)
     {
-        for (size_t j = 0; j < source->width; j++)
+        image_convert_row_to_grayscale(&source->img[i*source->width*3], &dest->img[i*dest->width], source->width);
+    }
+}
+
+void image_convert_row_to_grayscale(uint8_t *source, uint8_t *dest, uint nb_pixels){
+    for (size_t j = 0; j < nb_pixels; j++)
+    {
+        //classical luminance calculation, without floats
+        uint dst = source[j*3]*76+source[j*3+1]*150+source[j*3+2]*29;
+        dest[j] = (uint8_t)(dst/255);
+    }
+}
+
+//the plane is allocated once, image_grayscale_lazy_reset must be called for each new rgb image
+void image_grayscale_lazy_init(image_grayscale_lazy_t *lazy, int width, int height){
+    lazy->source = NULL;
+    lazy->gray.width = width;
+    lazy->gray.height = height;
+    lazy->gray.img = malloc(width*height);
+    lazy->tiles_x = (width+GRAY_TILE_SIZE-1)/GRAY_TILE_SIZE;
+    lazy->tiles_y = (height+GRAY_TILE_SIZE-1)/GRAY_TILE_SIZE;
+    lazy->converted = calloc((lazy->tiles_x*lazy->tiles_y+31)/32, sizeof(uint32_t));
+}
+
+void image_grayscale_lazy_free(image_grayscale_lazy_t *lazy){
+    free(lazy->gray.img);
+    free(lazy->converted);
+}
+
+//new source image, no tile is converted yet
+//the rgb image must stay valid as long as tiles are accessed
+void image_grayscale_lazy_reset(image_grayscale_lazy_t *lazy, image_rgb_t *source){
+    lazy->source = source;
+    memset(lazy->converted, 0, (lazy->tiles_x*lazy->tiles_y+31)/32*sizeof(uint32_t));
+}
+
+void image_grayscale_lazy_convert_tile(image_grayscale_lazy_t *lazy, uint tile_x, uint tile_y){
+    uint tile = tile_y*lazy->tiles_x+tile_x;
+    if(lazy->converted[tile/32]&(1u<<(tile%32))){
+        return;
+    }
+    lazy->converted[tile/32] |= 1u<<(tile%32);
+
+    int width = lazy->gray.width;
+    int x = tile_x*GRAY_TILE_SIZE;
+    int y = tile_y*GRAY_TILE_SIZE;
+    int size_x = x+GRAY_TILE_SIZE <= width ? GRAY_TILE_SIZE : width-x;
+    int end_y = y+GRAY_TILE_SIZE <= lazy->gray.height ? y+GRAY_TILE_SIZE : lazy->gray.height;
+
+    for (; y < end_y; y++)
+    {
+        image_convert_row_to_grayscale(&lazy->source->img[(y*width+x)*3], &lazy->gray.img[y*width+x], size_x);
+    }
+}
+
+//converts the tiles covering the rectangle (clipped to the image), its pixels can then be read directly in lazy->gray
+void image_grayscale_lazy_prefetch(image_grayscale_lazy_t *lazy, int x, int y, int size_x, int size_y){
+    int start_x = x < 0 ? 0 : x;
+    int start_y = y < 0 ? 0 : y;
+    int end_x = x+size_x < lazy->gray.width ? x+size_x : lazy->gray.width;
+    int end_y = y+size_y < lazy->gray.height ? y+size_y : lazy->gray.height;
+
+    if(start_x >= end_x || start_y >= end_y){
+        return;
+    }
+
+    for (int tile_y = start_y/GRAY_TILE_SIZE; tile_y <= (end_y-1)/GRAY_TILE_SIZE; tile_y++)
+    {
+        for (int tile_x = start_x/GRAY_TILE_SIZE; tile_x <= (end_x-1)/GRAY_TILE_SIZE; tile_x++)
         {
-            uint idx_source = (i*dest->width+j)*3;
-            uint idx_dest = i*dest->width+j;
-            //classical luminance calculation, without floats
-            uint dst = source->img[idx_source]*76+source->img[idx_source+1]*150+source->img[idx_source+2]*29;
-            dest->img[idx_dest] = (uint8_t)(dst/255);
+            image_grayscale_lazy_convert_tile(lazy, tile_x, tile_y);
         }
     }
 }
 
+//prefetch of the square windows of the given radius around a set of points
+void image_grayscale_lazy_prefetch_windows(image_grayscale_lazy_t *lazy, int *pos_x, int *pos_y, uint nb_points, int radius){
+    for (uint i = 0; i < nb_points; i++)
+    {
+        image_grayscale_lazy_prefetch(lazy, pos_x[i]-radius, pos_y[i]-radius, 2*radius+1, 2*radius+1);
+    }
+}
+
+//single pixel access, converts its tile if needed
+uint8_t image_grayscale_lazy_get(image_grayscale_lazy_t *lazy, int x, int y){
+    image_grayscale_lazy_convert_tile(lazy, x/GRAY_TILE_SIZE, y/GRAY_TILE_SIZE);
+    return lazy->gray.img[y*lazy->gray.width+x];
+}
+
 //use a simple box blur filter
 //use fact box filter is seperable to compute in two steps
 void blur_grayscale_image(image_grayscale_t *image_source, image_grayscale_t *image_dest, uint kernel_size){
@@ -171,6 +260,405 @@ void downscale_gray_image(image_grayscale_t *image_source, image_grayscale_t *im
     }
 }
 
+//gaussian pyramid step: 5x5 binomial filter (1 4 6 4 1) then divides by two on each axis the resolution
+//the border pixels are repeated outside of the image
+void downscale_gray_image_gaussian(image_grayscale_t *image_source, image_grayscale_t *image_dest){
+    image_dest->height = image_source->height/2;
+    image_dest->width = image_source->width/2;
+    image_dest->img = malloc(image_dest->width*image_dest->height);
+
+    int width = image_source->width;
+    int height = image_source->height;
+
+    //vertically filtered row, at most 16*255
+    uint16_t *row_filtered = malloc(width*sizeof(uint16_t));
+
+    for (int y = 0; y < image_dest->height; y++)
+    {
+        uint8_t *rows[5];
+        for (int k = 0; k < 5; k++)
+        {
+            int sy = 2*y+k-2;
+            if(sy < 0){
+                sy = 0;
+            }
+            if(sy >= height){
+                sy = height-1;
+            }
+            rows[k] = &image_source->img[sy*width];
+        }
+
+        int x = 0;
+#ifdef __ARM_NEON
+        for (; x+8 <= width; x+=8)
+        {
+            uint16x8_t acc = vaddl_u8(vld1_u8(&rows[0][x]), vld1_u8(&rows[4][x]));
+            acc = vmlal_u8(acc, vld1_u8(&rows[1][x]), vdup_n_u8(4));
+            acc = vmlal_u8(acc, vld1_u8(&rows[2][x]), vdup_n_u8(6));
+            acc = vmlal_u8(acc, vld1_u8(&rows[3][x]), vdup_n_u8(4));
+            vst1q_u16(&row_filtered[x], acc);
+        }
+#endif
+        for (; x < width; x++)
+        {
+            row_filtered[x] = rows[0][x]+4*rows[1][x]+6*rows[2][x]+4*rows[3][x]+rows[4][x];
+        }
+
+        for (int dx = 0; dx < image_dest->width; dx++)
+        {
+            int sx = 2*dx;
+            int x_m2 = sx-2 < 0 ? 0 : sx-2;
+            int x_m1 = sx-1 < 0 ? 0 : sx-1;
+            int x_p1 = sx+1 >= width ? width-1 : sx+1;
+            int x_p2 = sx+2 >= width ? width-1 : sx+2;
+
+            uint total = row_filtered[x_m2]+4*row_filtered[x_m1]+6*row_filtered[sx]+4*row_filtered[x_p1]+row_filtered[x_p2];
+            image_grayscale_set(image_dest, dx, y, (total+128)>>8);
+        }
+    }
+
+    free(row_filtered);
+}
+
+//builds the summed-area table (and optionally the summed squares) in a single pass over the image
+//each row is prefix summed and added to the previous row of the table
+void image_integral_compute(image_grayscale_t *source, image_integral_t *dest, uint with_squares){
+    dest->width = source->width;
+    dest->height = source->height;
+
+    uint stride = source->width+1;
+    dest->sum = malloc(stride*(source->height+1)*sizeof(uint32_t));
+    dest->sum_sq = NULL;
+    if(with_squares){
+        dest->sum_sq = malloc(stride*(source->height+1)*sizeof(uint32_t));
+        memset(dest->sum_sq, 0, stride*sizeof(uint32_t));
+    }
+
+    memset(dest->sum, 0, stride*sizeof(uint32_t));
+
+    for (int y = 0; y < source->height; y++)
+    {
+        uint8_t *src = &source->img[y*source->width];
+        uint32_t *prev = &dest->sum[y*stride+1];
+        uint32_t *cur = &dest->sum[(y+1)*stride+1];
+        uint32_t *prev_sq = NULL;
+        uint32_t *cur_sq = NULL;
+        if(with_squares){
+            prev_sq = &dest->sum_sq[y*stride+1];
+            cur_sq = &dest->sum_sq[(y+1)*stride+1];
+            cur_sq[-1] = 0;
+        }
+        cur[-1] = 0;
+
+        uint32_t row_sum = 0;
+        uint32_t row_sum_sq = 0;
+        int x = 0;
+
+#ifdef __ARM_NEON
+        //prefix sum of 8 pixels in registers by adding shifted copies of the vector
+        const uint16x8_t zero16 = vdupq_n_u16(0);
+        const uint32x4_t zero32 = vdupq_n_u32(0);
+        for (; x+8 <= source->width; x+=8)
+        {
+            uint16x8_t pix = vmovl_u8(vld1_u8(&src[x]));
+
+            uint16x8_t pref = vaddq_u16(pix, vextq_u16(zero16, pix, 7));
+            pref = vaddq_u16(pref, vextq_u16(zero16, pref, 6));
+            pref = vaddq_u16(pref, vextq_u16(zero16, pref, 4));
+
+            uint32x4_t carry = vdupq_n_u32(row_sum);
+            uint32x4_t lo = vaddq_u32(vmovl_u16(vget_low_u16(pref)), carry);
+            uint32x4_t hi = vaddq_u32(vmovl_u16(vget_high_u16(pref)), carry);
+            row_sum = vgetq_lane_u32(hi, 3);
+
+            vst1q_u32(&cur[x], vaddq_u32(lo, vld1q_u32(&prev[x])));
+            vst1q_u32(&cur[x+4], vaddq_u32(hi, vld1q_u32(&prev[x+4])));
+
+            if(with_squares){
+                uint32x4_t sq_lo = vmull_u16(vget_low_u16(pix), vget_low_u16(pix));
+                uint32x4_t sq_hi = vmull_u16(vget_high_u16(pix), vget_high_u16(pix));
+
+                sq_lo = vaddq_u32(sq_lo, vextq_u32(zero32, sq_lo, 3));
+                sq_lo = vaddq_u32(sq_lo, vextq_u32(zero32, sq_lo, 2));
+                sq_hi = vaddq_u32(sq_hi, vextq_u32(zero32, sq_hi, 3));
+                sq_hi = vaddq_u32(sq_hi, vextq_u32(zero32, sq_hi, 2));
+
+                sq_lo = vaddq_u32(sq_lo, vdupq_n_u32(row_sum_sq));
+                sq_hi = vaddq_u32(sq_hi, vdupq_n_u32(vgetq_lane_u32(sq_lo, 3)));
+                row_sum_sq = vgetq_lane_u32(sq_hi, 3);
+
+                vst1q_u32(&cur_sq[x], vaddq_u32(sq_lo, vld1q_u32(&prev_sq[x])));
+                vst1q_u32(&cur_sq[x+4], vaddq_u32(sq_hi, vld1q_u32(&prev_sq[x+4])));
+            }
+        }
+#elif defined(__SSE2__)
+        //same prefix sum, the byte shifts of the whole register give the shifted copies
+        const __m128i zero = _mm_setzero_si128();
+        for (; x+8 <= source->width; x+=8)
+        {
+            __m128i pix = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&src[x]), zero);
+
+            __m128i pref = _mm_add_epi16(pix, _mm_slli_si128(pix, 2));
+            pref = _mm_add_epi16(pref, _mm_slli_si128(pref, 4));
+            pref = _mm_add_epi16(pref, _mm_slli_si128(pref, 8));
+
+            __m128i carry = _mm_set1_epi32(row_sum);
+            __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(pref, zero), carry);
+            __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(pref, zero), carry);
+            row_sum = _mm_cvtsi128_si32(_mm_shuffle_epi32(hi, 0xFF));
+
+            _mm_storeu_si128((__m128i*)&cur[x], _mm_add_epi32(lo, _mm_loadu_si128((__m128i*)&prev[x])));
+            _mm_storeu_si128((__m128i*)&cur[x+4], _mm_add_epi32(hi, _mm_loadu_si128((__m128i*)&prev[x+4])));
+
+            if(with_squares){
+                //255*255 still fits in 16bits, the low half of the product is the square
+                __m128i sq = _mm_mullo_epi16(pix, pix);
+                __m128i sq_lo = _mm_unpacklo_epi16(sq, zero);
+                __m128i sq_hi = _mm_unpackhi_epi16(sq, zero);
+
+                sq_lo = _mm_add_epi32(sq_lo, _mm_slli_si128(sq_lo, 4));
+                sq_lo = _mm_add_epi32(sq_lo, _mm_slli_si128(sq_lo, 8));
+                sq_hi = _mm_add_epi32(sq_hi, _mm_slli_si128(sq_hi, 4));
+                sq_hi = _mm_add_epi32(sq_hi, _mm_slli_si128(sq_hi, 8));
+
+                sq_lo = _mm_add_epi32(sq_lo, _mm_set1_epi32(row_sum_sq));
+                sq_hi = _mm_add_epi32(sq_hi, _mm_shuffle_epi32(sq_lo, 0xFF));
+                row_sum_sq = _mm_cvtsi128_si32(_mm_shuffle_epi32(sq_hi, 0xFF));
+
+                _mm_storeu_si128((__m128i*)&cur_sq[x], _mm_add_epi32(sq_lo, _mm_loadu_si128((__m128i*)&prev_sq[x])));
+                _mm_storeu_si128((__m128i*)&cur_sq[x+4], _mm_add_epi32(sq_hi, _mm_loadu_si128((__m128i*)&prev_sq[x+4])));
+            }
+        }
+#endif
+
+        //remaining pixels (or all of them without neon/sse2)
+        if(with_squares){
+            for (; x < source->width; x++)
+            {
+                uint32_t pix = src[x];
+                row_sum += pix;
+                row_sum_sq += pix*pix;
+                cur[x] = prev[x]+row_sum;
+                cur_sq[x] = prev_sq[x]+row_sum_sq;
+            }
+        }
+        else{
+            for (; x < source->width; x++)
+            {
+                row_sum += src[x];
+                cur[x] = prev[x]+row_sum;
+            }
+        }
+    }
+}
+
+void image_integral_free(image_integral_t *integral){
+    free(integral->sum);
+    free(integral->sum_sq);
+    integral->sum = NULL;
+    integral->sum_sq = NULL;
+}
+
+//one row of a summed-area table of signed values (gradient products for example)
+//the prefix sum of values is added to the previous row of the table, rows include the zero first column
+//the sums wrap like the unsigned ones, rectangle sums are exact when read back as int32_t
+void image_integral_row_s32(uint32_t *table_row, uint32_t *table_prev_row, int32_t *values, uint width){
+    uint32_t row_sum = 0;
+    uint x = 0;
+
+    table_row[0] = 0;
+
+#ifdef __ARM_NEON
+    const uint32x4_t zero = vdupq_n_u32(0);
+    for (; x+4 <= width; x+=4)
+    {
+        uint32x4_t pref = vreinterpretq_u32_s32(vld1q_s32(&values[x]));
+        pref = vaddq_u32(pref, vextq_u32(zero, pref, 3));
+        pref = vaddq_u32(pref, vextq_u32(zero, pref, 2));
+        pref = vaddq_u32(pref, vdupq_n_u32(row_sum));
+        row_sum = vgetq_lane_u32(pref, 3);
+
+        vst1q_u32(&table_row[x+1], vaddq_u32(pref, vld1q_u32(&table_prev_row[x+1])));
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        row_sum += (uint32_t)values[x];
+        table_row[x+1] = table_prev_row[x+1]+row_sum;
+    }
+}
+
+//sum of the size_x*size_y rectangle with top left corner at (x,y), rectangle must be inside the image
+//unsigned arithmetic wraps so the result is correct even if the table overflowed
+inline uint32_t image_integral_sum(image_integral_t *integral, int x, int y, int size_x, int size_y){
+    uint stride = integral->width+1;
+    uint32_t *top = &integral->sum[y*stride+x];
+    uint32_t *bottom = &integral->sum[(y+size_y)*stride+x];
+    return bottom[size_x]-bottom[0]-top[size_x]+top[0];
+}
+
+inline uint32_t image_integral_sum_sq(image_integral_t *integral, int x, int y, int size_x, int size_y){
+    uint stride = integral->width+1;
+    uint32_t *top = &integral->sum_sq[y*stride+x];
+    uint32_t *bottom = &integral->sum_sq[(y+size_y)*stride+x];
+    return bottom[size_x]-bottom[0]-top[size_x]+top[0];
+}
+
+//sums of nb_rect rectangles of the same size, with top left corners given in pos_x, pos_y
+//sums_sq_out can be NULL if only the plain sums are needed
+void image_integral_sum_batch(image_integral_t *integral, int *pos_x, int *pos_y, uint nb_rect, int size_x, int size_y, uint32_t *sums_out, uint32_t *sums_sq_out){
+    uint stride = integral->width+1;
+    //offsets of the four corners relative to the top left one are the same for every rectangle
+    uint off_tr = size_x;
+    uint off_bl = size_y*stride;
+    uint off_br = size_y*stride+size_x;
+
+    for (size_t i = 0; i < nb_rect; i++)
+    {
+        uint idx = pos_y[i]*stride+pos_x[i];
+        uint32_t *tab = integral->sum;
+        sums_out[i] = tab[idx+off_br]-tab[idx+off_bl]-tab[idx+off_tr]+tab[idx];
+    }
+
+    if(sums_sq_out != NULL && integral->sum_sq != NULL){
+        for (size_t i = 0; i < nb_rect; i++)
+        {
+            uint idx = pos_y[i]*stride+pos_x[i];
+            uint32_t *tab = integral->sum_sq;
+            sums_sq_out[i] = tab[idx+off_br]-tab[idx+off_bl]-tab[idx+off_tr]+tab[idx];
+        }
+    }
+}
+
+//sums of the (2*radius+1)^2 windows centred on every pixel of row y
+//windows are clipped at the image borders, like blur_grayscale_image does
+void image_integral_box_row(image_integral_t *integral, int y, int radius, uint32_t *sums_out){
+    uint stride = integral->width+1;
+
+    int y_top = y-radius;
+    int y_bottom = y+radius+1;
+    if(y_top < 0){
+        y_top = 0;
+    }
+    if(y_bottom > integral->height){
+        y_bottom = integral->height;
+    }
+
+    uint32_t *top = &integral->sum[y_top*stride];
+    uint32_t *bottom = &integral->sum[y_bottom*stride];
+
+    //left and right borders, where the window is clipped horizontally
+    int end_left = radius < integral->width ? radius : integral->width;
+    int start_right = integral->width-radius > end_left ? integral->width-radius : end_left;
+    for (int x = 0; x < integral->width; x++)
+    {
+        if(x == end_left){
+            x = start_right;
+            if(x >= integral->width){
+                break;
+            }
+        }
+        int x_left = x-radius < 0 ? 0 : x-radius;
+        int x_right = x+radius+1 > integral->width ? integral->width : x+radius+1;
+        sums_out[x] = bottom[x_right]-bottom[x_left]-top[x_right]+top[x_left];
+    }
+
+    //inside of the row, no branches so it can be vectorised
+    uint size = 2*radius+1;
+    for (int x = radius; x < integral->width-radius; x++)
+    {
+        sums_out[x] = bottom[x-radius+size]-bottom[x-radius]-top[x-radius+size]+top[x-radius];
+    }
+}
+
+//sum of absolute differences between two blocks of size_x*size_y pixels, 16 pixels at a time
+uint32_t image_block_sad(uint8_t *block_a, uint8_t *block_b, uint stride_a, uint stride_b, uint size_x, uint size_y){
+    uint32_t sad = 0;
+
+#ifdef __ARM_NEON
+    uint32x4_t acc = vdupq_n_u32(0);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+#endif
+
+    for (size_t y = 0; y < size_y; y++)
+    {
+        uint8_t *row_a = &block_a[y*stride_a];
+        uint8_t *row_b = &block_b[y*stride_b];
+        uint x = 0;
+
+#ifdef __ARM_NEON
+        //each 16bits lane gains at most 2*255 per 16 pixels, so they are flushed every 2048 pixels before overflowing
+        while(x+16 <= size_x){
+            uint end_chunk = x+2048 < size_x ? x+2048 : size_x;
+            uint16x8_t acc_row = vdupq_n_u16(0);
+            for (; x+16 <= end_chunk; x+=16)
+            {
+                acc_row = vpadalq_u8(acc_row, vabdq_u8(vld1q_u8(&row_a[x]), vld1q_u8(&row_b[x])));
+            }
+            acc = vpadalq_u16(acc, acc_row);
+        }
+#elif defined(__SSE2__)
+        //psadbw gives two 16bits partial sums in the low part of each 64bits lane
+        for (; x+16 <= size_x; x+=16)
+        {
+            __m128i pix_a = _mm_loadu_si128((__m128i*)&row_a[x]);
+            __m128i pix_b = _mm_loadu_si128((__m128i*)&row_b[x]);
+            acc = _mm_add_epi32(acc, _mm_sad_epu8(pix_a, pix_b));
+        }
+#endif
+
+        for (; x < size_x; x++)
+        {
+            sad += abs(row_a[x]-row_b[x]);
+        }
+    }
+
+#ifdef __ARM_NEON
+    uint64x2_t total = vpaddlq_u32(acc);
+    sad += vgetq_lane_u64(total, 0)+vgetq_lane_u64(total, 1);
+#elif defined(__SSE2__)
+    sad += _mm_cvtsi128_si32(acc)+_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+    return sad;
+}
+
+//marks the blocks of block_size*block_size pixels whose mean absolute difference with the previous image is above threshold
+//mask has one byte per block, with (width+block_size-1)/block_size blocks per row
+//returns the number of changed blocks
+uint image_block_change_mask(image_grayscale_t *img, image_grayscale_t *img_prev, uint block_size, uint threshold, uint8_t *mask){
+    uint nb_blocks_x = (img->width+block_size-1)/block_size;
+    uint nb_blocks_y = (img->height+block_size-1)/block_size;
+    uint nb_changed = 0;
+
+    for (size_t by = 0; by < nb_blocks_y; by++)
+    {
+        for (size_t bx = 0; bx < nb_blocks_x; bx++)
+        {
+            //blocks on the right and bottom borders can be smaller
+            uint size_x = block_size;
+            uint size_y = block_size;
+            if((bx+1)*block_size > img->width){
+                size_x = img->width-bx*block_size;
+            }
+            if((by+1)*block_size > img->height){
+                size_y = img->height-by*block_size;
+            }
+
+            uint idx = by*block_size*img->width+bx*block_size;
+            uint32_t sad = image_block_sad(&img->img[idx], &img_prev->img[idx], img->width, img_prev->width, size_x, size_y);
+
+            uint changed = sad > threshold*size_x*size_y;
+            mask[by*nb_blocks_x+bx] = changed;
+            nb_changed += changed;
+        }
+    }
+
+    return nb_changed;
+}
+
 void image_draw_grayscale32(image_grayscale32_t *img, char *framebuffer, uint framebuffer_width){
     int offset_data = 0;
     for(int i = 0; i < img->height; i++){
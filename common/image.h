@@ -17,12 +17,39 @@ typedef struct image_grayscale_t{
     uint8_t *img;
 } image_grayscale_t;
 
+//label planes with more than 256 values (superpixels)
+typedef struct image_grayscale16_t{
+    int width;
+    int height;
+    uint16_t *img;
+} image_grayscale16_t;
+
 typedef struct image_grayscale32_t{
     int width;
     int height;
     uint32_t *img;
 } image_grayscale32_t;
 
+//summed-area table of a grayscale image, tables are (width+1)*(height+1) with a zero first row and column
+//values are 32bits and are allowed to wrap, rectangle sums stay exact as long as they fit in 32bits
+typedef struct image_integral_t{
+    int width;
+    int height;
+    uint32_t *sum;
+    uint32_t *sum_sq; //NULL if the squared sums were not requested
+} image_integral_t;
+
+//grayscale view of an rgb image, converted by tiles of GRAY_TILE_SIZE*GRAY_TILE_SIZE pixels on first access
+//for algorithms reading only parts of the image, the bitmap records the tiles already converted
+#define GRAY_TILE_SIZE 16
+typedef struct image_grayscale_lazy_t{
+    image_rgb_t *source;
+    image_grayscale_t gray; //only the converted tiles are valid
+    uint tiles_x;
+    uint tiles_y;
+    uint32_t *converted; //one bit per tile
+} image_grayscale_lazy_t;
+
 void image_draw(image_rgb_t *img, char *framebuffer, uint framebuffer_width);
 uint8_t image_get(image_rgb_t *img, int x, int y, int channel);
 void image_set(image_rgb_t *img, int x, int y, int channel, uint8_t val);
@@ -34,14 +61,36 @@ void image_draw_grayscale(image_grayscale_t *img, char *framebuffer, uint frameb
 uint8_t image_grayscale_get(image_grayscale_t *img, int x, int y);
 void image_grayscale_set(image_grayscale_t *img, int x, int y, uint8_t val);
 void image_convert_to_grayscale(image_rgb_t *source, image_grayscale_t *dest);
+void image_convert_to_grayscale_buffer(image_rgb_t *source, image_grayscale_t *dest);
+void image_convert_row_to_grayscale(uint8_t *source, uint8_t *dest, uint nb_pixels);
 void blur_grayscale_image(image_grayscale_t *image_source, image_grayscale_t *image_dest, uint kernel_size);
 void downscale_gray_image(image_grayscale_t *image_source, image_grayscale_t *image_dest);
+void downscale_gray_image_gaussian(image_grayscale_t *image_source, image_grayscale_t *image_dest);
+
+uint32_t image_block_sad(uint8_t *block_a, uint8_t *block_b, uint stride_a, uint stride_b, uint size_x, uint size_y);
+uint image_block_change_mask(image_grayscale_t *img, image_grayscale_t *img_prev, uint block_size, uint threshold, uint8_t *mask);
 
 void image_draw_grayscale32(image_grayscale32_t *img, char *framebuffer, uint framebuffer_width);
 uint32_t image_grayscale32_get(image_grayscale32_t *img, int x, int y);
 void image_grayscale32_increment_pix(image_grayscale32_t *img, int x, int y);
 void image_grayscale32_set(image_grayscale32_t *img, int x, int y, uint32_t val);
 
+void image_integral_compute(image_grayscale_t *source, image_integral_t *dest, uint with_squares);
+void image_integral_free(image_integral_t *integral);
+void image_integral_row_s32(uint32_t *table_row, uint32_t *table_prev_row, int32_t *values, uint width);
+uint32_t image_integral_sum(image_integral_t *integral, int x, int y, int size_x, int size_y);
+uint32_t image_integral_sum_sq(image_integral_t *integral, int x, int y, int size_x, int size_y);
+void image_integral_sum_batch(image_integral_t *integral, int *pos_x, int *pos_y, uint nb_rect, int size_x, int size_y, uint32_t *sums_out, uint32_t *sums_sq_out);
+void image_integral_box_row(image_integral_t *integral, int y, int radius, uint32_t *sums_out);
+
+void image_grayscale_lazy_init(image_grayscale_lazy_t *lazy, int width, int height);
+void image_grayscale_lazy_free(image_grayscale_lazy_t *lazy);
+void image_grayscale_lazy_reset(image_grayscale_lazy_t *lazy, image_rgb_t *source);
+void image_grayscale_lazy_convert_tile(image_grayscale_lazy_t *lazy, uint tile_x, uint tile_y);
+void image_grayscale_lazy_prefetch(image_grayscale_lazy_t *lazy, int x, int y, int size_x, int size_y);
+void image_grayscale_lazy_prefetch_windows(image_grayscale_lazy_t *lazy, int *pos_x, int *pos_y, uint nb_points, int radius);
+uint8_t image_grayscale_lazy_get(image_grayscale_lazy_t *lazy, int x, int y);
+
 void draw_circle(uint x, uint y, uint radius, image_rgb_t *img);
 void draw_line(uint x1, uint y1, uint x2, uint y2, image_rgb_t *img, uint colour[3]);
 
@@ -7,8 +7,15 @@
 #include <sys/mman.h>
 #include <semaphore.h>
 #include <time.h>
+#include <string.h>
+#include <math.h>
 
-//camera/mmal/raspberry specific libraries
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+//camera/mmal/raspberry specific libraries, not needed by a replay only build (-DFRAME_SOURCE_NO_CAMERA)
+#ifndef FRAME_SOURCE_NO_CAMERA
 #include "bcm_host.h"
 #include "mmal.h"
 #include "util/mmal_default_components.h"
@@ -18,7 +25,10 @@
 #include "interface/vcos/vcos.h"
 
 #include "../common/camera_mmal.h"
+#endif
+
 #include "../common/image.h"
+#include "../common/frame_source.h"
 
 //will affect framerate, it seems that if framerate is higher than possible shutter speed, it will be automatically lowered
 #define CAMERA_SHUTTER_SPEED 24000
@@ -37,29 +47,161 @@ uint32_t screen_size_y = 0;
 
 static int cur_sec;
 
+//BRIEF descriptor, compares 256 pairs of pixels in a patch around the point
+#define DESCRIPTOR_BITS 256
+#define DESCRIPTOR_PATCH_RADIUS 8
+
+//points are only matched with the points of the previous frame in the 3x3 neighbouring cells of this size
+#define MATCH_CELL_SIZE 32
+//maximum hamming distance (over the 256 bits) between two descriptors of the same feature
+#define MATCH_MAX_DISTANCE 64
+
+#define TOTAL_LEVELS_PYRAMID 3
+#define PYRAMID_BLUR 1 //means box blur filter of size (PYRAMID_BLUR*2+1)
+#define THRESHOLD_DETECTION 0.07f
+#define GRANULARITY_SEARCH 3
+#define MAX_POINTS_PER_PYRAMID 64
+#define MAX_FEATURE_POINTS (MAX_POINTS_PER_PYRAMID*TOTAL_LEVELS_PYRAMID)
+
+//tracking mode: full detection only every KEYFRAME_INTERVAL frames, points are followed with lucas kanade in between
+//and new points are only searched in the grid cells that lost all their points
+#define TRACKING_MODE 1
+#define KEYFRAME_INTERVAL 10
+#define TRACK_CELL_SIZE 100
+#define MAX_POINTS_PER_CELL 2 //per pyramid level
+#define TRACK_WINDOW_RADIUS 3
+#define TRACK_WINDOW_SIZE (2*TRACK_WINDOW_RADIUS+1)
+#define TRACK_ITERATIONS 4
+#define TRACK_MAX_MOTION 8 //in pixels of the pyramid level
+#define TRACK_MIN_EIGEN 25 //per pixel of the window, below it the window has not enough texture to be tracked
+#define TRACK_MAX_RESIDUAL 20 //mean absolute difference after tracking
+#define TRACK_MIN_DISTANCE 2 //tracked points of the same level closer than this (in pixels of the level) are the same corner
+
+//motion gating: blocks which did not change since their last search keep their points and are not searched again
+#define MOTION_GATING 1
+#define MOTION_BLOCK_SIZE 32
+#define MOTION_THRESHOLD 4 //mean absolute difference of the block with its last search, on the blurred image
+#define MOTION_MAX_POINTS_PER_BLOCK 1 //per pyramid level
+
+//optional corner response used to rank the FAST points and keep only the strongest ones
+#define CORNER_RESPONSE_NONE 0
+#define CORNER_RESPONSE_MIN_EIGEN 1 //shi-tomasi
+#define CORNER_RESPONSE_HARRIS 2
+#define CORNER_RESPONSE CORNER_RESPONSE_MIN_EIGEN
+
+//gradient products are summed over a (2*CORNER_WINDOW_RADIUS+1)^2 window
+#define CORNER_WINDOW_RADIUS 2
+#define HARRIS_K 0.04f
+//with a corner response, FAST keeps this many times more candidates before ranking them
+#define CORNER_CANDIDATES_FACTOR 4
+
+typedef struct feature_descriptor_t{
+    uint64_t bits[DESCRIPTOR_BITS/64];
+} feature_descriptor_t;
+
+//x and y are in the coordinates of the pyramid level
 typedef struct feature_point_t{
     int x;
     int y;
     int level;
+    float response;
+    feature_descriptor_t descriptor;
 } feature_point_t;
 
-extern sem_t semaphore_cam_buffer;
+//structure tensor of an image, gradient products summed over the window around each pixel
+//allocated once by structure_tensor_init, only the regions searched for points are computed
+typedef struct structure_tensor_t{
+    int width;
+    int height;
+    uint radius;
+    int32_t *sum_xx;
+    int32_t *sum_xy;
+    int32_t *sum_yy;
+    //rows of gradient products, ring of the 2*radius+1 last horizontally filtered rows and their vertical sums
+    //xx, xy and yy one after the other
+    int32_t *products;
+    int32_t *ring;
+    int32_t *acc;
+} structure_tensor_t;
+
+//what the main loop keeps from a frame to the next
+typedef struct features_state_t{
+    //points of the previous frame, to match with the current ones
+    feature_point_t prev_points[MAX_FEATURE_POINTS];
+    uint nb_prev_points;
+
+    //blurred pyramid of the previous frame, needed for tracking
+    image_grayscale_t prev_gray_blurred[TOTAL_LEVELS_PYRAMID];
+    uint has_prev_pyramid;
+    uint frame_count;
+
+    //the tensors are computed by detect_points_level, only on the regions it searches
+    structure_tensor_t tensors[TOTAL_LEVELS_PYRAMID];
+
+    //with MOTION_GATING, blurred image as it was at the last search of each block, the blocks are compared with it
+    //so slow changes add up until the block is searched again
+    image_grayscale_t motion_reference;
+} features_state_t;
 
 void init_time_keeping();
 float get_cur_time();
 
 uint check_fast_point(image_grayscale_t *image, float thresh, uint pos_x, uint pos_y);
 void find_fast_points(image_grayscale_t image, feature_point_t *points, uint *nb_points, uint granularity, uint max_points, float threshold);
+void find_fast_points_region(image_grayscale_t image, feature_point_t *points, uint *nb_points, uint granularity, uint max_points, float threshold, uint start_x, uint start_y, uint end_x, uint end_y);
+uint detect_points_level(image_grayscale_t *image, structure_tensor_t *tensor, uint level, uint start_x, uint start_y, uint end_x, uint end_y, feature_point_t *points, uint max_points);
+uint track_point_lk(image_grayscale_t *img_prev, image_grayscale_t *img, feature_point_t *point);
+int find_close_point(feature_point_t *points, uint nb_points, feature_point_t *point);
+uint point_in_changed_block(feature_point_t *point, uint8_t *block_mask, uint nb_blocks_x);
+uint detect_points_masked(image_grayscale_t *levels, structure_tensor_t *tensors, uint8_t *block_mask, uint nb_blocks_x, uint start_x, uint start_y, uint end_x, uint end_y, feature_point_t *points, uint max_points, image_grayscale_t *reference);
+void copy_region_gray(image_grayscale_t *source, image_grayscale_t *dest, uint start_x, uint start_y, uint end_x, uint end_y);
+
+void structure_tensor_init(structure_tensor_t *tensor, uint width, uint height, uint radius);
+void compute_structure_tensor(image_grayscale_t *image, structure_tensor_t *tensor);
+void compute_structure_tensor_region(image_grayscale_t *image, structure_tensor_t *tensor, uint start_x, uint start_y, uint end_x, uint end_y);
+void free_structure_tensor(structure_tensor_t *tensor);
+void gradient_products_row(uint8_t *row_above, uint8_t *row, uint8_t *row_below, uint width, int32_t *prod_xx, int32_t *prod_xy, int32_t *prod_yy);
+void add_row_s32(int32_t *dest, int32_t *src, uint size);
+void sub_row_s32(int32_t *dest, int32_t *src, uint size);
+float corner_response(structure_tensor_t *tensor, uint idx, uint type);
+void corner_response_at_points(structure_tensor_t *tensor, feature_point_t *points, uint nb_points, uint type);
+void corner_response_dense(structure_tensor_t *tensor, float *response, uint type);
+int compare_points_response(const void *a, const void *b);
+void keep_strongest_points(feature_point_t *points, uint *nb_points, uint max_points);
 
-void main(void){
+void init_brief_pattern();
+void compute_brief_descriptors(image_grayscale_t *image, feature_point_t *points, uint nb_points);
+uint hamming_distance(feature_descriptor_t *desc_a, feature_descriptor_t *desc_b);
+void match_feature_points(feature_point_t *prev_points, uint nb_prev_points, feature_point_t *points, uint nb_points, uint width, uint height, int *match_idx);
+
+void features_state_init(features_state_t *state, uint width, uint height);
+void features_state_free(features_state_t *state);
+void process_frame(features_state_t *state, image_rgb_t *img, image_rgb_t *img_draw);
+
+void main(int argc, char **argv){
+#ifndef FRAME_SOURCE_NO_CAMERA
     //sets up the framebuffer, will draw
     framebuffer_init(&fbp, &screen_size_x, &screen_size_y);
+#endif
 
-    MMAL_PORT_T *video_port;
-    MMAL_POOL_T *pool;
-    MMAL_BUFFER_HEADER_T *buffer;
-
-    camera_mmal_init(&video_port, &pool, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+    //frames from the camera, or replayed in a loop from a raw rgb sequence given as argument
+    //at the camera framerate or the one given after the sequence (0: as fast as possible)
+    //a replay only build needs the sequence and displays nothing
+    frame_source_t source;
+    if(argc > 1){
+        float framerate = argc > 2 ? atof(argv[2]) : MAX_CAMERA_FRAMERATE;
+        if(frame_source_replay_init(&source, argv[1], CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, 3, framerate, 1) != 0){
+            exit(1);
+        }
+    }
+    else{
+#ifndef FRAME_SOURCE_NO_CAMERA
+        frame_source_camera_init(&source, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#else
+        fprintf(stderr, "usage: %s sequence.raw [framerate]\n\r", argv[0]);
+        exit(1);
+#endif
+    }
 
     float time_since_report = 0.0f;
     int count_frames = 0;
@@ -71,90 +213,270 @@ void main(void){
 
     init_time_keeping();
 
+    init_brief_pattern();
+
+    image_rgb_t img;
+    img.width = CAMERA_RESOLUTION_X;
+    img.height = CAMERA_RESOLUTION_Y;
+
+    //the points are drawn on the camera buffer itself, a replayed frame is read only and is drawn on a copy
+    image_rgb_t img_draw;
+    img_draw.width = img.width;
+    img_draw.height = img.height;
+    img_draw.img = source.writable ? NULL : malloc(img.width*img.height*3);
+
+    features_state_t state;
+    features_state_init(&state, img.width, img.height);
+
     while(1){
         start_time = get_cur_time();
 
-        //wait until a buffer has been received
-        sem_wait(&semaphore_cam_buffer);
+        img.img = frame_source_get(&source);
+        if(source.writable){
+            img_draw.img = img.img;
+        }
 
-        buffer = mmal_queue_get(pool->queue);
+        process_frame(&state, &img, &img_draw);
 
-        image_rgb_t img;
-        img.width = CAMERA_RESOLUTION_X;
-        img.height = CAMERA_RESOLUTION_Y;
-        img.img = buffer->data;
+        // save to raw file
+        // save_image_rgb_to_file(&img_draw, "img.raw");
 
-        const uint TOTAL_LEVELS_PYRAMID = 3;
-        const float THRESHOLD_DETECTION = 0.07f;
-        const uint PYRAMID_BLUR = 1; //means box blur filter of size (PYRAMID_BLUR*2+1)
-        const uint MAX_POINTS_PER_PYRAMID = 64;
+#ifndef FRAME_SOURCE_NO_CAMERA
+        //before the release, img_draw can be the camera buffer
+        image_draw(&img_draw, fbp, screen_size_x); //11ms
+#endif
 
-        image_grayscale_t img_gray[TOTAL_LEVELS_PYRAMID];
-        image_grayscale_t img_gray_blurred[TOTAL_LEVELS_PYRAMID];
+        //gives back the frame, the camera can fill its buffer with an image again
+        frame_source_release(&source);
 
-        image_convert_to_grayscale(&img, &img_gray[0]); //13ms
 
-        uint factor = 1;
-        for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
-        {
-            blur_grayscale_image(&img_gray[i], &img_gray_blurred[i], PYRAMID_BLUR); //38ms
+        end_time = get_cur_time();
+        float seconds = (float)(end_time - start_time);
+        time_since_report += seconds;
+        count_frames++;
+
+        if(time_since_report > 1.0f){
+            float framerate = count_frames/time_since_report;
+            printf("frequency: %fHz\n\r", framerate);
+            time_since_report = 0;
+            count_frames = 0;
+        }
+
+
+        // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
+    }
 
-            feature_point_t points[64];
-            uint nb_points;
-            uint granularity_search = 3;
+    //todo free the mmal and framebuffer ressources cleanly
+}
 
-            // start_profiling_time = get_cur_time();
-            find_fast_points(img_gray_blurred[i], points, &nb_points, granularity_search, MAX_POINTS_PER_PYRAMID, THRESHOLD_DETECTION); // 34ms
-            // end_profiling_time = get_cur_time();
+void features_state_init(features_state_t *state, uint width, uint height){
+    state->nb_prev_points = 0;
+    state->has_prev_pyramid = 0;
+    state->frame_count = 0;
 
-            //draw the feature points on the image with appropriate size
-            for (size_t ipt = 0; ipt < nb_points; ipt++)
-            {
-                draw_circle(points[ipt].x*factor, points[ipt].y*factor, 4*factor, &img);
+#if CORNER_RESPONSE != CORNER_RESPONSE_NONE
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+    {
+        structure_tensor_init(&state->tensors[i], width>>i, height>>i, CORNER_WINDOW_RADIUS);
+    }
+#endif
+
+#if MOTION_GATING
+    state->motion_reference.width = width;
+    state->motion_reference.height = height;
+    state->motion_reference.img = malloc(width*height);
+#endif
+}
+
+void features_state_free(features_state_t *state){
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+    {
+        if(state->has_prev_pyramid){
+            free(state->prev_gray_blurred[i].img);
+        }
+#if CORNER_RESPONSE != CORNER_RESPONSE_NONE
+        free_structure_tensor(&state->tensors[i]);
+#endif
+    }
+
+#if MOTION_GATING
+    free(state->motion_reference.img);
+#endif
+}
+
+//work of the main loop on a frame, the points found in img are drawn on a copy of it in img_draw
+//img_draw must already hold a frame of the same size
+void process_frame(features_state_t *state, image_rgb_t *img, image_rgb_t *img_draw){
+    image_grayscale_t img_gray[TOTAL_LEVELS_PYRAMID];
+    image_grayscale_t img_gray_blurred[TOTAL_LEVELS_PYRAMID];
+
+    feature_point_t points[MAX_FEATURE_POINTS];
+    int match_idx[MAX_FEATURE_POINTS];
+    uint nb_points_total = 0;
+
+    image_convert_to_grayscale(img, &img_gray[0]); //13ms
+
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+    {
+        blur_grayscale_image(&img_gray[i], &img_gray_blurred[i], PYRAMID_BLUR); //38ms
+
+        if(i < TOTAL_LEVELS_PYRAMID-1){
+            downscale_gray_image(&img_gray_blurred[i], &img_gray[i+1]); //1ms
+        }
+    }
+
+    uint keyframe = !TRACKING_MODE || !state->has_prev_pyramid || state->frame_count%KEYFRAME_INTERVAL == 0;
+
+    //blocks which changed since they were last searched, the only ones where points are searched again
+    //NULL means everything is searched
+    uint8_t *motion_mask = NULL;
+    image_grayscale_t *reference = NULL;
+#if MOTION_GATING
+    uint nb_blocks_x = (img->width+MOTION_BLOCK_SIZE-1)/MOTION_BLOCK_SIZE;
+    uint nb_blocks_y = (img->height+MOTION_BLOCK_SIZE-1)/MOTION_BLOCK_SIZE;
+    uint8_t block_mask[nb_blocks_x*nb_blocks_y];
+    if(state->has_prev_pyramid){
+        image_block_change_mask(&img_gray_blurred[0], &state->motion_reference, MOTION_BLOCK_SIZE, MOTION_THRESHOLD, block_mask);
+        motion_mask = block_mask;
+        reference = &state->motion_reference;
+    }
+    else{
+        //the whole image is searched
+        memcpy(state->motion_reference.img, img_gray_blurred[0].img, img->width*img->height);
+    }
+#else
+    uint nb_blocks_x = 0;
+#endif
+
+    if(keyframe && motion_mask == NULL){
+        for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+        {
+            nb_points_total += detect_points_level(&img_gray_blurred[i], &state->tensors[i], i, 0, 0, img_gray_blurred[i].width, img_gray_blurred[i].height, &points[nb_points_total], MAX_POINTS_PER_PYRAMID); // 34ms
+        }
+
+        //find which points of the previous frame are the same as the current ones
+        match_feature_points(state->prev_points, state->nb_prev_points, points, nb_points_total, img->width, img->height, match_idx);
+    }
+    else if(keyframe){
+        //points of the blocks which did not change are carried over
+        for (size_t ipt = 0; ipt < state->nb_prev_points; ipt++)
+        {
+            if(!point_in_changed_block(&state->prev_points[ipt], motion_mask, nb_blocks_x)){
+                match_idx[nb_points_total] = ipt;
+                points[nb_points_total] = state->prev_points[ipt];
+                nb_points_total++;
             }
+        }
 
+        uint nb_carried = nb_points_total;
+        nb_points_total += detect_points_masked(img_gray_blurred, state->tensors, motion_mask, nb_blocks_x, 0, 0, img->width, img->height, &points[nb_points_total], MAX_FEATURE_POINTS-nb_points_total, reference);
 
-            if(i < TOTAL_LEVELS_PYRAMID-1){
-                downscale_gray_image(&img_gray_blurred[i], &img_gray[i+1]); //1ms
+        match_feature_points(state->prev_points, state->nb_prev_points, &points[nb_carried], nb_points_total-nb_carried, img->width, img->height, &match_idx[nb_carried]);
+    }
+    else{
+        //follow the points of the previous frame on their pyramid level
+        //points in blocks which did not change stay where they are
+        for (size_t ipt = 0; ipt < state->nb_prev_points; ipt++)
+        {
+            feature_point_t pt = state->prev_points[ipt];
+            if(motion_mask == NULL || point_in_changed_block(&pt, motion_mask, nb_blocks_x)){
+                if(!track_point_lk(&state->prev_gray_blurred[pt.level], &img_gray_blurred[pt.level], &pt)){
+                    continue;
+                }
+                //the descriptor of the new position, the next keyframe matches with it
+                compute_brief_descriptors(&img_gray_blurred[pt.level], &pt, 1);
             }
 
-            factor*=2;
+            //points converging on the same corner are merged, the strongest one is kept
+            int close_idx = find_close_point(points, nb_points_total, &pt);
+            if(close_idx < 0){
+                match_idx[nb_points_total] = ipt;
+                points[nb_points_total] = pt;
+                nb_points_total++;
+            }
+            else if(pt.response > points[close_idx].response){
+                match_idx[close_idx] = ipt;
+                points[close_idx] = pt;
+            }
         }
 
-        // image_draw_grayscale(&img_gray[0], fbp, screen_size_x);
+        //search new points only in the cells which have no point left
+        uint nb_cells_x = (img->width+TRACK_CELL_SIZE-1)/TRACK_CELL_SIZE;
+        uint nb_cells_y = (img->height+TRACK_CELL_SIZE-1)/TRACK_CELL_SIZE;
+        uint8_t cell_occupied[nb_cells_x*nb_cells_y];
+        memset(cell_occupied, 0, nb_cells_x*nb_cells_y);
 
-        image_draw(&img, fbp, screen_size_x); //11ms
+        for (size_t ipt = 0; ipt < nb_points_total; ipt++)
+        {
+            uint cx = (points[ipt].x<<points[ipt].level)/TRACK_CELL_SIZE;
+            uint cy = (points[ipt].y<<points[ipt].level)/TRACK_CELL_SIZE;
+            cell_occupied[cy*nb_cells_x+cx] = 1;
+        }
 
-        // save to raw file
-        // save_image_rgb_to_file(&img, "img.raw");
+        for (size_t cell = 0; cell < nb_cells_x*nb_cells_y; cell++)
+        {
+            if(cell_occupied[cell]){
+                continue;
+            }
 
-        //Send back the buffer to the port to be filled with an image again
-        mmal_port_send_buffer(video_port, buffer);
+            uint cell_x = (cell%nb_cells_x)*TRACK_CELL_SIZE;
+            uint cell_y = (cell/nb_cells_x)*TRACK_CELL_SIZE;
+            uint nb_new = 0;
 
+            if(motion_mask != NULL){
+                //an empty cell which did not change would not get any new point
+                nb_new = detect_points_masked(img_gray_blurred, state->tensors, motion_mask, nb_blocks_x, cell_x, cell_y, cell_x+TRACK_CELL_SIZE, cell_y+TRACK_CELL_SIZE, &points[nb_points_total], MAX_FEATURE_POINTS-nb_points_total, reference);
+            }
+            else{
+                for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+                {
+                    uint max_points = MAX_FEATURE_POINTS-nb_points_total-nb_new;
+                    if(max_points > MAX_POINTS_PER_CELL){
+                        max_points = MAX_POINTS_PER_CELL;
+                    }
 
-        end_time = get_cur_time();
-        float seconds = (float)(end_time - start_time);
-        time_since_report += seconds;
-        count_frames++;
+                    nb_new += detect_points_level(&img_gray_blurred[i], &state->tensors[i], i, cell_x>>i, cell_y>>i, (cell_x+TRACK_CELL_SIZE)>>i, (cell_y+TRACK_CELL_SIZE)>>i, &points[nb_points_total+nb_new], max_points);
+                }
+            }
 
-        if(time_since_report > 1.0f){
-            float framerate = count_frames/time_since_report;
-            printf("frequency: %fHz\n\r", framerate);
-            time_since_report = 0;
-            count_frames = 0;
+            for (size_t ipt = 0; ipt < nb_new; ipt++)
+            {
+                match_idx[nb_points_total+ipt] = -1;
+            }
+            nb_points_total += nb_new;
         }
+    }
 
+    //draw the feature points on the image with appropriate size, and the motion of the matched ones
+    //img_draw is the frame itself when the source is writable, a copy of it otherwise
+    if(img_draw->img != img->img){
+        memcpy(img_draw->img, img->img, img->width*img->height*3);
+    }
+    uint col_match[3] = {0, 255, 0};
+    for (size_t ipt = 0; ipt < nb_points_total; ipt++)
+    {
+        uint factor = 1<<points[ipt].level;
+        draw_circle(points[ipt].x*factor, points[ipt].y*factor, 4*factor, img_draw);
 
-        // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
-
-        //destroy buffers
-        for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++){
-            free(img_gray[i].img);
-            free(img_gray_blurred[i].img);
+        if(match_idx[ipt] >= 0){
+            feature_point_t *prev = &state->prev_points[match_idx[ipt]];
+            draw_line(prev->x<<prev->level, prev->y<<prev->level, points[ipt].x<<points[ipt].level, points[ipt].y<<points[ipt].level, img_draw, col_match);
         }
     }
 
-    //todo free the mmal and framebuffer ressources cleanly
+    memcpy(state->prev_points, points, nb_points_total*sizeof(feature_point_t));
+    state->nb_prev_points = nb_points_total;
+    state->frame_count++;
+
+    //destroy buffers, the blurred pyramid is kept for the next frame
+    for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++){
+        free(img_gray[i].img);
+        if(state->has_prev_pyramid){
+            free(state->prev_gray_blurred[i].img);
+        }
+        state->prev_gray_blurred[i] = img_gray_blurred[i];
+    }
+    state->has_prev_pyramid = 1;
 }
 
 //clock_gettime is a better time keeping mechanism than other on the raspberry pi
@@ -265,21 +587,630 @@ uint check_fast_point(image_grayscale_t *image, float thresh, uint pos_x, uint p
 
 //check in all image, given granularty for fast points
 void find_fast_points(image_grayscale_t image, feature_point_t *points, uint *nb_points, uint granularity, uint max_points, float threshold){
+    find_fast_points_region(image, points, nb_points, granularity, max_points, threshold, 0, 0, image.width, image.height);
+}
+
+//same as find_fast_points, only in the rectangle from (start_x, start_y) to (end_x, end_y) excluded
+//the rectangle is clipped to stay 10 pixels away from the borders
+void find_fast_points_region(image_grayscale_t image, feature_point_t *points, uint *nb_points, uint granularity, uint max_points, float threshold, uint start_x, uint start_y, uint end_x, uint end_y){
 
     uint current_head = 0;
 
-    for (size_t i = 10; i < image.height-10; i+=granularity)
+    if(start_x < 10){
+        start_x = 10;
+    }
+    if(start_y < 10){
+        start_y = 10;
+    }
+    if(end_x > image.width-10){
+        end_x = image.width-10;
+    }
+    if(end_y > image.height-10){
+        end_y = image.height-10;
+    }
+
+    for (size_t i = start_y; i < end_y && current_head < max_points; i+=granularity)
         {
-            for (size_t j = 10; j < image.width-10; j+=granularity)
+            for (size_t j = start_x; j < end_x && current_head < max_points; j+=granularity)
             {
-                if(check_fast_point(&image, threshold, j, i) && current_head < max_points){
+                if(check_fast_point(&image, threshold, j, i)){
                     points[current_head].x = j;
                     points[current_head].y = i;
                     points[current_head].level = 0;
+                    points[current_head].response = 0;
                     current_head++;
                 }
             }
         }
 
     *nb_points = current_head;
+}
+
+//finds up to max_points in a region of one pyramid level and computes their descriptors
+//with a corner response, the candidates are ranked with the structure tensor of the level, computed on the region
+uint detect_points_level(image_grayscale_t *image, structure_tensor_t *tensor, uint level, uint start_x, uint start_y, uint end_x, uint end_y, feature_point_t *points, uint max_points){
+    uint nb_points = 0;
+
+    if(max_points == 0){
+        return 0;
+    }
+
+#if CORNER_RESPONSE == CORNER_RESPONSE_NONE
+    find_fast_points_region(*image, points, &nb_points, GRANULARITY_SEARCH, max_points, THRESHOLD_DETECTION, start_x, start_y, end_x, end_y);
+#else
+    //take more FAST candidates than needed and only keep the ones with the strongest corner response
+    feature_point_t candidates[max_points*CORNER_CANDIDATES_FACTOR];
+    find_fast_points_region(*image, candidates, &nb_points, GRANULARITY_SEARCH, max_points*CORNER_CANDIDATES_FACTOR, THRESHOLD_DETECTION, start_x, start_y, end_x, end_y);
+
+    //the tensor is only needed where the candidates are
+    if(nb_points > 0){
+        compute_structure_tensor_region(image, tensor, start_x, start_y, end_x, end_y);
+    }
+    corner_response_at_points(tensor, candidates, nb_points, CORNER_RESPONSE);
+
+    keep_strongest_points(candidates, &nb_points, max_points);
+    memcpy(points, candidates, nb_points*sizeof(feature_point_t));
+#endif
+
+    for (size_t ipt = 0; ipt < nb_points; ipt++)
+    {
+        points[ipt].level = level;
+    }
+
+    //descriptors are computed on the blurred level the points were found on
+    compute_brief_descriptors(image, points, nb_points);
+
+    return nb_points;
+}
+
+//block_mask is in blocks of MOTION_BLOCK_SIZE of the full resolution image
+inline uint point_in_changed_block(feature_point_t *point, uint8_t *block_mask, uint nb_blocks_x){
+    uint bx = (point->x<<point->level)/MOTION_BLOCK_SIZE;
+    uint by = (point->y<<point->level)/MOTION_BLOCK_SIZE;
+    return block_mask[by*nb_blocks_x+bx];
+}
+
+//detection restricted to the changed blocks inside the region (full resolution coordinates)
+//each changed block gets up to MOTION_MAX_POINTS_PER_BLOCK points on every pyramid level
+//the searched part of each block is copied to reference (if not NULL), the next changes are measured from it
+uint detect_points_masked(image_grayscale_t *levels, structure_tensor_t *tensors, uint8_t *block_mask, uint nb_blocks_x, uint start_x, uint start_y, uint end_x, uint end_y, feature_point_t *points, uint max_points, image_grayscale_t *reference){
+    uint nb_points = 0;
+
+    for (uint by = start_y/MOTION_BLOCK_SIZE; by*MOTION_BLOCK_SIZE < end_y; by++)
+    {
+        for (uint bx = start_x/MOTION_BLOCK_SIZE; bx*MOTION_BLOCK_SIZE < end_x; bx++)
+        {
+            //regions can go past the image, blocks outside of it have no mask entry
+            if(bx*MOTION_BLOCK_SIZE >= levels[0].width || by*MOTION_BLOCK_SIZE >= levels[0].height){
+                continue;
+            }
+            if(!block_mask[by*nb_blocks_x+bx]){
+                continue;
+            }
+
+            //intersection of the block and the region
+            uint block_start_x = bx*MOTION_BLOCK_SIZE > start_x ? bx*MOTION_BLOCK_SIZE : start_x;
+            uint block_start_y = by*MOTION_BLOCK_SIZE > start_y ? by*MOTION_BLOCK_SIZE : start_y;
+            uint block_end_x = (bx+1)*MOTION_BLOCK_SIZE < end_x ? (bx+1)*MOTION_BLOCK_SIZE : end_x;
+            uint block_end_y = (by+1)*MOTION_BLOCK_SIZE < end_y ? (by+1)*MOTION_BLOCK_SIZE : end_y;
+
+            for (size_t i = 0; i < TOTAL_LEVELS_PYRAMID; i++)
+            {
+                uint max_points_block = max_points-nb_points;
+                if(max_points_block > MOTION_MAX_POINTS_PER_BLOCK){
+                    max_points_block = MOTION_MAX_POINTS_PER_BLOCK;
+                }
+
+                nb_points += detect_points_level(&levels[i], &tensors[i], i, block_start_x>>i, block_start_y>>i, block_end_x>>i, block_end_y>>i, &points[nb_points], max_points_block);
+            }
+
+            if(reference != NULL){
+                copy_region_gray(&levels[0], reference, block_start_x, block_start_y, block_end_x, block_end_y);
+            }
+        }
+    }
+
+    return nb_points;
+}
+
+//copies the rectangle from (start_x, start_y) to (end_x, end_y) excluded, clipped to the images of the same size
+void copy_region_gray(image_grayscale_t *source, image_grayscale_t *dest, uint start_x, uint start_y, uint end_x, uint end_y){
+    if(end_x > source->width){
+        end_x = source->width;
+    }
+    if(end_y > source->height){
+        end_y = source->height;
+    }
+
+    for (uint y = start_y; y < end_y; y++)
+    {
+        memcpy(&dest->img[y*dest->width+start_x], &source->img[y*source->width+start_x], end_x-start_x);
+    }
+}
+
+//follows a point from img_prev to img with a few lucas kanade iterations on a small window around it
+//like calc_optical_flow in optical_flow, but the displacement is rounded to the pixel and refined at each iteration
+//returns 0 if the point is lost (not enough texture, out of the image or too different after tracking)
+uint track_point_lk(image_grayscale_t *img_prev, image_grayscale_t *img, feature_point_t *point){
+    int grad_x[TRACK_WINDOW_SIZE*TRACK_WINDOW_SIZE];
+    int grad_y[TRACK_WINDOW_SIZE*TRACK_WINDOW_SIZE];
+
+    int pos_x = point->x;
+    int pos_y = point->y;
+    int width = img->width;
+
+    //gradients of the previous image, central differences (twice the real gradient)
+    int a_xx = 0;
+    int a_xy = 0;
+    int a_yy = 0;
+    uint counter = 0;
+    for (int j = -TRACK_WINDOW_RADIUS; j <= TRACK_WINDOW_RADIUS; j++)
+    {
+        uint8_t *row = &img_prev->img[(pos_y+j)*width+pos_x];
+        for (int i = -TRACK_WINDOW_RADIUS; i <= TRACK_WINDOW_RADIUS; i++)
+        {
+            grad_x[counter] = row[i+1]-row[i-1];
+            grad_y[counter] = row[i+width]-row[i-width];
+            a_xx += grad_x[counter]*grad_x[counter];
+            a_xy += grad_x[counter]*grad_y[counter];
+            a_yy += grad_y[counter]*grad_y[counter];
+            counter++;
+        }
+    }
+
+    float half_diff = (a_xx-a_yy)*0.5f;
+    float min_eigen = (a_xx+a_yy)*0.5f-sqrtf(half_diff*half_diff+(float)a_xy*a_xy);
+    if(min_eigen < TRACK_MIN_EIGEN*TRACK_WINDOW_SIZE*TRACK_WINDOW_SIZE){
+        return 0;
+    }
+
+    float det = (float)a_xx*a_yy-(float)a_xy*a_xy;
+
+    int disp_x = 0;
+    int disp_y = 0;
+    uint residual = 0;
+
+    for (size_t it = 0; it <= TRACK_ITERATIONS; it++)
+    {
+        int new_x = pos_x+disp_x;
+        int new_y = pos_y+disp_y;
+
+        //same border as find_fast_points, so the window and the descriptor stay in the image
+        if(new_x < 10 || new_y < 10 || new_x >= img->width-10 || new_y >= img->height-10){
+            return 0;
+        }
+        if(abs(disp_x) > TRACK_MAX_MOTION || abs(disp_y) > TRACK_MAX_MOTION){
+            return 0;
+        }
+
+        int b_x = 0;
+        int b_y = 0;
+        residual = 0;
+        counter = 0;
+        for (int j = -TRACK_WINDOW_RADIUS; j <= TRACK_WINDOW_RADIUS; j++)
+        {
+            uint8_t *row_prev = &img_prev->img[(pos_y+j)*width+pos_x];
+            uint8_t *row = &img->img[(new_y+j)*width+new_x];
+            for (int i = -TRACK_WINDOW_RADIUS; i <= TRACK_WINDOW_RADIUS; i++)
+            {
+                int dt = row[i]-row_prev[i];
+                b_x -= grad_x[counter]*dt;
+                b_y -= grad_y[counter]*dt;
+                residual += abs(dt);
+                counter++;
+            }
+        }
+
+        //last pass only measures the residual at the final position
+        if(it == TRACK_ITERATIONS){
+            break;
+        }
+
+        //solve Au=B, the factor 2 compensates the central differences
+        float u_x = 2.0f*(a_yy*(float)b_x-a_xy*(float)b_y)/det;
+        float u_y = 2.0f*(a_xx*(float)b_y-a_xy*(float)b_x)/det;
+
+        int step_x = lroundf(u_x);
+        int step_y = lroundf(u_y);
+
+        if(step_x == 0 && step_y == 0){
+            break;
+        }
+
+        disp_x += step_x;
+        disp_y += step_y;
+    }
+
+    if(residual > TRACK_MAX_RESIDUAL*TRACK_WINDOW_SIZE*TRACK_WINDOW_SIZE){
+        return 0;
+    }
+
+    point->x = pos_x+disp_x;
+    point->y = pos_y+disp_y;
+
+    return 1;
+}
+
+//index of a point of the same level as point closer than TRACK_MIN_DISTANCE on both axes, -1 if there is none
+int find_close_point(feature_point_t *points, uint nb_points, feature_point_t *point){
+    for (size_t ipt = 0; ipt < nb_points; ipt++)
+    {
+        if(points[ipt].level == point->level && abs(points[ipt].x-point->x) < TRACK_MIN_DISTANCE && abs(points[ipt].y-point->y) < TRACK_MIN_DISTANCE){
+            return ipt;
+        }
+    }
+
+    return -1;
+}
+
+//pixels closer than radius+1 to the border are never computed and stay at 0
+void structure_tensor_init(structure_tensor_t *tensor, uint width, uint height, uint radius){
+    uint window = 2*radius+1;
+
+    tensor->width = width;
+    tensor->height = height;
+    tensor->radius = radius;
+    tensor->sum_xx = calloc(width*height, sizeof(int32_t));
+    tensor->sum_xy = calloc(width*height, sizeof(int32_t));
+    tensor->sum_yy = calloc(width*height, sizeof(int32_t));
+    tensor->products = calloc(3*width, sizeof(int32_t));
+    tensor->ring = calloc(3*width*window, sizeof(int32_t));
+    tensor->acc = calloc(3*width, sizeof(int32_t));
+}
+
+void compute_structure_tensor(image_grayscale_t *image, structure_tensor_t *tensor){
+    compute_structure_tensor_region(image, tensor, 0, 0, image->width, image->height);
+}
+
+//computes the tensor for the pixels from (start_x, start_y) to (end_x, end_y) excluded, the others are left as they are
+//the gradient products of the region and its margin are box filtered separably:
+//a ring of the last 2*radius+1 horizontally filtered rows is kept, and summed vertically with a running sum
+void compute_structure_tensor_region(image_grayscale_t *image, structure_tensor_t *tensor, uint start_x, uint start_y, uint end_x, uint end_y){
+    uint width = image->width;
+    uint height = image->height;
+    uint radius = tensor->radius;
+    uint window = 2*radius+1;
+
+    //the products exist from 1 to size-2, the sums from radius+1 to size-radius-2
+    if(start_x < radius+1){
+        start_x = radius+1;
+    }
+    if(start_y < radius+1){
+        start_y = radius+1;
+    }
+    if(end_x > width-radius-1){
+        end_x = width-radius-1;
+    }
+    if(end_y > height-radius-1){
+        end_y = height-radius-1;
+    }
+    if(start_x >= end_x || start_y >= end_y){
+        return;
+    }
+
+    int32_t *prod_xx = tensor->products;
+    int32_t *prod_xy = &tensor->products[width];
+    int32_t *prod_yy = &tensor->products[2*width];
+    int32_t *ring_xx = tensor->ring;
+    int32_t *ring_xy = &tensor->ring[width*window];
+    int32_t *ring_yy = &tensor->ring[2*width*window];
+    int32_t *acc_xx = tensor->acc;
+    int32_t *acc_xy = &tensor->acc[width];
+    int32_t *acc_yy = &tensor->acc[2*width];
+
+    uint size_x = end_x-start_x;
+    //the products of the columns start_x-radius to end_x+radius-1 are needed
+    uint prod_start = start_x-radius;
+    uint prod_size = size_x+2*radius;
+
+    memset(&acc_xx[start_x], 0, size_x*sizeof(int32_t));
+    memset(&acc_xy[start_x], 0, size_x*sizeof(int32_t));
+    memset(&acc_yy[start_x], 0, size_x*sizeof(int32_t));
+
+    for (uint y = start_y-radius; y < end_y+radius; y++)
+    {
+        uint nb_rows = y-(start_y-radius);
+        uint8_t *row = &image->img[y*width+prod_start-1];
+        gradient_products_row(row-width, row, row+width, prod_size+2, &prod_xx[prod_start-1], &prod_xy[prod_start-1], &prod_yy[prod_start-1]);
+
+        uint slot = (nb_rows%window)*width;
+
+        //the row leaving the window is in the slot about to be overwritten
+        if(nb_rows >= window){
+            sub_row_s32(&acc_xx[start_x], &ring_xx[slot+start_x], size_x);
+            sub_row_s32(&acc_xy[start_x], &ring_xy[slot+start_x], size_x);
+            sub_row_s32(&acc_yy[start_x], &ring_yy[slot+start_x], size_x);
+        }
+
+        //horizontal box filter as a sum of shifted rows
+        memcpy(&ring_xx[slot+start_x], &prod_xx[start_x-radius], size_x*sizeof(int32_t));
+        memcpy(&ring_xy[slot+start_x], &prod_xy[start_x-radius], size_x*sizeof(int32_t));
+        memcpy(&ring_yy[slot+start_x], &prod_yy[start_x-radius], size_x*sizeof(int32_t));
+        for (uint k = 1; k < window; k++)
+        {
+            add_row_s32(&ring_xx[slot+start_x], &prod_xx[start_x-radius+k], size_x);
+            add_row_s32(&ring_xy[slot+start_x], &prod_xy[start_x-radius+k], size_x);
+            add_row_s32(&ring_yy[slot+start_x], &prod_yy[start_x-radius+k], size_x);
+        }
+
+        add_row_s32(&acc_xx[start_x], &ring_xx[slot+start_x], size_x);
+        add_row_s32(&acc_xy[start_x], &ring_xy[slot+start_x], size_x);
+        add_row_s32(&acc_yy[start_x], &ring_yy[slot+start_x], size_x);
+
+        //the window of rows y-2*radius to y is complete, its centre is y-radius
+        if(nb_rows >= window-1){
+            uint out_idx = (y-radius)*width+start_x;
+            memcpy(&tensor->sum_xx[out_idx], &acc_xx[start_x], size_x*sizeof(int32_t));
+            memcpy(&tensor->sum_xy[out_idx], &acc_xy[start_x], size_x*sizeof(int32_t));
+            memcpy(&tensor->sum_yy[out_idx], &acc_yy[start_x], size_x*sizeof(int32_t));
+        }
+    }
+}
+
+void free_structure_tensor(structure_tensor_t *tensor){
+    free(tensor->sum_xx);
+    free(tensor->sum_xy);
+    free(tensor->sum_yy);
+    free(tensor->products);
+    free(tensor->ring);
+    free(tensor->acc);
+}
+
+//products of the central difference gradients for one row, from x=1 to width-2
+void gradient_products_row(uint8_t *row_above, uint8_t *row, uint8_t *row_below, uint width, int32_t *prod_xx, int32_t *prod_xy, int32_t *prod_yy){
+    uint x = 1;
+#ifdef __ARM_NEON
+    for (; x+8 <= width-1; x+=8)
+    {
+        //the difference of two uint8 fits in a int16
+        int16x8_t ix = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(&row[x+1]), vld1_u8(&row[x-1])));
+        int16x8_t iy = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(&row_below[x]), vld1_u8(&row_above[x])));
+
+        vst1q_s32(&prod_xx[x], vmull_s16(vget_low_s16(ix), vget_low_s16(ix)));
+        vst1q_s32(&prod_xx[x+4], vmull_s16(vget_high_s16(ix), vget_high_s16(ix)));
+        vst1q_s32(&prod_xy[x], vmull_s16(vget_low_s16(ix), vget_low_s16(iy)));
+        vst1q_s32(&prod_xy[x+4], vmull_s16(vget_high_s16(ix), vget_high_s16(iy)));
+        vst1q_s32(&prod_yy[x], vmull_s16(vget_low_s16(iy), vget_low_s16(iy)));
+        vst1q_s32(&prod_yy[x+4], vmull_s16(vget_high_s16(iy), vget_high_s16(iy)));
+    }
+#endif
+    for (; x < width-1; x++)
+    {
+        int ix = row[x+1]-row[x-1];
+        int iy = row_below[x]-row_above[x];
+        prod_xx[x] = ix*ix;
+        prod_xy[x] = ix*iy;
+        prod_yy[x] = iy*iy;
+    }
+}
+
+void add_row_s32(int32_t *dest, int32_t *src, uint size){
+    uint i = 0;
+#ifdef __ARM_NEON
+    for (; i+4 <= size; i+=4)
+    {
+        vst1q_s32(&dest[i], vaddq_s32(vld1q_s32(&dest[i]), vld1q_s32(&src[i])));
+    }
+#endif
+    for (; i < size; i++)
+    {
+        dest[i] += src[i];
+    }
+}
+
+void sub_row_s32(int32_t *dest, int32_t *src, uint size){
+    uint i = 0;
+#ifdef __ARM_NEON
+    for (; i+4 <= size; i+=4)
+    {
+        vst1q_s32(&dest[i], vsubq_s32(vld1q_s32(&dest[i]), vld1q_s32(&src[i])));
+    }
+#endif
+    for (; i < size; i++)
+    {
+        dest[i] -= src[i];
+    }
+}
+
+//smallest eigenvalue of the structure tensor (shi-tomasi) or harris response det-k*trace^2
+inline float corner_response(structure_tensor_t *tensor, uint idx, uint type){
+    float sxx = tensor->sum_xx[idx];
+    float sxy = tensor->sum_xy[idx];
+    float syy = tensor->sum_yy[idx];
+
+    if(type == CORNER_RESPONSE_HARRIS){
+        return sxx*syy-sxy*sxy-HARRIS_K*(sxx+syy)*(sxx+syy);
+    }
+
+    float half_diff = (sxx-syy)*0.5f;
+    return (sxx+syy)*0.5f-sqrtf(half_diff*half_diff+sxy*sxy);
+}
+
+void corner_response_at_points(structure_tensor_t *tensor, feature_point_t *points, uint nb_points, uint type){
+    for (size_t ipt = 0; ipt < nb_points; ipt++)
+    {
+        points[ipt].response = corner_response(tensor, points[ipt].y*tensor->width+points[ipt].x, type);
+    }
+}
+
+//response for every pixel, response must hold width*height floats
+void corner_response_dense(structure_tensor_t *tensor, float *response, uint type){
+    for (size_t i = 0; i < tensor->width*tensor->height; i++)
+    {
+        response[i] = corner_response(tensor, i, type);
+    }
+}
+
+//strongest first, ties broken by position so the selection does not depend on the sort
+int compare_points_response(const void *a, const void *b){
+    const feature_point_t *pt_a = a;
+    const feature_point_t *pt_b = b;
+
+    if(pt_a->response != pt_b->response){
+        return pt_a->response < pt_b->response ? 1 : -1;
+    }
+    if(pt_a->y != pt_b->y){
+        return pt_a->y-pt_b->y;
+    }
+    return pt_a->x-pt_b->x;
+}
+
+void keep_strongest_points(feature_point_t *points, uint *nb_points, uint max_points){
+    qsort(points, *nb_points, sizeof(feature_point_t), compare_points_response);
+
+    if(*nb_points > max_points){
+        *nb_points = max_points;
+    }
+}
+
+//pairs of offsets (xa, ya, xb, yb) compared for each bit of the descriptor
+static int8_t brief_pattern[DESCRIPTOR_BITS*4];
+
+//random pairs with a gaussian-like distribution around the centre, as in the BRIEF paper
+//the seed is fixed, since descriptors of different frames must use the same pattern
+void init_brief_pattern(){
+    uint32_t seed = 0x2545F491;
+
+    for (size_t i = 0; i < DESCRIPTOR_BITS*4; i++)
+    {
+        //sum of uniform values approximates a gaussian
+        int sum = 0;
+        for (size_t k = 0; k < 4; k++)
+        {
+            seed = seed*1664525+1013904223;
+            sum += (int)((seed>>16)%(2*DESCRIPTOR_PATCH_RADIUS+1))-DESCRIPTOR_PATCH_RADIUS;
+        }
+
+        int offset = sum/3;
+        if(offset > DESCRIPTOR_PATCH_RADIUS){
+            offset = DESCRIPTOR_PATCH_RADIUS;
+        }
+        if(offset < -DESCRIPTOR_PATCH_RADIUS){
+            offset = -DESCRIPTOR_PATCH_RADIUS;
+        }
+        brief_pattern[i] = offset;
+    }
+}
+
+//points must be at least DESCRIPTOR_PATCH_RADIUS pixels away from the border, find_fast_points keeps 10
+void compute_brief_descriptors(image_grayscale_t *image, feature_point_t *points, uint nb_points){
+    //the pattern as offsets in the image buffer, only depends on the width of the level
+    int offsets_a[DESCRIPTOR_BITS];
+    int offsets_b[DESCRIPTOR_BITS];
+
+    for (size_t i = 0; i < DESCRIPTOR_BITS; i++)
+    {
+        offsets_a[i] = brief_pattern[i*4+1]*image->width+brief_pattern[i*4];
+        offsets_b[i] = brief_pattern[i*4+3]*image->width+brief_pattern[i*4+2];
+    }
+
+    for (size_t ipt = 0; ipt < nb_points; ipt++)
+    {
+        uint8_t *centre = &image->img[points[ipt].y*image->width+points[ipt].x];
+
+        for (size_t w = 0; w < DESCRIPTOR_BITS/64; w++)
+        {
+            uint64_t word = 0;
+            for (size_t b = 0; b < 64; b++)
+            {
+                uint bit_idx = w*64+b;
+                word |= (uint64_t)(centre[offsets_a[bit_idx]] < centre[offsets_b[bit_idx]]) << b;
+            }
+            points[ipt].descriptor.bits[w] = word;
+        }
+    }
+}
+
+//number of different bits, using the hardware population count
+inline uint hamming_distance(feature_descriptor_t *desc_a, feature_descriptor_t *desc_b){
+#ifdef __ARM_NEON
+    uint8x16_t diff_0 = veorq_u8(vld1q_u8((uint8_t*)&desc_a->bits[0]), vld1q_u8((uint8_t*)&desc_b->bits[0]));
+    uint8x16_t diff_1 = veorq_u8(vld1q_u8((uint8_t*)&desc_a->bits[2]), vld1q_u8((uint8_t*)&desc_b->bits[2]));
+    //vcnt counts per byte, at most 16 per byte after the addition
+    uint8x16_t count = vaddq_u8(vcntq_u8(diff_0), vcntq_u8(diff_1));
+    uint64x2_t total = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(count)));
+    return vgetq_lane_u64(total, 0)+vgetq_lane_u64(total, 1);
+#else
+    uint dist = 0;
+    for (size_t w = 0; w < DESCRIPTOR_BITS/64; w++)
+    {
+        dist += __builtin_popcountll(desc_a->bits[w]^desc_b->bits[w]);
+    }
+    return dist;
+#endif
+}
+
+//for each point, find the previous point of the same level with the closest descriptor
+//only the previous points in the 3x3 neighbouring grid cells are considered
+//match_idx[i] is the index of the match in prev_points, or -1 if none is close enough
+void match_feature_points(feature_point_t *prev_points, uint nb_prev_points, feature_point_t *points, uint nb_points, uint width, uint height, int *match_idx){
+    uint nb_cells_x = width/MATCH_CELL_SIZE+1;
+    uint nb_cells_y = height/MATCH_CELL_SIZE+1;
+    uint nb_cells = nb_cells_x*nb_cells_y;
+
+    //sort the previous points by cell (counting sort), cell c has the points cell_start[c] to cell_start[c+1]
+    uint *cell_start = calloc(nb_cells+1, sizeof(uint));
+    uint *sorted_idx = malloc((nb_prev_points+1)*sizeof(uint));
+    uint *cell_of_point = malloc((nb_prev_points+1)*sizeof(uint));
+
+    for (size_t i = 0; i < nb_prev_points; i++)
+    {
+        uint cx = (prev_points[i].x<<prev_points[i].level)/MATCH_CELL_SIZE;
+        uint cy = (prev_points[i].y<<prev_points[i].level)/MATCH_CELL_SIZE;
+        cell_of_point[i] = cy*nb_cells_x+cx;
+        cell_start[cell_of_point[i]+1]++;
+    }
+
+    for (size_t c = 0; c < nb_cells; c++)
+    {
+        cell_start[c+1] += cell_start[c];
+    }
+
+    uint *cell_fill = malloc(nb_cells*sizeof(uint));
+    memcpy(cell_fill, cell_start, nb_cells*sizeof(uint));
+    for (size_t i = 0; i < nb_prev_points; i++)
+    {
+        sorted_idx[cell_fill[cell_of_point[i]]++] = i;
+    }
+
+    for (size_t ipt = 0; ipt < nb_points; ipt++)
+    {
+        int cx = (points[ipt].x<<points[ipt].level)/MATCH_CELL_SIZE;
+        int cy = (points[ipt].y<<points[ipt].level)/MATCH_CELL_SIZE;
+
+        uint best_dist = MATCH_MAX_DISTANCE+1;
+        int best_idx = -1;
+
+        for (int ncy = cy-1; ncy <= cy+1; ncy++)
+        {
+            for (int ncx = cx-1; ncx <= cx+1; ncx++)
+            {
+                if(ncx < 0 || ncy < 0 || ncx >= nb_cells_x || ncy >= nb_cells_y){
+                    continue;
+                }
+
+                uint cell = ncy*nb_cells_x+ncx;
+                for (size_t k = cell_start[cell]; k < cell_start[cell+1]; k++)
+                {
+                    uint prev_idx = sorted_idx[k];
+                    if(prev_points[prev_idx].level != points[ipt].level){
+                        continue;
+                    }
+
+                    uint dist = hamming_distance(&points[ipt].descriptor, &prev_points[prev_idx].descriptor);
+                    if(dist < best_dist){
+                        best_dist = dist;
+                        best_idx = prev_idx;
+                    }
+                }
+            }
+        }
+
+        match_idx[ipt] = best_idx;
+    }
+
+    free(cell_start);
+    free(sorted_idx);
+    free(cell_of_point);
+    free(cell_fill);
 }
\ No newline at end of file
@@ -8,8 +8,10 @@
 #include <semaphore.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
 
-//camera/mmal/raspberry specific libraries
+//camera/mmal/raspberry specific libraries, not needed by a replay only build (-DFRAME_SOURCE_NO_CAMERA)
+#ifndef FRAME_SOURCE_NO_CAMERA
 #include "bcm_host.h"
 #include "mmal.h"
 #include "util/mmal_default_components.h"
@@ -19,8 +21,11 @@
 #include "interface/vcos/vcos.h"
 
 #include "../common/camera_mmal.h"
+#endif
+
 #include "../common/image.h"
 #include "../common/edge_detect.h"
+#include "../common/frame_source.h"
 
 //will affect framerate, it seems that if framerate is higher than possible shutter speed, it will be automatically lowered
 #define CAMERA_SHUTTER_SPEED 15000
@@ -33,7 +38,14 @@
 #define CAMERA_RESOLUTION_X 480
 #define CAMERA_RESOLUTION_Y 480
 
+//a size of hough transform similar to the size of the image
+//give the best results
+#define SIZE_HOUGH_X 400
+#define SIZE_HOUGH_Y 400
+
+#ifndef FRAME_SOURCE_NO_CAMERA
 #define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n\r");}
+#endif
 
 char *fbp;
 uint32_t screen_size_x = 0;
@@ -41,8 +53,6 @@ uint32_t screen_size_y = 0;
 
 static int cur_sec;
 
-extern sem_t semaphore_cam_buffer;
-
 void init_time_keeping();
 float get_cur_time();
 
@@ -52,15 +62,32 @@ void increment_hough_value(image_grayscale32_t *img, uint x, uint y, uint diag);
 void draw_inverse_hough_transform(image_rgb_t *img_out, image_grayscale32_t *hough_transf, uint threshold);
 void draw_inverse_hough_transform_point(image_rgb_t *img_out, float theta, float rho);
 
-void main(void){
+void process_frame(image_rgb_t *img, image_rgb_t *img_draw);
+
+void main(int argc, char **argv){
+#ifndef FRAME_SOURCE_NO_CAMERA
     //sets up the framebuffer, will draw
     framebuffer_init(&fbp, &screen_size_x, &screen_size_y);
-
-    MMAL_PORT_T *video_port;
-    MMAL_POOL_T *pool;
-    MMAL_BUFFER_HEADER_T *buffer;
-
-    camera_mmal_init(&video_port, &pool, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#endif
+
+    //frames from the camera, or replayed in a loop from a raw rgb sequence given as argument
+    //at the camera framerate or the one given after the sequence (0: as fast as possible)
+    //a replay only build needs the sequence and displays nothing
+    frame_source_t source;
+    if(argc > 1){
+        float framerate = argc > 2 ? atof(argv[2]) : MAX_CAMERA_FRAMERATE;
+        if(frame_source_replay_init(&source, argv[1], CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, 3, framerate, 1) != 0){
+            exit(1);
+        }
+    }
+    else{
+#ifndef FRAME_SOURCE_NO_CAMERA
+        frame_source_camera_init(&source, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#else
+        fprintf(stderr, "usage: %s sequence.raw [framerate]\n\r", argv[0]);
+        exit(1);
+#endif
+    }
 
     float time_since_report = 0.0f;
     int count_frames = 0;
@@ -76,44 +103,32 @@ void main(void){
     img.width = CAMERA_RESOLUTION_X;
     img.height = CAMERA_RESOLUTION_Y;
 
-    image_grayscale_t img_gray;
-    image_grayscale_t img_canny;
-
-    image_grayscale32_t img_hough_trans;
-
-    //a size of hough transform similar to the size of the image
-    //give the best results
-    #define SIZE_HOUGH_X 400
-    #define SIZE_HOUGH_Y 400
+    //the lines are drawn on the camera buffer itself, a replayed frame is read only and is drawn on a copy
+    image_rgb_t img_draw;
+    img_draw.width = img.width;
+    img_draw.height = img.height;
+    img_draw.img = source.writable ? NULL : malloc(img.width*img.height*3);
 
     while(1){
         start_time = get_cur_time();
 
-        //wait until a buffer has been received
-        sem_wait(&semaphore_cam_buffer);
-
-        buffer = mmal_queue_get(pool->queue);
-
-        img.img = buffer->data;
-
-        image_convert_to_grayscale(&img, &img_gray);
-
-        get_canny(&img_gray, &img_canny);
-
-        //will transform the edge image (canny) into the hough tranform
-        get_hough_transform(&img_canny, &img_hough_trans, SIZE_HOUGH_X, SIZE_HOUGH_Y);
-
-        uint hough_threshold = img.height/2;
-        draw_inverse_hough_transform(&img, &img_hough_trans, hough_threshold);
+        img.img = frame_source_get(&source);
+        if(source.writable){
+            img_draw.img = img.img;
+        }
 
+        process_frame(&img, &img_draw);
 
         // save to raw file
-        // save_image_rgb_to_file(&img, "img.raw");
+        // save_image_rgb_to_file(&img_draw, "img.raw");
 
-        image_draw(&img, fbp, screen_size_x);
+#ifndef FRAME_SOURCE_NO_CAMERA
+        //before the release, img_draw can be the camera buffer
+        image_draw(&img_draw, fbp, screen_size_x);
+#endif
 
-        //Send back the buffer to the port to be filled with an image again
-        mmal_port_send_buffer(video_port, buffer);
+        //gives back the frame, the camera can fill its buffer with an image again
+        frame_source_release(&source);
 
 
         end_time = get_cur_time();
@@ -129,14 +144,35 @@ void main(void){
         }
 
         // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
+    }
+
+    //todo free the mmal and framebuffer ressources cleanly
+}
+
+//work of the main loop on a frame, the lines found in img are drawn on a copy of it in img_draw
+//img_draw must already hold a frame of the same size
+void process_frame(image_rgb_t *img, image_rgb_t *img_draw){
+    image_grayscale_t img_gray;
+    image_grayscale_t img_canny;
+    image_grayscale32_t img_hough_trans;
+
+    image_convert_to_grayscale(img, &img_gray);
 
-        free(img_gray.img);
-        free(img_canny.img);
-        free(img_hough_trans.img);
+    get_canny(&img_gray, &img_canny);
 
+    //will transform the edge image (canny) into the hough tranform
+    get_hough_transform(&img_canny, &img_hough_trans, SIZE_HOUGH_X, SIZE_HOUGH_Y);
+
+    uint hough_threshold = img->height/2;
+    //img_draw is the frame itself when the source is writable, a copy of it otherwise
+    if(img_draw->img != img->img){
+        memcpy(img_draw->img, img->img, img->width*img->height*3);
     }
+    draw_inverse_hough_transform(img_draw, &img_hough_trans, hough_threshold);
 
-    //todo free the mmal and framebuffer ressources cleanly
+    free(img_gray.img);
+    free(img_canny.img);
+    free(img_hough_trans.img);
 }
 
 //clock_gettime is a better time keeping mechanism than other on the raspberry pi
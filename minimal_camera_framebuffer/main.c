@@ -8,7 +8,8 @@
 #include <semaphore.h>
 #include <time.h>
 
-//camera/mmal/raspberry specific libraries
+//camera/mmal/raspberry specific libraries, not needed by a replay only build (-DFRAME_SOURCE_NO_CAMERA)
+#ifndef FRAME_SOURCE_NO_CAMERA
 #include "bcm_host.h"
 #include "mmal.h"
 #include "util/mmal_default_components.h"
@@ -18,6 +19,9 @@
 #include "interface/vcos/vcos.h"
 
 #include "../common/camera_mmal.h"
+#endif
+
+#include "../common/frame_source.h"
 
 //will affect framerate, it seems that if framerate is higher than possible shutter speed, it will be automatically lowered
 #define CAMERA_SHUTTER_SPEED 25000
@@ -36,20 +40,33 @@ uint32_t screen_size_y = 0;
 
 static int cur_sec;
 
-extern sem_t semaphore_cam_buffer;
-
 void init_time_keeping();
 float get_cur_time();
 
-void main(void){
-    MMAL_PORT_T *video_port;
-    MMAL_POOL_T *pool;
-    MMAL_BUFFER_HEADER_T *buffer;
-
+void main(int argc, char **argv){
+#ifndef FRAME_SOURCE_NO_CAMERA
     //sets up the framebuffer, will draw
     framebuffer_init(&fbp, &screen_size_x, &screen_size_y);
-
-    camera_mmal_init(&video_port, &pool, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#endif
+
+    //frames from the camera, or replayed in a loop from a raw rgb sequence given as argument
+    //at the camera framerate or the one given after the sequence (0: as fast as possible)
+    //a replay only build needs the sequence and displays nothing
+    frame_source_t source;
+    if(argc > 1){
+        float framerate = argc > 2 ? atof(argv[2]) : MAX_CAMERA_FRAMERATE;
+        if(frame_source_replay_init(&source, argv[1], CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, 3, framerate, 1) != 0){
+            exit(1);
+        }
+    }
+    else{
+#ifndef FRAME_SOURCE_NO_CAMERA
+        frame_source_camera_init(&source, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#else
+        fprintf(stderr, "usage: %s sequence.raw [framerate]\n\r", argv[0]);
+        exit(1);
+#endif
+    }
 
     // printf("out\n");
     float time_since_report = 0.0f;
@@ -65,13 +82,11 @@ void main(void){
     while(1){
         start_time = get_cur_time();
 
-        //wait until a buffer has been received
-        sem_wait(&semaphore_cam_buffer);
-
-        buffer = mmal_queue_get(pool->queue);
+        uint8_t *frame = frame_source_get(&source);
 
         start_copy_time = get_cur_time();
 
+#ifndef FRAME_SOURCE_NO_CAMERA
         //draw the image on the top left corner of the framebuffer
         //would be less costly to limit frambuffer size and just do a memcpy
         int img_idx = 0;
@@ -79,20 +94,21 @@ void main(void){
         for(int i = 0; i < CAMERA_RESOLUTION_Y; i++){
            for(int j = 0; j < CAMERA_RESOLUTION_X; j++){
                //seem that R and B components are inverted
-               fbp[framebuffer_idx] = buffer->data[img_idx+2];
-               fbp[framebuffer_idx+1] = buffer->data[img_idx+1];
-               fbp[framebuffer_idx+2] = buffer->data[img_idx+0];
+               fbp[framebuffer_idx] = frame[img_idx+2];
+               fbp[framebuffer_idx+1] = frame[img_idx+1];
+               fbp[framebuffer_idx+2] = frame[img_idx+0];
                img_idx +=  3;
                framebuffer_idx += 3;
            }
            framebuffer_idx = i*screen_size_x*3;
         }
+#endif
 
         end_copy_time = get_cur_time();
         // printf("frame copy time: %f\n\r", end_copy_time-start_copy_time);
 
-        //Send back the buffer to the port to be filled with an image again
-        mmal_port_send_buffer(video_port, buffer);
+        //gives back the frame, the camera can fill its buffer with an image again
+        frame_source_release(&source);
 
         end_time = get_cur_time();
         float seconds = (float)(end_time - start_time);
@@ -8,8 +8,16 @@
 #include <semaphore.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
 
-//camera/mmal/raspberry specific libraries
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//camera/mmal/raspberry specific libraries, not needed by a replay only build (-DFRAME_SOURCE_NO_CAMERA)
+#ifndef FRAME_SOURCE_NO_CAMERA
 #include "bcm_host.h"
 #include "mmal.h"
 #include "util/mmal_default_components.h"
@@ -19,7 +27,10 @@
 #include "interface/vcos/vcos.h"
 
 #include "../common/camera_mmal.h"
+#endif
+
 #include "../common/image.h"
+#include "../common/frame_source.h"
 
 //will affect framerate, it seems that if framerate is higher than possible shutter speed, it will be automatically lowered
 #define CAMERA_SHUTTER_SPEED 15000
@@ -32,7 +43,162 @@
 #define CAMERA_RESOLUTION_X 640
 #define CAMERA_RESOLUTION_Y 480
 
+#ifndef FRAME_SOURCE_NO_CAMERA
 #define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n\r");}
+#endif
+
+//sparse: calc_optical_flow on each point of the grid
+//dense: derivatives computed once per frame, flow solved at every pixel with integral images of their products
+#define FLOW_MODE_SPARSE 0
+#define FLOW_MODE_DENSE 1
+#define FLOW_MODE_PYRAMIDAL 2 //iterative lucas kanade on a gaussian pyramid, for larger motions
+#define FLOW_MODE_BLOCK_MATCHING 3 //motion of blocks found by diamond search, as in video encoders
+#define FLOW_MODE_SPARSE_BATCH 4 //same as sparse, with an integer solver working on several points at once
+#define FLOW_MODE_HORN_SCHUNCK 5 //smooth dense flow, variational method solved with multigrid
+#define FLOW_MODE FLOW_MODE_SPARSE_BATCH
+
+//the sparse modes only read windows around the grid points, only the tiles of the grayscale image under them are converted
+#define LAZY_GRAYSCALE (FLOW_MODE == FLOW_MODE_SPARSE || FLOW_MODE == FLOW_MODE_SPARSE_BATCH)
+
+//window of calc_optical_flow, MUST BE AN ODD VALUE
+#define WINDOW_SIZE 5
+
+//same 5x5 window as calc_optical_flow
+#define DENSE_WINDOW_RADIUS 2
+//windows with a smaller determinant (in the unnormalised sums) get no flow, avoids divisions by 0
+#define DENSE_MIN_DET 1.0f
+//sums of dx*dx, dx*dy, dy*dy, dx*dt and dy*dt
+#define NB_FLOW_PRODUCTS 5
+
+//pyramidal mode, motions up to about (2^PYR_LEVELS)*PYR_WINDOW_RADIUS pixels can be followed
+#define PYR_LEVELS 3
+#define PYR_WINDOW_RADIUS 3
+#define PYR_MAX_ITERATIONS 8
+#define PYR_EPSILON 0.03f //iterations stop when the update is smaller, in pixels
+#define PYR_MIN_CONFIDENCE 4.0f //vectors with a smaller confidence are not drawn
+
+typedef struct flow_vector_t{
+    float u_x;
+    float u_y;
+    //smallest eigenvalue of the structure tensor of the window (per pixel), 0 if the point was lost
+    float confidence;
+} flow_vector_t;
+
+//batched sparse mode, points are solved BATCH_LANES at a time
+#define BATCH_LANES 4
+//windows whose matrix (with the normalised derivatives of calc_optical_flow) has a smaller determinant get no flow
+//the 0.001 of the disabled check of calc_optical_flow rejects nearly every point of a natural image
+#define BATCH_MIN_DET 0.0000001f
+//with neon the windows of the 4 points are gathered with vectors, a patch row (WINDOW_SIZE+2 pixels) fits in 8 lanes
+#if defined(__ARM_NEON) && BATCH_LANES == 4 && WINDOW_SIZE+2 <= 8
+#define BATCH_NEON_GATHER 1
+#else
+#define BATCH_NEON_GATHER 0
+#endif
+
+//block matching mode
+#define BM_BLOCK_SIZE 16
+#define BM_SEARCH_RANGE 16 //maximum displacement on each axis
+#define BM_MAX_DIAMOND_STEPS 16
+#define BM_GOOD_ENOUGH_SAD 2 //per pixel, a candidate this good stops the search
+
+typedef struct motion_vector_t{
+    int x;
+    int y;
+    uint32_t sad;
+} motion_vector_t;
+
+//horn schunck mode, one multigrid v-cycle per frame starting from the flow of the previous frame
+#define HS_LEVELS 4
+#define HS_ALPHA 200.0f //weight of the smoothness of the flow, in intensity^2
+#define HS_OMEGA 1.5f //over-relaxation factor of the SOR iterations
+#define HS_PRE_SMOOTHING 2 //red-black iterations on each level before going to the coarser one
+#define HS_POST_SMOOTHING 2 //and after its correction
+#define HS_COARSE_ITERATIONS 8 //on the coarsest level
+
+//horn schunck system on one level of the multigrid, for each pixel:
+//diag_u*u + a12*v - alpha*(sum of the 4 neighbours of u) = b1
+//a12*u + diag_v*v - alpha*(sum of the 4 neighbours of v) = b2
+//on the finest level (u, v) is the flow, on the others it is a correction of the finer level
+typedef struct hs_level_t{
+    int width;
+    int height;
+    float alpha;
+    float *u;
+    float *v;
+    float *diag_u;
+    float *diag_v;
+    float *inv_diag_u;
+    float *inv_diag_v;
+    float *a12;
+    float *b1;
+    float *b2;
+} hs_level_t;
+
+//global motion: a model of the camera motion is fitted on the vectors with ransac
+//vectors that do not follow it (moving objects) are drawn in another colour
+#define GLOBAL_MOTION 1
+#define GM_MODEL_AFFINE 0 //6 parameters, 3 vectors per hypothesis
+#define GM_MODEL_HOMOGRAPHY 1 //8 parameters, 4 vectors per hypothesis
+#define GM_MODEL GM_MODEL_AFFINE
+#define GM_INLIER_THRESHOLD 1.5f //distance in pixels between a vector and the model
+#define GM_CONFIDENCE 0.99f //probability of drawing at least one sample without outliers
+#define GM_MAX_ITERATIONS 500
+#define GM_MIN_VECTORS 8
+
+typedef struct global_motion_t{
+    //maps a point of the previous image to the current one, 3x3 row major, last row is 0 0 1 for an affine model
+    float h[9];
+    uint nb_inliers;
+} global_motion_t;
+
+//derivatives of an image pair, same definitions as calc_dx, calc_dy and calc_dt without the normalisation
+//dx and dy are 6 times calc_dx and calc_dy, dt is 9 times calc_dt, the border pixels are 0
+typedef struct flow_derivatives_t{
+    int width;
+    int height;
+    int16_t *dx;
+    int16_t *dy;
+    int16_t *dt;
+} flow_derivatives_t;
+
+//buffers of the horn schunck mode, allocated once for a resolution by horn_schunck_init
+typedef struct horn_schunck_t{
+    hs_level_t levels[HS_LEVELS];
+    flow_derivatives_t deriv;
+} horn_schunck_t;
+
+//buffers of the dense mode, allocated once for a resolution by dense_flow_init
+typedef struct dense_flow_t{
+    flow_derivatives_t deriv;
+    int32_t *column_sums; //for each derivative product, the sums of each column over the rows of the window
+    float *flow_x;
+    float *flow_y;
+} dense_flow_t;
+
+//what the main loop keeps from a frame to the next, only the buffers of FLOW_MODE are allocated
+typedef struct flow_state_t{
+    //two grayscale planes allocated once, the current and previous images swap at each frame
+    //no copy of the previous rgb image is kept
+    image_grayscale_lazy_t lazy_planes[2];
+    image_grayscale_t gray_planes[2];
+    uint cur_plane;
+    image_grayscale_t img_gray;
+    uint has_prev_frame;
+
+    //block matching: the vectors of the previous frame are used as candidates for the search
+    motion_vector_t *field;
+    motion_vector_t *prev_field;
+
+    //dense: flow of every pixel, the grid only samples it for the display
+    dense_flow_t dense;
+
+    //horn schunck: the flow is kept between frames as a starting point
+    horn_schunck_t hs;
+
+    //pyramidal: pyramid of the previous frame
+    image_grayscale_t pyramid[PYR_LEVELS];
+} flow_state_t;
 
 char *fbp;
 uint32_t screen_size_x = 0;
@@ -40,8 +206,6 @@ uint32_t screen_size_y = 0;
 
 static int cur_sec;
 
-extern sem_t semaphore_cam_buffer;
-
 void init_time_keeping();
 float get_cur_time();
 
@@ -51,16 +215,68 @@ float calc_dt(image_grayscale_t *img, image_grayscale_t *img_prev, uint pos_x, u
 
 void calc_optical_flow(image_grayscale_t *img, image_grayscale_t *img_prev, uint pos_x, uint pos_y, float *u_x, float *u_y);
 
-void main(void){
+void flow_derivatives_init(flow_derivatives_t *deriv, int width, int height);
+void compute_flow_derivatives(image_grayscale_t *img, image_grayscale_t *img_prev, flow_derivatives_t *deriv);
+void free_flow_derivatives(flow_derivatives_t *deriv);
+void dense_flow_init(dense_flow_t *dense, int width, int height);
+void dense_flow_free(dense_flow_t *dense);
+void dense_update_columns(flow_derivatives_t *deriv, int row_in, int row_out, int32_t *column_sums);
+void dense_solve_row(int32_t *column_sums, int width, float *flow_x, float *flow_y);
+void calc_dense_optical_flow(dense_flow_t *dense);
+
+void build_gaussian_pyramid(image_grayscale_t *img, image_grayscale_t *pyramid, uint nb_levels);
+void free_gaussian_pyramid(image_grayscale_t *pyramid, uint nb_levels);
+uint sample_window_bilinear(image_grayscale_t *img, float pos_x, float pos_y, int radius, int32_t *window);
+void calc_pyramidal_optical_flow(image_grayscale_t *pyramid, image_grayscale_t *pyramid_prev, uint nb_levels, float pos_x, float pos_y, flow_vector_t *flow);
+
+void window_derivatives(image_grayscale_t *img, image_grayscale_t *img_prev, uint pos_x, uint pos_y, int16_t *dx, int16_t *dy, int16_t *dt, uint lane);
+void calc_optical_flow_batch(image_grayscale_t *img, image_grayscale_t *img_prev, uint16_t *pos_x, uint16_t *pos_y, uint nb_points, float *u_x, float *u_y);
+
+void horn_schunck_init(horn_schunck_t *hs, int width, int height);
+void horn_schunck_free(horn_schunck_t *hs);
+void horn_schunck_coefficients(hs_level_t *level);
+void horn_schunck_sor_row(hs_level_t *level, int y, uint colour);
+void horn_schunck_smooth(hs_level_t *level, uint nb_iterations);
+void horn_schunck_vcycle(hs_level_t *levels, uint level_idx);
+void calc_horn_schunck_flow(image_grayscale_t *img, image_grayscale_t *img_prev, horn_schunck_t *hs);
+
+uint solve_linear_system(double *a, double *b, uint n);
+uint fit_motion_model(float *src_x, float *src_y, float *dst_x, float *dst_y, uint *indices, uint nb, uint model, float *h);
+uint count_motion_inliers(float *h, float *src_x, float *src_y, float *dst_x, float *dst_y, uint nb, float threshold, uint best, uint8_t *inlier_mask);
+uint estimate_global_motion(float *pos_x, float *pos_y, float *u_x, float *u_y, uint nb_vectors, uint model, global_motion_t *motion, uint8_t *inlier_mask);
+void global_motion_at(global_motion_t *motion, float pos_x, float pos_y, float *u_x, float *u_y);
+
+uint32_t block_matching_sad(image_grayscale_t *img, image_grayscale_t *img_prev, int block_x, int block_y, int vec_x, int vec_y);
+void block_matching_motion(image_grayscale_t *img, image_grayscale_t *img_prev, motion_vector_t *field, motion_vector_t *prev_field);
+
+void flow_state_init(flow_state_t *state, uint width, uint height);
+void flow_state_free(flow_state_t *state);
+void process_frame(flow_state_t *state, image_rgb_t *img, image_rgb_t *img_draw);
+
+void main(int argc, char **argv){
+#ifndef FRAME_SOURCE_NO_CAMERA
     //sets up the framebuffer, will draw
     framebuffer_init(&fbp, &screen_size_x, &screen_size_y);
-
-    MMAL_PORT_T *video_port;
-    MMAL_POOL_T *pool;
-    MMAL_BUFFER_HEADER_T *buffer;
-    MMAL_BUFFER_HEADER_T *prev_buffer;
-
-    camera_mmal_init(&video_port, &pool, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#endif
+
+    //frames from the camera, or replayed in a loop from a raw rgb sequence given as argument
+    //at the camera framerate or the one given after the sequence (0: as fast as possible)
+    //a replay only build needs the sequence and displays nothing
+    frame_source_t source;
+    if(argc > 1){
+        float framerate = argc > 2 ? atof(argv[2]) : MAX_CAMERA_FRAMERATE;
+        if(frame_source_replay_init(&source, argv[1], CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, 3, framerate, 1) != 0){
+            exit(1);
+        }
+    }
+    else{
+#ifndef FRAME_SOURCE_NO_CAMERA
+        frame_source_camera_init(&source, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#else
+        fprintf(stderr, "usage: %s sequence.raw [framerate]\n\r", argv[0]);
+        exit(1);
+#endif
+    }
 
     float time_since_report = 0.0f;
     int count_frames = 0;
@@ -76,115 +292,329 @@ void main(void){
     img.width = CAMERA_RESOLUTION_X;
     img.height = CAMERA_RESOLUTION_Y;
 
-    image_rgb_t img_prev;
-    img_prev.width = CAMERA_RESOLUTION_X;
-    img_prev.height = CAMERA_RESOLUTION_Y;
+    //the flow is drawn on the camera buffer itself, a replayed frame is read only and is drawn on a copy
+    image_rgb_t img_draw;
+    img_draw.width = img.width;
+    img_draw.height = img.height;
+    img_draw.img = source.writable ? NULL : malloc(img.width*img.height*3);
 
-    //allocate mem for previous image, it will just be memcpyied every image from the current image
-    img_prev.img = malloc(img.width*img.height*3);
+    flow_state_t state;
+    flow_state_init(&state, img.width, img.height);
 
-    image_grayscale_t img_gray_prev;
-    image_grayscale_t img_gray;
+    while(1){
+        start_time = get_cur_time();
 
-    sem_wait(&semaphore_cam_buffer);
+        img.img = frame_source_get(&source);
+        if(source.writable){
+            img_draw.img = img.img;
+        }
 
-    buffer = mmal_queue_get(pool->queue);
+        process_frame(&state, &img, &img_draw);
 
-    img.img = buffer->data;
+        // save to raw file
+        // save_image_rgb_to_file(&img_draw, "img.raw");
 
-    image_convert_to_grayscale(&img, &img_gray);
+#ifndef FRAME_SOURCE_NO_CAMERA
+        //before the release, img_draw can be the camera buffer
+        image_draw(&img_draw, fbp, screen_size_x);
+#endif
 
-    while(1){
-        start_time = get_cur_time();
+        //gives back the frame, the camera can fill its buffer with an image again
+        frame_source_release(&source);
 
-        //wait until a buffer has been received
-        sem_wait(&semaphore_cam_buffer);
 
-        buffer = mmal_queue_get(pool->queue);
+        end_time = get_cur_time();
+        float seconds = (float)(end_time - start_time);
+        time_since_report += seconds;
+        count_frames++;
 
-        //keep old image in memory
-        memcpy(img_prev.img, img.img, img.width*img.height*3);
+        if(time_since_report > 1.0f){
+            float framerate = count_frames/time_since_report;
+            printf("frequency: %fHz\n\r", framerate);
+            time_since_report = 0;
+            count_frames = 0;
+        }
 
-        //update current image
-        img.img = buffer->data;
+        // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
+    }
 
-        img_gray_prev = img_gray;
-        image_convert_to_grayscale(&img, &img_gray);
+    //todo free the mmal and framebuffer ressources cleanly
+}
 
-        uint col[3] = {0, 255, 0};
+void flow_state_init(flow_state_t *state, uint width, uint height){
+#if LAZY_GRAYSCALE
+    image_grayscale_lazy_init(&state->lazy_planes[0], width, height);
+    image_grayscale_lazy_init(&state->lazy_planes[1], width, height);
+#else
+    for (size_t i = 0; i < 2; i++)
+    {
+        state->gray_planes[i].width = width;
+        state->gray_planes[i].height = height;
+        state->gray_planes[i].img = malloc(width*height);
+    }
+#endif
+    state->cur_plane = 0;
+    state->has_prev_frame = 0;
+
+#if FLOW_MODE == FLOW_MODE_BLOCK_MATCHING
+    uint nb_blocks = (width/BM_BLOCK_SIZE)*(height/BM_BLOCK_SIZE);
+    state->field = calloc(nb_blocks, sizeof(motion_vector_t));
+    state->prev_field = calloc(nb_blocks, sizeof(motion_vector_t));
+#endif
+
+#if FLOW_MODE == FLOW_MODE_DENSE
+    dense_flow_init(&state->dense, width, height);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_HORN_SCHUNCK
+    horn_schunck_init(&state->hs, width, height);
+#endif
+}
 
-        const uint space_between_points = 10;
+void flow_state_free(flow_state_t *state){
+#if LAZY_GRAYSCALE
+    image_grayscale_lazy_free(&state->lazy_planes[0]);
+    image_grayscale_lazy_free(&state->lazy_planes[1]);
+#else
+    free(state->gray_planes[0].img);
+    free(state->gray_planes[1].img);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_BLOCK_MATCHING
+    free(state->field);
+    free(state->prev_field);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_DENSE
+    dense_flow_free(&state->dense);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_HORN_SCHUNCK
+    horn_schunck_free(&state->hs);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_PYRAMIDAL
+    if(state->has_prev_frame){
+        free_gaussian_pyramid(state->pyramid, PYR_LEVELS);
+    }
+#endif
+}
 
-        //start and end *2 to avoid seg fault
-        for (uint i = space_between_points*2; i < img.width-space_between_points*2; i+=space_between_points)
-        {
-            for (uint j = space_between_points*2; j < img.height-space_between_points*2; j+=space_between_points){
-                //flow vector variables
-                float u_x, u_y;
-                calc_optical_flow(&img_gray, &img_gray_prev, i, j, &u_x, &u_y);
+//work of the main loop on a frame, the flow between the previous frame and img is drawn on a copy of img in img_draw
+//img_draw must already hold a frame of the same size, the first frame is drawn without flow
+void process_frame(flow_state_t *state, image_rgb_t *img, image_rgb_t *img_draw){
+    //update current image
+    image_grayscale_t img_gray_prev = state->img_gray;
+    state->cur_plane = 1-state->cur_plane;
+#if LAZY_GRAYSCALE
+    image_grayscale_lazy_reset(&state->lazy_planes[state->cur_plane], img);
+    state->img_gray = state->lazy_planes[state->cur_plane].gray;
+#else
+    state->img_gray = state->gray_planes[state->cur_plane];
+    image_convert_to_grayscale_buffer(img, &state->img_gray);
+#endif
+
+    if(!state->has_prev_frame){
+        state->has_prev_frame = 1;
+#if LAZY_GRAYSCALE
+        //the whole first image, the windows of the grid are then always converted in both images
+        image_grayscale_lazy_prefetch(&state->lazy_planes[state->cur_plane], 0, 0, img->width, img->height);
+#endif
+#if FLOW_MODE == FLOW_MODE_PYRAMIDAL
+        build_gaussian_pyramid(&state->img_gray, state->pyramid, PYR_LEVELS);
+#endif
+        if(img_draw->img != img->img){
+            memcpy(img_draw->img, img->img, img->width*img->height*3);
+        }
+        return;
+    }
 
-                //convert flow vector to polar for simpler handling
-                float angle = atan2(u_y, u_x);
-                float mag = sqrt(u_x*u_x+u_y*u_y);
+#if FLOW_MODE == FLOW_MODE_BLOCK_MATCHING
+    //one vector per block
+    const uint space_between_points = BM_BLOCK_SIZE;
+#else
+    const uint space_between_points = 10;
+#endif
+
+#if FLOW_MODE == FLOW_MODE_PYRAMIDAL
+    image_grayscale_t pyramid_prev[PYR_LEVELS];
+    memcpy(pyramid_prev, state->pyramid, sizeof(state->pyramid));
+    build_gaussian_pyramid(&state->img_gray, state->pyramid, PYR_LEVELS);
+
+    //large motions can be followed, so vectors are clamped further away
+    const uint max_magnitude = space_between_points*2;
+#else
+    const uint max_magnitude = space_between_points;
+#endif
+
+#if FLOW_MODE == FLOW_MODE_BLOCK_MATCHING
+    motion_vector_t *field_swap = state->prev_field;
+    state->prev_field = state->field;
+    state->field = field_swap;
+    block_matching_motion(&state->img_gray, &img_gray_prev, state->field, state->prev_field);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_DENSE
+    compute_flow_derivatives(&state->img_gray, &img_gray_prev, &state->dense.deriv);
+    calc_dense_optical_flow(&state->dense);
+#endif
+
+#if FLOW_MODE == FLOW_MODE_HORN_SCHUNCK
+    calc_horn_schunck_flow(&state->img_gray, &img_gray_prev, &state->hs);
+#endif
+
+#if LAZY_GRAYSCALE
+    //window of lucas kanade with one more pixel for the derivatives
+    const int window_radius = WINDOW_SIZE/2+1;
+    for (uint i = space_between_points*2; i < img->width-space_between_points*2; i+=space_between_points)
+    {
+        for (uint j = space_between_points*2; j < img->height-space_between_points*2; j+=space_between_points){
+            image_grayscale_lazy_prefetch(&state->lazy_planes[state->cur_plane], i-window_radius, j-window_radius, 2*window_radius+1, 2*window_radius+1);
+        }
+    }
+#endif
 
-                //clamp crazy vectors to avoid mess in the display
-                if(mag > space_between_points)
-                {
-                    mag = space_between_points;
-                }
+#if FLOW_MODE == FLOW_MODE_SPARSE_BATCH
+    //points of the grid as a structure of arrays, in the order of the display loop
+    uint nb_grid_points = 0;
+    uint16_t grid_x[(img->width/space_between_points)*(img->height/space_between_points)];
+    uint16_t grid_y[(img->width/space_between_points)*(img->height/space_between_points)];
+    float grid_u_x[(img->width/space_between_points)*(img->height/space_between_points)];
+    float grid_u_y[(img->width/space_between_points)*(img->height/space_between_points)];
 
-                //only draw significant vectors
-                if(mag >= 2){
-                    //draw a starting point in red
-                    for (int k = -1; k <= 1; k++)
-                    {
-                        for (int l = -1; l <= 1; l++)
-                        {
-                            image_set(&img_prev, i+k, j+l, 0, 255);
-                            image_set(&img_prev, i+k, j+l, 1, 0);
-                            image_set(&img_prev, i+k, j+l, 2, 0);
-                        }
+    for (uint i = space_between_points*2; i < img->width-space_between_points*2; i+=space_between_points)
+    {
+        for (uint j = space_between_points*2; j < img->height-space_between_points*2; j+=space_between_points){
+            grid_x[nb_grid_points] = i;
+            grid_y[nb_grid_points] = j;
+            nb_grid_points++;
+        }
+    }
 
-                    }
+    calc_optical_flow_batch(&state->img_gray, &img_gray_prev, grid_x, grid_y, nb_grid_points, grid_u_x, grid_u_y);
+    uint grid_idx = 0;
+#endif
 
-                    //draw the flow vector
-                    uint col_green[3] = {0, 255, 0};
+    //vectors of the grid, gathered before being drawn so the global motion can be fitted on all of them
+    uint max_vectors = (img->width/space_between_points)*(img->height/space_between_points);
+    float vec_x[max_vectors];
+    float vec_y[max_vectors];
+    float vec_u_x[max_vectors];
+    float vec_u_y[max_vectors];
+    uint nb_vectors = 0;
 
-                    int iu_x = mag*cos(angle);
-                    int iu_y = mag*sin(angle);
-                    draw_line(i, j, i+iu_x, j+iu_y, &img_prev, col_green);
-                }
+    //start and end *2 to avoid seg fault
+    for (uint i = space_between_points*2; i < img->width-space_between_points*2; i+=space_between_points)
+    {
+        for (uint j = space_between_points*2; j < img->height-space_between_points*2; j+=space_between_points){
+            //flow vector variables
+            float u_x, u_y;
+#if FLOW_MODE == FLOW_MODE_DENSE
+            u_x = state->dense.flow_x[j*img->width+i];
+            u_y = state->dense.flow_y[j*img->width+i];
+#elif FLOW_MODE == FLOW_MODE_HORN_SCHUNCK
+            u_x = state->hs.levels[0].u[j*img->width+i];
+            u_y = state->hs.levels[0].v[j*img->width+i];
+#elif FLOW_MODE == FLOW_MODE_SPARSE_BATCH
+            u_x = grid_u_x[grid_idx];
+            u_y = grid_u_y[grid_idx];
+            grid_idx++;
+#elif FLOW_MODE == FLOW_MODE_BLOCK_MATCHING
+            motion_vector_t *vec = &state->field[(j/BM_BLOCK_SIZE)*(img->width/BM_BLOCK_SIZE)+i/BM_BLOCK_SIZE];
+            u_x = vec->x;
+            u_y = vec->y;
+#elif FLOW_MODE == FLOW_MODE_PYRAMIDAL
+            flow_vector_t flow;
+            calc_pyramidal_optical_flow(state->pyramid, pyramid_prev, PYR_LEVELS, i, j, &flow);
+            if(flow.confidence < PYR_MIN_CONFIDENCE){
+                continue;
             }
+            u_x = flow.u_x;
+            u_y = flow.u_y;
+#else
+            calc_optical_flow(&state->img_gray, &img_gray_prev, i, j, &u_x, &u_y);
+#endif
+            vec_x[nb_vectors] = i;
+            vec_y[nb_vectors] = j;
+            vec_u_x[nb_vectors] = u_x;
+            vec_u_y[nb_vectors] = u_y;
+            nb_vectors++;
         }
+    }
 
-        image_draw(&img_prev, fbp, screen_size_x);
-
-        // save to raw file
-        // save_image_rgb_to_file(&img, "img.raw");
-
-        //Send back the buffer to the port to be filled with an image again
-        mmal_port_send_buffer(video_port, buffer);
+#if GLOBAL_MOTION
+    uint8_t inlier_mask[max_vectors];
+    global_motion_t motion;
+    uint has_motion = estimate_global_motion(vec_x, vec_y, vec_u_x, vec_u_y, nb_vectors, GM_MODEL, &motion, inlier_mask);
+    if(!has_motion){
+        //no model, every vector is drawn as camera motion
+        memset(inlier_mask, 1, nb_vectors);
+    }
+#endif
 
+    //img_draw is the frame itself when the source is writable, a copy of it otherwise
+    if(img_draw->img != img->img){
+        memcpy(img_draw->img, img->img, img->width*img->height*3);
+    }
+    for (uint v = 0; v < nb_vectors; v++)
+    {
+        uint i = vec_x[v];
+        uint j = vec_y[v];
+        float u_x = vec_u_x[v];
+        float u_y = vec_u_y[v];
+
+#if GLOBAL_MOTION
+        //moving objects are drawn with their own motion, without the motion of the camera at their position
+        if(has_motion && !inlier_mask[v]){
+            float cam_u_x, cam_u_y;
+            global_motion_at(&motion, i, j, &cam_u_x, &cam_u_y);
+            u_x -= cam_u_x;
+            u_y -= cam_u_y;
+        }
+#endif
 
-        end_time = get_cur_time();
-        float seconds = (float)(end_time - start_time);
-        time_since_report += seconds;
-        count_frames++;
+        //convert flow vector to polar for simpler handling
+        float angle = atan2(u_y, u_x);
+        float mag = sqrt(u_x*u_x+u_y*u_y);
 
-        if(time_since_report > 1.0f){
-            float framerate = count_frames/time_since_report;
-            printf("frequency: %fHz\n\r", framerate);
-            time_since_report = 0;
-            count_frames = 0;
+        //clamp crazy vectors to avoid mess in the display
+        if(mag > max_magnitude)
+        {
+            mag = max_magnitude;
         }
 
-        // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
+        //only draw significant vectors
+        if(mag >= 2){
+            //draw a starting point in red
+            for (int k = -1; k <= 1; k++)
+            {
+                for (int l = -1; l <= 1; l++)
+                {
+                    image_set(img_draw, i+k, j+l, 0, 255);
+                    image_set(img_draw, i+k, j+l, 1, 0);
+                    image_set(img_draw, i+k, j+l, 2, 0);
+                }
+
+            }
 
-        //free buffers
-        free(img_gray_prev.img);
+            //draw the flow vector, in green if it follows the camera motion, in magenta otherwise
+            uint col_green[3] = {0, 255, 0};
+#if GLOBAL_MOTION
+            uint col_magenta[3] = {255, 0, 255};
+            uint *col_vector = inlier_mask[v] ? col_green : col_magenta;
+#else
+            uint *col_vector = col_green;
+#endif
+
+            int iu_x = mag*cos(angle);
+            int iu_y = mag*sin(angle);
+            draw_line(i, j, i+iu_x, j+iu_y, img_draw, col_vector);
+        }
     }
 
-    //todo free the mmal and framebuffer ressources cleanly
+#if FLOW_MODE == FLOW_MODE_PYRAMIDAL
+    free_gaussian_pyramid(pyramid_prev, PYR_LEVELS);
+#endif
 }
 
 //clock_gettime is a better time keeping mechanism than other on the raspberry pi
@@ -257,8 +687,6 @@ float calc_dt(image_grayscale_t *img, image_grayscale_t *img_prev, uint pos_x, u
 
 void calc_optical_flow(image_grayscale_t *img, image_grayscale_t *img_prev, uint pos_x, uint pos_y, float *u_x, float *u_y)
 {
-    //MUST BE AN ODD VALUE
-    #define WINDOW_SIZE 5
     float dx[WINDOW_SIZE*WINDOW_SIZE];
     float dy[WINDOW_SIZE*WINDOW_SIZE];
     float dt[WINDOW_SIZE*WINDOW_SIZE];
@@ -315,4 +743,1418 @@ void calc_optical_flow(image_grayscale_t *img, image_grayscale_t *img_prev, uint
         *u_x = A_inv[0]*B_mat[0]+A_inv[1]*B_mat[1];
         *u_y = A_inv[2]*B_mat[0]+A_inv[3]*B_mat[1];
     }
-}
\ No newline at end of file
+}
+
+//the border pixels are set to 0 here and never written by compute_flow_derivatives
+void flow_derivatives_init(flow_derivatives_t *deriv, int width, int height){
+    deriv->width = width;
+    deriv->height = height;
+    deriv->dx = calloc(width*height, sizeof(int16_t));
+    deriv->dy = calloc(width*height, sizeof(int16_t));
+    deriv->dt = calloc(width*height, sizeof(int16_t));
+}
+
+//computes the derivative planes of the image pair in one pass, in planes allocated by flow_derivatives_init
+//all three come from vertical and horizontal sums of 3 pixels, computed 8 pixels at a time with neon or sse2
+void compute_flow_derivatives(image_grayscale_t *img, image_grayscale_t *img_prev, flow_derivatives_t *deriv){
+    int width = img->width;
+    int height = img->height;
+
+    for (int y = 1; y < height-1; y++)
+    {
+        uint8_t *prev_above = &img_prev->img[(y-1)*width];
+        uint8_t *prev_row = &img_prev->img[y*width];
+        uint8_t *prev_below = &img_prev->img[(y+1)*width];
+        uint8_t *cur_above = &img->img[(y-1)*width];
+        uint8_t *cur_row = &img->img[y*width];
+        uint8_t *cur_below = &img->img[(y+1)*width];
+
+        int16_t *dx = &deriv->dx[y*width];
+        int16_t *dy = &deriv->dy[y*width];
+        int16_t *dt = &deriv->dt[y*width];
+
+        int x = 1;
+#ifdef __ARM_NEON
+        //sums are at most 9*255, the differences are taken in 16bits and fit as signed values
+        for (; x+8 <= width-1; x+=8)
+        {
+            uint16x8_t prev_left = vaddw_u8(vaddl_u8(vld1_u8(&prev_above[x-1]), vld1_u8(&prev_row[x-1])), vld1_u8(&prev_below[x-1]));
+            uint16x8_t prev_centre = vaddw_u8(vaddl_u8(vld1_u8(&prev_above[x]), vld1_u8(&prev_row[x])), vld1_u8(&prev_below[x]));
+            uint16x8_t prev_right = vaddw_u8(vaddl_u8(vld1_u8(&prev_above[x+1]), vld1_u8(&prev_row[x+1])), vld1_u8(&prev_below[x+1]));
+
+            uint16x8_t cur_left = vaddw_u8(vaddl_u8(vld1_u8(&cur_above[x-1]), vld1_u8(&cur_row[x-1])), vld1_u8(&cur_below[x-1]));
+            uint16x8_t cur_centre = vaddw_u8(vaddl_u8(vld1_u8(&cur_above[x]), vld1_u8(&cur_row[x])), vld1_u8(&cur_below[x]));
+            uint16x8_t cur_right = vaddw_u8(vaddl_u8(vld1_u8(&cur_above[x+1]), vld1_u8(&cur_row[x+1])), vld1_u8(&cur_below[x+1]));
+
+            uint16x8_t prev_sum_below = vaddw_u8(vaddl_u8(vld1_u8(&prev_below[x-1]), vld1_u8(&prev_below[x])), vld1_u8(&prev_below[x+1]));
+            uint16x8_t prev_sum_above = vaddw_u8(vaddl_u8(vld1_u8(&prev_above[x-1]), vld1_u8(&prev_above[x])), vld1_u8(&prev_above[x+1]));
+
+            uint16x8_t prev_box = vaddq_u16(vaddq_u16(prev_left, prev_centre), prev_right);
+            uint16x8_t cur_box = vaddq_u16(vaddq_u16(cur_left, cur_centre), cur_right);
+
+            vst1q_s16(&dx[x], vreinterpretq_s16_u16(vsubq_u16(prev_right, prev_left)));
+            vst1q_s16(&dy[x], vreinterpretq_s16_u16(vsubq_u16(prev_sum_below, prev_sum_above)));
+            vst1q_s16(&dt[x], vreinterpretq_s16_u16(vsubq_u16(cur_box, prev_box)));
+        }
+#elif defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        #define LOAD_U16_8(ptr) _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(ptr)), zero)
+
+        for (; x+8 <= width-1; x+=8)
+        {
+            __m128i prev_above_left = LOAD_U16_8(&prev_above[x-1]);
+            __m128i prev_above_centre = LOAD_U16_8(&prev_above[x]);
+            __m128i prev_above_right = LOAD_U16_8(&prev_above[x+1]);
+            __m128i prev_below_left = LOAD_U16_8(&prev_below[x-1]);
+            __m128i prev_below_centre = LOAD_U16_8(&prev_below[x]);
+            __m128i prev_below_right = LOAD_U16_8(&prev_below[x+1]);
+
+            __m128i prev_left = _mm_add_epi16(_mm_add_epi16(prev_above_left, LOAD_U16_8(&prev_row[x-1])), prev_below_left);
+            __m128i prev_centre = _mm_add_epi16(_mm_add_epi16(prev_above_centre, LOAD_U16_8(&prev_row[x])), prev_below_centre);
+            __m128i prev_right = _mm_add_epi16(_mm_add_epi16(prev_above_right, LOAD_U16_8(&prev_row[x+1])), prev_below_right);
+
+            __m128i cur_left = _mm_add_epi16(_mm_add_epi16(LOAD_U16_8(&cur_above[x-1]), LOAD_U16_8(&cur_row[x-1])), LOAD_U16_8(&cur_below[x-1]));
+            __m128i cur_centre = _mm_add_epi16(_mm_add_epi16(LOAD_U16_8(&cur_above[x]), LOAD_U16_8(&cur_row[x])), LOAD_U16_8(&cur_below[x]));
+            __m128i cur_right = _mm_add_epi16(_mm_add_epi16(LOAD_U16_8(&cur_above[x+1]), LOAD_U16_8(&cur_row[x+1])), LOAD_U16_8(&cur_below[x+1]));
+
+            __m128i prev_sum_below = _mm_add_epi16(_mm_add_epi16(prev_below_left, prev_below_centre), prev_below_right);
+            __m128i prev_sum_above = _mm_add_epi16(_mm_add_epi16(prev_above_left, prev_above_centre), prev_above_right);
+
+            __m128i prev_box = _mm_add_epi16(_mm_add_epi16(prev_left, prev_centre), prev_right);
+            __m128i cur_box = _mm_add_epi16(_mm_add_epi16(cur_left, cur_centre), cur_right);
+
+            _mm_storeu_si128((__m128i*)&dx[x], _mm_sub_epi16(prev_right, prev_left));
+            _mm_storeu_si128((__m128i*)&dy[x], _mm_sub_epi16(prev_sum_below, prev_sum_above));
+            _mm_storeu_si128((__m128i*)&dt[x], _mm_sub_epi16(cur_box, prev_box));
+        }
+        #undef LOAD_U16_8
+#endif
+        for (; x < width-1; x++)
+        {
+            int prev_left = prev_above[x-1]+prev_row[x-1]+prev_below[x-1];
+            int prev_centre = prev_above[x]+prev_row[x]+prev_below[x];
+            int prev_right = prev_above[x+1]+prev_row[x+1]+prev_below[x+1];
+            int cur_box = cur_above[x-1]+cur_row[x-1]+cur_below[x-1]+cur_above[x]+cur_row[x]+cur_below[x]+cur_above[x+1]+cur_row[x+1]+cur_below[x+1];
+
+            dx[x] = prev_right-prev_left;
+            dy[x] = (prev_below[x-1]+prev_below[x]+prev_below[x+1])-(prev_above[x-1]+prev_above[x]+prev_above[x+1]);
+            dt[x] = cur_box-(prev_left+prev_centre+prev_right);
+        }
+    }
+}
+
+void free_flow_derivatives(flow_derivatives_t *deriv){
+    free(deriv->dx);
+    free(deriv->dy);
+    free(deriv->dt);
+}
+
+void dense_flow_init(dense_flow_t *dense, int width, int height){
+    flow_derivatives_init(&dense->deriv, width, height);
+    dense->column_sums = malloc(NB_FLOW_PRODUCTS*width*sizeof(int32_t));
+    dense->flow_x = malloc(width*height*sizeof(float));
+    dense->flow_y = malloc(width*height*sizeof(float));
+}
+
+void dense_flow_free(dense_flow_t *dense){
+    free_flow_derivatives(&dense->deriv);
+    free(dense->column_sums);
+    free(dense->flow_x);
+    free(dense->flow_y);
+}
+
+//the products of the row entering the window are added to the column sums, those of the row leaving it removed
+//the sums of a 5 rows window are at most 25*2295*765, they fit in 32bits
+void dense_update_columns(flow_derivatives_t *deriv, int row_in, int row_out, int32_t *column_sums){
+    int width = deriv->width;
+    int16_t *dx_in = &deriv->dx[row_in*width];
+    int16_t *dy_in = &deriv->dy[row_in*width];
+    int16_t *dt_in = &deriv->dt[row_in*width];
+    int16_t *dx_out = &deriv->dx[row_out*width];
+    int16_t *dy_out = &deriv->dy[row_out*width];
+    int16_t *dt_out = &deriv->dt[row_out*width];
+
+    int32_t *col_xx = &column_sums[0];
+    int32_t *col_xy = &column_sums[width];
+    int32_t *col_yy = &column_sums[2*width];
+    int32_t *col_xt = &column_sums[3*width];
+    int32_t *col_yt = &column_sums[4*width];
+
+    int x = 0;
+#ifdef __ARM_NEON
+    for (; x+4 <= width; x+=4)
+    {
+        int16x4_t vdx_in = vld1_s16(&dx_in[x]);
+        int16x4_t vdy_in = vld1_s16(&dy_in[x]);
+        int16x4_t vdt_in = vld1_s16(&dt_in[x]);
+        int16x4_t vdx_out = vld1_s16(&dx_out[x]);
+        int16x4_t vdy_out = vld1_s16(&dy_out[x]);
+        int16x4_t vdt_out = vld1_s16(&dt_out[x]);
+        vst1q_s32(&col_xx[x], vaddq_s32(vld1q_s32(&col_xx[x]), vmlsl_s16(vmull_s16(vdx_in, vdx_in), vdx_out, vdx_out)));
+        vst1q_s32(&col_xy[x], vaddq_s32(vld1q_s32(&col_xy[x]), vmlsl_s16(vmull_s16(vdx_in, vdy_in), vdx_out, vdy_out)));
+        vst1q_s32(&col_yy[x], vaddq_s32(vld1q_s32(&col_yy[x]), vmlsl_s16(vmull_s16(vdy_in, vdy_in), vdy_out, vdy_out)));
+        vst1q_s32(&col_xt[x], vaddq_s32(vld1q_s32(&col_xt[x]), vmlsl_s16(vmull_s16(vdx_in, vdt_in), vdx_out, vdt_out)));
+        vst1q_s32(&col_yt[x], vaddq_s32(vld1q_s32(&col_yt[x]), vmlsl_s16(vmull_s16(vdy_in, vdt_in), vdy_out, vdt_out)));
+    }
+#elif defined(__SSE2__)
+    //pmaddwd on interleaved (in, out) and (in, -out) pairs gives in*in'-out*out' in 32bits
+    for (; x+8 <= width; x+=8)
+    {
+        __m128i vdx_in = _mm_loadu_si128((__m128i*)&dx_in[x]);
+        __m128i vdy_in = _mm_loadu_si128((__m128i*)&dy_in[x]);
+        __m128i vdt_in = _mm_loadu_si128((__m128i*)&dt_in[x]);
+        __m128i vdx_out = _mm_loadu_si128((__m128i*)&dx_out[x]);
+        __m128i vdy_out = _mm_loadu_si128((__m128i*)&dy_out[x]);
+        __m128i vdt_out = _mm_loadu_si128((__m128i*)&dt_out[x]);
+        __m128i zero = _mm_setzero_si128();
+        __m128i vdx_neg = _mm_sub_epi16(zero, vdx_out);
+        __m128i vdy_neg = _mm_sub_epi16(zero, vdy_out);
+        __m128i vdt_neg = _mm_sub_epi16(zero, vdt_out);
+
+        __m128i dx_lo = _mm_unpacklo_epi16(vdx_in, vdx_out);
+        __m128i dx_hi = _mm_unpackhi_epi16(vdx_in, vdx_out);
+        __m128i dy_lo = _mm_unpacklo_epi16(vdy_in, vdy_out);
+        __m128i dy_hi = _mm_unpackhi_epi16(vdy_in, vdy_out);
+        __m128i dx_neg_lo = _mm_unpacklo_epi16(vdx_in, vdx_neg);
+        __m128i dx_neg_hi = _mm_unpackhi_epi16(vdx_in, vdx_neg);
+        __m128i dy_neg_lo = _mm_unpacklo_epi16(vdy_in, vdy_neg);
+        __m128i dy_neg_hi = _mm_unpackhi_epi16(vdy_in, vdy_neg);
+        __m128i dt_neg_lo = _mm_unpacklo_epi16(vdt_in, vdt_neg);
+        __m128i dt_neg_hi = _mm_unpackhi_epi16(vdt_in, vdt_neg);
+
+        #define UPDATE_COLUMNS_8(col, a_lo, a_hi, b_lo, b_hi) \
+            _mm_storeu_si128((__m128i*)&col[x], _mm_add_epi32(_mm_loadu_si128((__m128i*)&col[x]), _mm_madd_epi16(a_lo, b_lo))); \
+            _mm_storeu_si128((__m128i*)&col[x+4], _mm_add_epi32(_mm_loadu_si128((__m128i*)&col[x+4]), _mm_madd_epi16(a_hi, b_hi)))
+
+        UPDATE_COLUMNS_8(col_xx, dx_lo, dx_hi, dx_neg_lo, dx_neg_hi);
+        UPDATE_COLUMNS_8(col_xy, dx_lo, dx_hi, dy_neg_lo, dy_neg_hi);
+        UPDATE_COLUMNS_8(col_yy, dy_lo, dy_hi, dy_neg_lo, dy_neg_hi);
+        UPDATE_COLUMNS_8(col_xt, dx_lo, dx_hi, dt_neg_lo, dt_neg_hi);
+        UPDATE_COLUMNS_8(col_yt, dy_lo, dy_hi, dt_neg_lo, dt_neg_hi);
+        #undef UPDATE_COLUMNS_8
+    }
+#endif
+    for (; x < width; x++)
+    {
+        col_xx[x] += dx_in[x]*dx_in[x]-dx_out[x]*dx_out[x];
+        col_xy[x] += dx_in[x]*dy_in[x]-dx_out[x]*dy_out[x];
+        col_yy[x] += dy_in[x]*dy_in[x]-dy_out[x]*dy_out[x];
+        col_xt[x] += dx_in[x]*dt_in[x]-dx_out[x]*dt_out[x];
+        col_yt[x] += dy_in[x]*dt_in[x]-dy_out[x]*dt_out[x];
+    }
+}
+
+//sums of the windows of a row from the column sums, and their 2x2 system solved at each pixel
+//the pixels closer than DENSE_WINDOW_RADIUS+1 to the left and right borders get no flow
+void dense_solve_row(int32_t *column_sums, int width, float *flow_x, float *flow_y){
+    const int radius = DENSE_WINDOW_RADIUS;
+
+    int32_t *col_xx = &column_sums[0];
+    int32_t *col_xy = &column_sums[width];
+    int32_t *col_yy = &column_sums[2*width];
+    int32_t *col_xt = &column_sums[3*width];
+    int32_t *col_yt = &column_sums[4*width];
+
+    for (int x = 0; x < radius+1; x++)
+    {
+        flow_x[x] = 0;
+        flow_y[x] = 0;
+        flow_x[width-1-x] = 0;
+        flow_y[width-1-x] = 0;
+    }
+
+    int x = radius+1;
+#ifdef __ARM_NEON
+    const float32x4_t zero = vdupq_n_f32(0);
+    const float32x4_t min_det = vdupq_n_f32(DENSE_MIN_DET);
+
+    for (; x+4 <= width-radius-1; x+=4)
+    {
+        //window sums of 4 consecutive pixels, as sums of 2*DENSE_WINDOW_RADIUS+1 shifted columns
+        int32x4_t ixx = vld1q_s32(&col_xx[x-radius]);
+        int32x4_t ixy = vld1q_s32(&col_xy[x-radius]);
+        int32x4_t iyy = vld1q_s32(&col_yy[x-radius]);
+        int32x4_t ixt = vld1q_s32(&col_xt[x-radius]);
+        int32x4_t iyt = vld1q_s32(&col_yt[x-radius]);
+        for (int k = 1-radius; k <= radius; k++)
+        {
+            ixx = vaddq_s32(ixx, vld1q_s32(&col_xx[x+k]));
+            ixy = vaddq_s32(ixy, vld1q_s32(&col_xy[x+k]));
+            iyy = vaddq_s32(iyy, vld1q_s32(&col_yy[x+k]));
+            ixt = vaddq_s32(ixt, vld1q_s32(&col_xt[x+k]));
+            iyt = vaddq_s32(iyt, vld1q_s32(&col_yt[x+k]));
+        }
+        float32x4_t sxx = vcvtq_f32_s32(ixx);
+        float32x4_t sxy = vcvtq_f32_s32(ixy);
+        float32x4_t syy = vcvtq_f32_s32(iyy);
+        float32x4_t sxt = vcvtq_f32_s32(ixt);
+        float32x4_t syt = vcvtq_f32_s32(iyt);
+
+        float32x4_t det = vmlsq_f32(vmulq_f32(sxx, syy), sxy, sxy);
+        float32x4_t num_x = vmlsq_f32(vmulq_f32(sxy, syt), syy, sxt);
+        float32x4_t num_y = vmlsq_f32(vmulq_f32(sxy, sxt), sxx, syt);
+
+        //reciprocal estimate refined with two newton steps
+        float32x4_t inv_det = vrecpeq_f32(det);
+        inv_det = vmulq_f32(vrecpsq_f32(det, inv_det), inv_det);
+        inv_det = vmulq_f32(vrecpsq_f32(det, inv_det), inv_det);
+        inv_det = vmulq_n_f32(inv_det, 2.0f/3.0f);
+
+        uint32x4_t valid = vcgtq_f32(det, min_det);
+        vst1q_f32(&flow_x[x], vbslq_f32(valid, vmulq_f32(num_x, inv_det), zero));
+        vst1q_f32(&flow_y[x], vbslq_f32(valid, vmulq_f32(num_y, inv_det), zero));
+    }
+#elif defined(__SSE2__)
+    const __m128 min_det = _mm_set1_ps(DENSE_MIN_DET);
+    const __m128 factor = _mm_set1_ps(2.0f/3.0f);
+
+    //same operations as the scalar version, the flow is the same
+    for (; x+4 <= width-radius-1; x+=4)
+    {
+        __m128i ixx = _mm_loadu_si128((__m128i*)&col_xx[x-radius]);
+        __m128i ixy = _mm_loadu_si128((__m128i*)&col_xy[x-radius]);
+        __m128i iyy = _mm_loadu_si128((__m128i*)&col_yy[x-radius]);
+        __m128i ixt = _mm_loadu_si128((__m128i*)&col_xt[x-radius]);
+        __m128i iyt = _mm_loadu_si128((__m128i*)&col_yt[x-radius]);
+        for (int k = 1-radius; k <= radius; k++)
+        {
+            ixx = _mm_add_epi32(ixx, _mm_loadu_si128((__m128i*)&col_xx[x+k]));
+            ixy = _mm_add_epi32(ixy, _mm_loadu_si128((__m128i*)&col_xy[x+k]));
+            iyy = _mm_add_epi32(iyy, _mm_loadu_si128((__m128i*)&col_yy[x+k]));
+            ixt = _mm_add_epi32(ixt, _mm_loadu_si128((__m128i*)&col_xt[x+k]));
+            iyt = _mm_add_epi32(iyt, _mm_loadu_si128((__m128i*)&col_yt[x+k]));
+        }
+        __m128 sxx = _mm_cvtepi32_ps(ixx);
+        __m128 sxy = _mm_cvtepi32_ps(ixy);
+        __m128 syy = _mm_cvtepi32_ps(iyy);
+        __m128 sxt = _mm_cvtepi32_ps(ixt);
+        __m128 syt = _mm_cvtepi32_ps(iyt);
+
+        __m128 det = _mm_sub_ps(_mm_mul_ps(sxx, syy), _mm_mul_ps(sxy, sxy));
+        __m128 num_x = _mm_sub_ps(_mm_mul_ps(sxy, syt), _mm_mul_ps(syy, sxt));
+        __m128 num_y = _mm_sub_ps(_mm_mul_ps(sxy, sxt), _mm_mul_ps(sxx, syt));
+
+        //the invalid lanes may divide by 0, they are masked
+        __m128 inv_det = _mm_div_ps(factor, det);
+        __m128 valid = _mm_cmpgt_ps(det, min_det);
+        _mm_storeu_ps(&flow_x[x], _mm_and_ps(valid, _mm_mul_ps(num_x, inv_det)));
+        _mm_storeu_ps(&flow_y[x], _mm_and_ps(valid, _mm_mul_ps(num_y, inv_det)));
+    }
+#endif
+    for (; x < width-radius-1; x++)
+    {
+        int32_t ixx = 0;
+        int32_t ixy = 0;
+        int32_t iyy = 0;
+        int32_t ixt = 0;
+        int32_t iyt = 0;
+        for (int k = -radius; k <= radius; k++)
+        {
+            ixx += col_xx[x+k];
+            ixy += col_xy[x+k];
+            iyy += col_yy[x+k];
+            ixt += col_xt[x+k];
+            iyt += col_yt[x+k];
+        }
+        float sxx = ixx;
+        float sxy = ixy;
+        float syy = iyy;
+        float sxt = ixt;
+        float syt = iyt;
+
+        float det = sxx*syy-sxy*sxy;
+        if(det > DENSE_MIN_DET)
+        {
+            float inv_det = (2.0f/3.0f)/det;
+            flow_x[x] = (sxy*syt-syy*sxt)*inv_det;
+            flow_y[x] = (sxy*sxt-sxx*syt)*inv_det;
+        }
+        else{
+            flow_x[x] = 0;
+            flow_y[x] = 0;
+        }
+    }
+}
+
+//lucas kanade at every pixel: the 5 derivative products are box filtered separably, without tables over the image:
+//running sums of each column over the rows of the window, then the sum of 2*DENSE_WINDOW_RADIUS+1 columns for each pixel
+//gives the same flow as calc_optical_flow (the normalisations of the derivatives reduce to a factor 2/3)
+//flow of the derivatives of dense->deriv in dense->flow_x and dense->flow_y
+//pixels whose window is not entirely inside the image get no flow
+void calc_dense_optical_flow(dense_flow_t *dense){
+    flow_derivatives_t *deriv = &dense->deriv;
+    int width = deriv->width;
+    int height = deriv->height;
+
+    //derivatives are valid from 1 to size-2, the window must stay in that range
+    const int radius = DENSE_WINDOW_RADIUS;
+    const int size = 2*DENSE_WINDOW_RADIUS+1;
+
+    memset(dense->flow_x, 0, (radius+1)*width*sizeof(float));
+    memset(dense->flow_y, 0, (radius+1)*width*sizeof(float));
+    memset(&dense->flow_x[(height-radius-1)*width], 0, (radius+1)*width*sizeof(float));
+    memset(&dense->flow_y[(height-radius-1)*width], 0, (radius+1)*width*sizeof(float));
+    memset(dense->column_sums, 0, NB_FLOW_PRODUCTS*width*sizeof(int32_t));
+
+    //the window of the row y-radius ends at row y, the row leaving it is y-size
+    //the first row of the derivatives is 0, it stands for the rows before the image
+    for (int y = 1; y < height-1; y++)
+    {
+        dense_update_columns(deriv, y, y >= size ? y-size : 0, dense->column_sums);
+
+        int centre = y-radius;
+        if(centre >= radius+1){
+            dense_solve_row(dense->column_sums, width, &dense->flow_x[centre*width], &dense->flow_y[centre*width]);
+        }
+    }
+}
+
+void build_gaussian_pyramid(image_grayscale_t *img, image_grayscale_t *pyramid, uint nb_levels){
+    pyramid[0] = *img;
+    for (size_t i = 1; i < nb_levels; i++)
+    {
+        downscale_gray_image_gaussian(&pyramid[i-1], &pyramid[i]);
+    }
+}
+
+void free_gaussian_pyramid(image_grayscale_t *pyramid, uint nb_levels){
+    for (size_t i = 1; i < nb_levels; i++)
+    {
+        free(pyramid[i].img);
+    }
+}
+
+//samples the (2*radius+1)^2 window centred on a sub-pixel position with bilinear interpolation
+//weights are 8 bits fixed point, values are returned with 3 fractional bits (intensity*8)
+//returns 0 if the window is not inside the image
+uint sample_window_bilinear(image_grayscale_t *img, float pos_x, float pos_y, int radius, int32_t *window){
+    int base_x = floorf(pos_x);
+    int base_y = floorf(pos_y);
+
+    if(base_x-radius < 0 || base_y-radius < 0 || base_x+radius+1 >= img->width || base_y+radius+1 >= img->height){
+        return 0;
+    }
+
+    //same fractional part for the whole window, so the weights are computed once
+    int frac_x = (pos_x-base_x)*256.0f+0.5f;
+    int frac_y = (pos_y-base_y)*256.0f+0.5f;
+    int w_00 = ((256-frac_x)*(256-frac_y)+128)>>8;
+    int w_01 = (frac_x*(256-frac_y)+128)>>8;
+    int w_10 = ((256-frac_x)*frac_y+128)>>8;
+    int w_11 = 256-w_00-w_01-w_10;
+
+    uint counter = 0;
+    for (int j = -radius; j <= radius; j++)
+    {
+        uint8_t *row = &img->img[(base_y+j)*img->width+base_x];
+        uint8_t *row_below = row+img->width;
+        for (int i = -radius; i <= radius; i++)
+        {
+            int val = w_00*row[i]+w_01*row[i+1]+w_10*row_below[i]+w_11*row_below[i+1];
+            window[counter] = (val+16)>>5;
+            counter++;
+        }
+    }
+
+    return 1;
+}
+
+//pyramidal iterative lucas kanade (as described by bouguet) on the point (pos_x, pos_y) of the previous image
+//on each level, starting from the coarsest, the displacement is refined until the update is below PYR_EPSILON
+//and the result is used as a starting guess for the next level
+void calc_pyramidal_optical_flow(image_grayscale_t *pyramid, image_grayscale_t *pyramid_prev, uint nb_levels, float pos_x, float pos_y, flow_vector_t *flow){
+    #define PYR_WINDOW_SIZE (2*PYR_WINDOW_RADIUS+1)
+    #define PYR_PATCH_SIZE (PYR_WINDOW_SIZE+2)
+
+    //window of the previous image with one more pixel around for the gradients
+    int32_t patch_prev[PYR_PATCH_SIZE*PYR_PATCH_SIZE];
+    int32_t window_prev[PYR_WINDOW_SIZE*PYR_WINDOW_SIZE];
+    int32_t window_cur[PYR_WINDOW_SIZE*PYR_WINDOW_SIZE];
+    int32_t grad_x[PYR_WINDOW_SIZE*PYR_WINDOW_SIZE];
+    int32_t grad_y[PYR_WINDOW_SIZE*PYR_WINDOW_SIZE];
+
+    float guess_x = 0;
+    float guess_y = 0;
+
+    flow->u_x = 0;
+    flow->u_y = 0;
+    flow->confidence = 0;
+
+    for (int level = nb_levels-1; level >= 0; level--)
+    {
+        float level_x = pos_x/(1<<level);
+        float level_y = pos_y/(1<<level);
+
+        if(!sample_window_bilinear(&pyramid_prev[level], level_x, level_y, PYR_WINDOW_RADIUS+1, patch_prev)){
+            return;
+        }
+
+        //gradients with central differences (16 times the real gradient with the 3 fractional bits)
+        //sums stay in int32 for windows up to 9x9
+        int a_xx = 0;
+        int a_xy = 0;
+        int a_yy = 0;
+        uint counter = 0;
+        for (int j = 1; j <= PYR_WINDOW_SIZE; j++)
+        {
+            for (int i = 1; i <= PYR_WINDOW_SIZE; i++)
+            {
+                uint idx = j*PYR_PATCH_SIZE+i;
+                window_prev[counter] = patch_prev[idx];
+                grad_x[counter] = patch_prev[idx+1]-patch_prev[idx-1];
+                grad_y[counter] = patch_prev[idx+PYR_PATCH_SIZE]-patch_prev[idx-PYR_PATCH_SIZE];
+                a_xx += grad_x[counter]*grad_x[counter];
+                a_xy += grad_x[counter]*grad_y[counter];
+                a_yy += grad_y[counter]*grad_y[counter];
+                counter++;
+            }
+        }
+
+        float det = (float)a_xx*a_yy-(float)a_xy*a_xy;
+        if(det < 1.0f){
+            return;
+        }
+
+        float iter_x = 0;
+        float iter_y = 0;
+
+        for (size_t it = 0; it < PYR_MAX_ITERATIONS; it++)
+        {
+            if(!sample_window_bilinear(&pyramid[level], level_x+guess_x+iter_x, level_y+guess_y+iter_y, PYR_WINDOW_RADIUS, window_cur)){
+                return;
+            }
+
+            int b_x = 0;
+            int b_y = 0;
+            for (size_t k = 0; k < PYR_WINDOW_SIZE*PYR_WINDOW_SIZE; k++)
+            {
+                int diff = window_cur[k]-window_prev[k];
+                b_x -= grad_x[k]*diff;
+                b_y -= grad_y[k]*diff;
+            }
+
+            //the factor 2 compensates the scaling of the gradients and of the differences
+            float delta_x = 2.0f*(a_yy*(float)b_x-a_xy*(float)b_y)/det;
+            float delta_y = 2.0f*(a_xx*(float)b_y-a_xy*(float)b_x)/det;
+
+            iter_x += delta_x;
+            iter_y += delta_y;
+
+            if(delta_x*delta_x+delta_y*delta_y < PYR_EPSILON*PYR_EPSILON){
+                break;
+            }
+        }
+
+        if(level > 0){
+            guess_x = 2.0f*(guess_x+iter_x);
+            guess_y = 2.0f*(guess_y+iter_y);
+        }
+        else{
+            flow->u_x = guess_x+iter_x;
+            flow->u_y = guess_y+iter_y;
+
+            //smallest eigenvalue, converted to real gradients and divided by the number of pixels
+            float half_diff = (a_xx-a_yy)*0.5f;
+            float min_eigen = (a_xx+a_yy)*0.5f-sqrtf(half_diff*half_diff+(float)a_xy*a_xy);
+            flow->confidence = min_eigen/(256.0f*PYR_WINDOW_SIZE*PYR_WINDOW_SIZE);
+        }
+    }
+}
+
+//derivatives of the 5x5 window around a point, stored in the given lane of structure of arrays buffers
+//(dx[k*BATCH_LANES+lane] for the pixel k of the window), same definitions as compute_flow_derivatives
+//the 7x7 patch is read once and the 3 pixels sums are shared between the pixels of the window
+void window_derivatives(image_grayscale_t *img, image_grayscale_t *img_prev, uint pos_x, uint pos_y, int16_t *dx, int16_t *dy, int16_t *dt, uint lane){
+    #define PATCH_SIZE (WINDOW_SIZE+2)
+    int16_t col_sum_prev[WINDOW_SIZE][PATCH_SIZE]; //vertical sums of 3 pixels of the previous image
+    int16_t row_sum_prev[PATCH_SIZE][WINDOW_SIZE]; //horizontal sums of 3 pixels of the previous image
+    int16_t col_sum_diff[WINDOW_SIZE][PATCH_SIZE]; //vertical sums of 3 pixels of the temporal difference
+
+    int width = img->width;
+    uint8_t *patch_prev = &img_prev->img[(pos_y-PATCH_SIZE/2)*width+pos_x-PATCH_SIZE/2];
+    uint8_t *patch = &img->img[(pos_y-PATCH_SIZE/2)*width+pos_x-PATCH_SIZE/2];
+
+    for (int r = 0; r < WINDOW_SIZE; r++)
+    {
+        for (int c = 0; c < PATCH_SIZE; c++)
+        {
+            int idx = (r+1)*width+c;
+            col_sum_prev[r][c] = patch_prev[idx-width]+patch_prev[idx]+patch_prev[idx+width];
+            col_sum_diff[r][c] = (patch[idx-width]+patch[idx]+patch[idx+width])-col_sum_prev[r][c];
+        }
+    }
+
+    for (int r = 0; r < PATCH_SIZE; r++)
+    {
+        for (int c = 0; c < WINDOW_SIZE; c++)
+        {
+            int idx = r*width+c+1;
+            row_sum_prev[r][c] = patch_prev[idx-1]+patch_prev[idx]+patch_prev[idx+1];
+        }
+    }
+
+    uint counter = 0;
+    for (int r = 0; r < WINDOW_SIZE; r++)
+    {
+        for (int c = 0; c < WINDOW_SIZE; c++)
+        {
+            dx[counter*BATCH_LANES+lane] = col_sum_prev[r][c+2]-col_sum_prev[r][c];
+            dy[counter*BATCH_LANES+lane] = row_sum_prev[r+2][c]-row_sum_prev[r][c];
+            dt[counter*BATCH_LANES+lane] = col_sum_diff[r][c]+col_sum_diff[r][c+1]+col_sum_diff[r][c+2];
+            counter++;
+        }
+    }
+}
+
+#if BATCH_NEON_GATHER
+//same derivatives as window_derivatives for the BATCH_LANES points of a batch, with vectors:
+//each of the 7 patch rows is loaded once in a vector (one pixel per lane), the 3 pixels sums and the derivatives
+//are computed on whole rows, and the rows of the 4 points are interleaved into the structure of arrays with vst4q
+//a store writes 3 pixels past its window row, they are overwritten by the next row (the buffers have 3 more pixels)
+void window_derivatives_neon(image_grayscale_t *img, image_grayscale_t *img_prev, uint *batch_x, uint *batch_y, int16_t *dx, int16_t *dy, int16_t *dt){
+    int width = img->width;
+    int16x8_t lane_dx[BATCH_LANES][WINDOW_SIZE];
+    int16x8_t lane_dy[BATCH_LANES][WINDOW_SIZE];
+    int16x8_t lane_dt[BATCH_LANES][WINDOW_SIZE];
+
+    for (uint lane = 0; lane < BATCH_LANES; lane++)
+    {
+        uint8_t *patch_prev = &img_prev->img[(batch_y[lane]-PATCH_SIZE/2)*width+batch_x[lane]-PATCH_SIZE/2];
+        uint8_t *patch = &img->img[(batch_y[lane]-PATCH_SIZE/2)*width+batch_x[lane]-PATCH_SIZE/2];
+
+        uint16x8_t row_prev[PATCH_SIZE];
+        uint16x8_t row_cur[PATCH_SIZE];
+        for (int r = 0; r < PATCH_SIZE; r++)
+        {
+            row_prev[r] = vmovl_u8(vld1_u8(&patch_prev[r*width]));
+            row_cur[r] = vmovl_u8(vld1_u8(&patch[r*width]));
+        }
+
+        for (int r = 0; r < WINDOW_SIZE; r++)
+        {
+            //vertical sums of 3 pixels, lane c for the column c of the patch
+            uint16x8_t col_sum_prev = vaddq_u16(vaddq_u16(row_prev[r], row_prev[r+1]), row_prev[r+2]);
+            uint16x8_t col_sum_cur = vaddq_u16(vaddq_u16(row_cur[r], row_cur[r+1]), row_cur[r+2]);
+            //horizontal sums of 3 pixels of the rows above and below, lane c for the columns c to c+2
+            uint16x8_t row_sum_top = vaddq_u16(vaddq_u16(row_prev[r], vextq_u16(row_prev[r], row_prev[r], 1)), vextq_u16(row_prev[r], row_prev[r], 2));
+            uint16x8_t row_sum_bottom = vaddq_u16(vaddq_u16(row_prev[r+2], vextq_u16(row_prev[r+2], row_prev[r+2], 1)), vextq_u16(row_prev[r+2], row_prev[r+2], 2));
+            //differences wrap in 16bits and are read back as signed
+            int16x8_t col_sum_diff = vreinterpretq_s16_u16(vsubq_u16(col_sum_cur, col_sum_prev));
+
+            lane_dx[lane][r] = vreinterpretq_s16_u16(vsubq_u16(vextq_u16(col_sum_prev, col_sum_prev, 2), col_sum_prev));
+            lane_dy[lane][r] = vreinterpretq_s16_u16(vsubq_u16(row_sum_bottom, row_sum_top));
+            lane_dt[lane][r] = vaddq_s16(vaddq_s16(col_sum_diff, vextq_s16(col_sum_diff, col_sum_diff, 1)), vextq_s16(col_sum_diff, col_sum_diff, 2));
+        }
+    }
+
+    //rows in increasing order, each store overwrites the pixels written past the previous row
+    for (int r = 0; r < WINDOW_SIZE; r++)
+    {
+        int16x8x4_t rows_dx = {{lane_dx[0][r], lane_dx[1][r], lane_dx[2][r], lane_dx[3][r]}};
+        int16x8x4_t rows_dy = {{lane_dy[0][r], lane_dy[1][r], lane_dy[2][r], lane_dy[3][r]}};
+        int16x8x4_t rows_dt = {{lane_dt[0][r], lane_dt[1][r], lane_dt[2][r], lane_dt[3][r]}};
+        vst4q_s16(&dx[r*WINDOW_SIZE*BATCH_LANES], rows_dx);
+        vst4q_s16(&dy[r*WINDOW_SIZE*BATCH_LANES], rows_dy);
+        vst4q_s16(&dt[r*WINDOW_SIZE*BATCH_LANES], rows_dt);
+    }
+}
+#endif
+
+//lucas kanade on a list of points (structure of arrays), BATCH_LANES points at a time
+//the sums of the normal equations are accumulated in int32 from the integer derivatives (no division by 255)
+//and ill-conditioned windows get no flow
+//gives the same result as calc_optical_flow, the normalisations reduce to a factor 2/3
+void calc_optical_flow_batch(image_grayscale_t *img, image_grayscale_t *img_prev, uint16_t *pos_x, uint16_t *pos_y, uint nb_points, float *u_x, float *u_y){
+    #define WINDOW_PIXELS (WINDOW_SIZE*WINDOW_SIZE)
+    //room for the pixels written past the last row by window_derivatives_neon
+    int16_t dx[(WINDOW_PIXELS+8-WINDOW_SIZE)*BATCH_LANES];
+    int16_t dy[(WINDOW_PIXELS+8-WINDOW_SIZE)*BATCH_LANES];
+    int16_t dt[(WINDOW_PIXELS+8-WINDOW_SIZE)*BATCH_LANES];
+
+    //BATCH_MIN_DET is for the matrix of normalised derivatives, dx and dy are 6*255 times bigger
+    const float min_det = BATCH_MIN_DET*(36.0f*255.0f*255.0f)*(36.0f*255.0f*255.0f);
+
+    for (uint first = 0; first < nb_points; first+=BATCH_LANES)
+    {
+        //the last batch repeats its last point in the unused lanes
+#if BATCH_NEON_GATHER
+        uint batch_x[BATCH_LANES];
+        uint batch_y[BATCH_LANES];
+        for (uint lane = 0; lane < BATCH_LANES; lane++)
+        {
+            uint pt = first+lane < nb_points ? first+lane : nb_points-1;
+            batch_x[lane] = pos_x[pt];
+            batch_y[lane] = pos_y[pt];
+        }
+        window_derivatives_neon(img, img_prev, batch_x, batch_y, dx, dy, dt);
+#else
+        for (uint lane = 0; lane < BATCH_LANES; lane++)
+        {
+            uint pt = first+lane < nb_points ? first+lane : nb_points-1;
+            window_derivatives(img, img_prev, pos_x[pt], pos_y[pt], dx, dy, dt, lane);
+        }
+#endif
+
+        float det[BATCH_LANES];
+        float num_x[BATCH_LANES];
+        float num_y[BATCH_LANES];
+
+#ifdef __ARM_NEON
+        int32x4_t sum_xx = vdupq_n_s32(0);
+        int32x4_t sum_xy = vdupq_n_s32(0);
+        int32x4_t sum_yy = vdupq_n_s32(0);
+        int32x4_t sum_xt = vdupq_n_s32(0);
+        int32x4_t sum_yt = vdupq_n_s32(0);
+
+        for (size_t k = 0; k < WINDOW_PIXELS; k++)
+        {
+            int16x4_t vdx = vld1_s16(&dx[k*BATCH_LANES]);
+            int16x4_t vdy = vld1_s16(&dy[k*BATCH_LANES]);
+            int16x4_t vdt = vld1_s16(&dt[k*BATCH_LANES]);
+            sum_xx = vmlal_s16(sum_xx, vdx, vdx);
+            sum_xy = vmlal_s16(sum_xy, vdx, vdy);
+            sum_yy = vmlal_s16(sum_yy, vdy, vdy);
+            sum_xt = vmlal_s16(sum_xt, vdx, vdt);
+            sum_yt = vmlal_s16(sum_yt, vdy, vdt);
+        }
+
+        float32x4_t sxx = vcvtq_f32_s32(sum_xx);
+        float32x4_t sxy = vcvtq_f32_s32(sum_xy);
+        float32x4_t syy = vcvtq_f32_s32(sum_yy);
+        float32x4_t sxt = vcvtq_f32_s32(sum_xt);
+        float32x4_t syt = vcvtq_f32_s32(sum_yt);
+
+        vst1q_f32(det, vmlsq_f32(vmulq_f32(sxx, syy), sxy, sxy));
+        vst1q_f32(num_x, vmlsq_f32(vmulq_f32(sxy, syt), syy, sxt));
+        vst1q_f32(num_y, vmlsq_f32(vmulq_f32(sxy, sxt), sxx, syt));
+#else
+        int32_t sum_xx[BATCH_LANES] = {0};
+        int32_t sum_xy[BATCH_LANES] = {0};
+        int32_t sum_yy[BATCH_LANES] = {0};
+        int32_t sum_xt[BATCH_LANES] = {0};
+        int32_t sum_yt[BATCH_LANES] = {0};
+
+        for (size_t k = 0; k < WINDOW_PIXELS; k++)
+        {
+            for (size_t lane = 0; lane < BATCH_LANES; lane++)
+            {
+                int32_t vdx = dx[k*BATCH_LANES+lane];
+                int32_t vdy = dy[k*BATCH_LANES+lane];
+                int32_t vdt = dt[k*BATCH_LANES+lane];
+                sum_xx[lane] += vdx*vdx;
+                sum_xy[lane] += vdx*vdy;
+                sum_yy[lane] += vdy*vdy;
+                sum_xt[lane] += vdx*vdt;
+                sum_yt[lane] += vdy*vdt;
+            }
+        }
+
+        for (size_t lane = 0; lane < BATCH_LANES; lane++)
+        {
+            det[lane] = (float)sum_xx[lane]*sum_yy[lane]-(float)sum_xy[lane]*sum_xy[lane];
+            num_x[lane] = (float)sum_xy[lane]*sum_yt[lane]-(float)sum_yy[lane]*sum_xt[lane];
+            num_y[lane] = (float)sum_xy[lane]*sum_xt[lane]-(float)sum_xx[lane]*sum_yt[lane];
+        }
+#endif
+
+        for (uint lane = 0; lane < BATCH_LANES && first+lane < nb_points; lane++)
+        {
+            if(det[lane] < min_det)
+            {
+                u_x[first+lane] = 0;
+                u_y[first+lane] = 0;
+            }
+            else
+            {
+                float inv_det = (2.0f/3.0f)/det[lane];
+                u_x[first+lane] = num_x[lane]*inv_det;
+                u_y[first+lane] = num_y[lane]*inv_det;
+            }
+        }
+    }
+}
+
+//sad between the block of the previous image and the same block moved by (vec_x, vec_y) in the current one
+//UINT32_MAX if the moved block is not inside the image
+uint32_t block_matching_sad(image_grayscale_t *img, image_grayscale_t *img_prev, int block_x, int block_y, int vec_x, int vec_y){
+    int x = block_x+vec_x;
+    int y = block_y+vec_y;
+
+    if(x < 0 || y < 0 || x+BM_BLOCK_SIZE > img->width || y+BM_BLOCK_SIZE > img->height){
+        return UINT32_MAX;
+    }
+
+    return image_block_sad(&img_prev->img[block_y*img_prev->width+block_x], &img->img[y*img->width+x], img_prev->width, img->width, BM_BLOCK_SIZE, BM_BLOCK_SIZE);
+}
+
+//motion of each block of the previous image to the current one
+//the search starts from the best of the zero vector, the vectors of the left, top and top right blocks
+//and the vector of the same block in the previous frame, then is refined with a large diamond
+//until its centre is the best, then with a small diamond
+void block_matching_motion(image_grayscale_t *img, image_grayscale_t *img_prev, motion_vector_t *field, motion_vector_t *prev_field){
+    static const int large_diamond[8*2] = {0, -2, 1, -1, 2, 0, 1, 1, 0, 2, -1, 1, -2, 0, -1, -1};
+    static const int small_diamond[4*2] = {0, -1, 1, 0, 0, 1, -1, 0};
+
+    int nb_blocks_x = img->width/BM_BLOCK_SIZE;
+    int nb_blocks_y = img->height/BM_BLOCK_SIZE;
+    uint32_t good_enough = BM_GOOD_ENOUGH_SAD*BM_BLOCK_SIZE*BM_BLOCK_SIZE;
+
+    for (int by = 0; by < nb_blocks_y; by++)
+    {
+        for (int bx = 0; bx < nb_blocks_x; bx++)
+        {
+            int block_x = bx*BM_BLOCK_SIZE;
+            int block_y = by*BM_BLOCK_SIZE;
+            uint idx = by*nb_blocks_x+bx;
+
+            //predictors, neighbours already computed in this frame
+            motion_vector_t candidates[5];
+            uint nb_candidates = 0;
+            candidates[nb_candidates++] = (motion_vector_t){0, 0, 0};
+            candidates[nb_candidates++] = prev_field[idx];
+            if(bx > 0){
+                candidates[nb_candidates++] = field[idx-1];
+            }
+            if(by > 0){
+                candidates[nb_candidates++] = field[idx-nb_blocks_x];
+            }
+            if(by > 0 && bx < nb_blocks_x-1){
+                candidates[nb_candidates++] = field[idx-nb_blocks_x+1];
+            }
+
+            motion_vector_t best = {0, 0, UINT32_MAX};
+            for (size_t c = 0; c < nb_candidates; c++)
+            {
+                uint32_t sad = block_matching_sad(img, img_prev, block_x, block_y, candidates[c].x, candidates[c].y);
+                if(sad < best.sad){
+                    best.x = candidates[c].x;
+                    best.y = candidates[c].y;
+                    best.sad = sad;
+                }
+            }
+
+            //large diamond, moves until the centre is the best position
+            for (size_t step = 0; step < BM_MAX_DIAMOND_STEPS && best.sad > good_enough; step++)
+            {
+                motion_vector_t centre = best;
+                for (size_t k = 0; k < 8; k++)
+                {
+                    int vec_x = centre.x+large_diamond[2*k];
+                    int vec_y = centre.y+large_diamond[2*k+1];
+                    if(abs(vec_x) > BM_SEARCH_RANGE || abs(vec_y) > BM_SEARCH_RANGE){
+                        continue;
+                    }
+
+                    uint32_t sad = block_matching_sad(img, img_prev, block_x, block_y, vec_x, vec_y);
+                    if(sad < best.sad){
+                        best.x = vec_x;
+                        best.y = vec_y;
+                        best.sad = sad;
+                    }
+                }
+
+                if(best.x == centre.x && best.y == centre.y){
+                    break;
+                }
+            }
+
+            //final refinement with the small diamond
+            motion_vector_t centre = best;
+            for (size_t k = 0; k < 4 && best.sad > good_enough; k++)
+            {
+                int vec_x = centre.x+small_diamond[2*k];
+                int vec_y = centre.y+small_diamond[2*k+1];
+                if(abs(vec_x) > BM_SEARCH_RANGE || abs(vec_y) > BM_SEARCH_RANGE){
+                    continue;
+                }
+
+                uint32_t sad = block_matching_sad(img, img_prev, block_x, block_y, vec_x, vec_y);
+                if(sad < best.sad){
+                    best.x = vec_x;
+                    best.y = vec_y;
+                    best.sad = sad;
+                }
+            }
+
+            field[idx] = best;
+        }
+    }
+}
+
+//the levels are halved in size, the smoothness weight is divided by 4 at each level
+//since the coarse equations are averages of 2x2 fine equations
+void horn_schunck_init(horn_schunck_t *hs, int width, int height){
+    flow_derivatives_init(&hs->deriv, width, height);
+
+    for (uint l = 0; l < HS_LEVELS; l++)
+    {
+        hs_level_t *level = &hs->levels[l];
+        level->width = width;
+        level->height = height;
+        level->alpha = HS_ALPHA/(1<<(2*l));
+
+        uint size = width*height;
+        level->u = calloc(size, sizeof(float));
+        level->v = calloc(size, sizeof(float));
+        level->diag_u = malloc(size*sizeof(float));
+        level->diag_v = malloc(size*sizeof(float));
+        level->inv_diag_u = malloc(size*sizeof(float));
+        level->inv_diag_v = malloc(size*sizeof(float));
+        level->a12 = malloc(size*sizeof(float));
+        level->b1 = malloc(size*sizeof(float));
+        level->b2 = malloc(size*sizeof(float));
+
+        width /= 2;
+        height /= 2;
+    }
+}
+
+void horn_schunck_free(horn_schunck_t *hs){
+    free_flow_derivatives(&hs->deriv);
+
+    for (uint l = 0; l < HS_LEVELS; l++)
+    {
+        hs_level_t *level = &hs->levels[l];
+        free(level->u);
+        free(level->v);
+        free(level->diag_u);
+        free(level->diag_v);
+        free(level->inv_diag_u);
+        free(level->inv_diag_v);
+        free(level->a12);
+        free(level->b1);
+        free(level->b2);
+    }
+}
+
+void horn_schunck_coefficients(hs_level_t *level){
+    for (uint k = 0; k < level->width*level->height; k++)
+    {
+        level->inv_diag_u[k] = 1.0f/level->diag_u[k];
+        level->inv_diag_v[k] = 1.0f/level->diag_v[k];
+    }
+}
+
+//one SOR update of the pixels of a row with (x+y)%2 == colour, their 4 neighbours have the other colour
+//with neon, 4 pixels of the colour are updated at a time, deinterleaved from 8 pixels with vld2q
+void horn_schunck_sor_row(hs_level_t *level, int y, uint colour){
+    int width = level->width;
+    float alpha = level->alpha;
+    float *u = &level->u[y*width];
+    float *v = &level->v[y*width];
+    float *u_above = u-width;
+    float *u_below = u+width;
+    float *v_above = v-width;
+    float *v_below = v+width;
+    float *a12 = &level->a12[y*width];
+    float *b1 = &level->b1[y*width];
+    float *b2 = &level->b2[y*width];
+    float *inv_diag_u = &level->inv_diag_u[y*width];
+    float *inv_diag_v = &level->inv_diag_v[y*width];
+
+    int x = ((1+y)&1) == colour ? 1 : 2;
+#ifdef __ARM_NEON
+    float32x4_t v_omega = vdupq_n_f32(HS_OMEGA);
+    for (; x+8 <= width-1; x+=8)
+    {
+        //val[0] are the pixels to update, val[1] their right neighbours
+        float32x4x2_t cur_u = vld2q_f32(&u[x]);
+        float32x4x2_t cur_v = vld2q_f32(&v[x]);
+
+        float32x4_t sum_u = vaddq_f32(vaddq_f32(vld2q_f32(&u[x-1]).val[0], cur_u.val[1]), vaddq_f32(vld2q_f32(&u_above[x]).val[0], vld2q_f32(&u_below[x]).val[0]));
+        float32x4_t sum_v = vaddq_f32(vaddq_f32(vld2q_f32(&v[x-1]).val[0], cur_v.val[1]), vaddq_f32(vld2q_f32(&v_above[x]).val[0], vld2q_f32(&v_below[x]).val[0]));
+
+        float32x4_t coef = vld2q_f32(&a12[x]).val[0];
+
+        float32x4_t u_gs = vmulq_f32(vmlsq_f32(vmlaq_n_f32(vld2q_f32(&b1[x]).val[0], sum_u, alpha), coef, cur_v.val[0]), vld2q_f32(&inv_diag_u[x]).val[0]);
+        cur_u.val[0] = vmlaq_f32(cur_u.val[0], v_omega, vsubq_f32(u_gs, cur_u.val[0]));
+
+        float32x4_t v_gs = vmulq_f32(vmlsq_f32(vmlaq_n_f32(vld2q_f32(&b2[x]).val[0], sum_v, alpha), coef, cur_u.val[0]), vld2q_f32(&inv_diag_v[x]).val[0]);
+        cur_v.val[0] = vmlaq_f32(cur_v.val[0], v_omega, vsubq_f32(v_gs, cur_v.val[0]));
+
+        //the right neighbours are stored back unchanged
+        vst2q_f32(&u[x], cur_u);
+        vst2q_f32(&v[x], cur_v);
+    }
+#endif
+    for (; x < width-1; x+=2)
+    {
+        float sum_u = u[x-1]+u[x+1]+u_above[x]+u_below[x];
+        float sum_v = v[x-1]+v[x+1]+v_above[x]+v_below[x];
+
+        float u_gs = (alpha*sum_u+b1[x]-a12[x]*v[x])*inv_diag_u[x];
+        u[x] += HS_OMEGA*(u_gs-u[x]);
+
+        float v_gs = (alpha*sum_v+b2[x]-a12[x]*u[x])*inv_diag_v[x];
+        v[x] += HS_OMEGA*(v_gs-v[x]);
+    }
+}
+
+//red-black SOR iterations, the border pixels copy their neighbour (zero derivative of the flow)
+void horn_schunck_smooth(hs_level_t *level, uint nb_iterations){
+    int width = level->width;
+    int height = level->height;
+
+    for (uint it = 0; it < nb_iterations; it++)
+    {
+        for (uint colour = 0; colour < 2; colour++)
+        {
+            for (int y = 1; y < height-1; y++)
+            {
+                horn_schunck_sor_row(level, y, colour);
+            }
+        }
+    }
+
+    for (int y = 1; y < height-1; y++)
+    {
+        level->u[y*width] = level->u[y*width+1];
+        level->v[y*width] = level->v[y*width+1];
+        level->u[y*width+width-1] = level->u[y*width+width-2];
+        level->v[y*width+width-1] = level->v[y*width+width-2];
+    }
+    memcpy(level->u, &level->u[width], width*sizeof(float));
+    memcpy(level->v, &level->v[width], width*sizeof(float));
+    memcpy(&level->u[(height-1)*width], &level->u[(height-2)*width], width*sizeof(float));
+    memcpy(&level->v[(height-1)*width], &level->v[(height-2)*width], width*sizeof(float));
+}
+
+//smooths the level, solves for its error on the coarser level and corrects it, then smooths again
+void horn_schunck_vcycle(hs_level_t *levels, uint level_idx){
+    hs_level_t *level = &levels[level_idx];
+
+    if(level_idx == HS_LEVELS-1){
+        horn_schunck_smooth(level, HS_COARSE_ITERATIONS);
+        return;
+    }
+
+    horn_schunck_smooth(level, HS_PRE_SMOOTHING);
+
+    int width = level->width;
+    int height = level->height;
+    hs_level_t *coarse = &levels[level_idx+1];
+    int coarse_width = coarse->width;
+    int coarse_height = coarse->height;
+    uint coarse_size = coarse_width*coarse_height;
+
+    //the residual, averaged on 2x2 blocks, is the right hand side of the coarse level
+    memset(coarse->u, 0, coarse_size*sizeof(float));
+    memset(coarse->v, 0, coarse_size*sizeof(float));
+    memset(coarse->b1, 0, coarse_size*sizeof(float));
+    memset(coarse->b2, 0, coarse_size*sizeof(float));
+
+    for (int y = 1; y < height-1 && y/2 < coarse_height; y++)
+    {
+        for (int x = 1; x < width-1 && x/2 < coarse_width; x++)
+        {
+            uint k = y*width+x;
+            float sum_u = level->u[k-1]+level->u[k+1]+level->u[k-width]+level->u[k+width];
+            float sum_v = level->v[k-1]+level->v[k+1]+level->v[k-width]+level->v[k+width];
+            float r1 = level->b1[k]+level->alpha*sum_u-level->diag_u[k]*level->u[k]-level->a12[k]*level->v[k];
+            float r2 = level->b2[k]+level->alpha*sum_v-level->diag_v[k]*level->v[k]-level->a12[k]*level->u[k];
+
+            uint coarse_k = (y/2)*coarse_width+x/2;
+            coarse->b1[coarse_k] += 0.25f*r1;
+            coarse->b2[coarse_k] += 0.25f*r2;
+        }
+    }
+
+    horn_schunck_vcycle(levels, level_idx+1);
+
+    //correction, constant on each 2x2 block
+    for (int y = 1; y < height-1; y++)
+    {
+        int coarse_y = y/2 < coarse_height ? y/2 : coarse_height-1;
+        for (int x = 1; x < width-1; x++)
+        {
+            int coarse_x = x/2 < coarse_width ? x/2 : coarse_width-1;
+            level->u[y*width+x] += coarse->u[coarse_y*coarse_width+coarse_x];
+            level->v[y*width+x] += coarse->v[coarse_y*coarse_width+coarse_x];
+        }
+    }
+
+    horn_schunck_smooth(level, HS_POST_SMOOTHING);
+}
+
+//horn schunck flow of the image pair in levels[0].u and levels[0].v
+//the derivatives are computed once, the previous flow is the starting point and a single v-cycle refines it,
+//so the cost is fixed and a steady flow is reached after a few frames
+void calc_horn_schunck_flow(image_grayscale_t *img, image_grayscale_t *img_prev, horn_schunck_t *hs){
+    hs_level_t *levels = hs->levels;
+    flow_derivatives_t *deriv = &hs->deriv;
+    compute_flow_derivatives(img, img_prev, deriv);
+
+    //same normalisation as calc_dx, calc_dy and calc_dt, intensities are kept in 0-255
+    hs_level_t *fine = &levels[0];
+    for (uint k = 0; k < fine->width*fine->height; k++)
+    {
+        float ix = deriv->dx[k]*(1.0f/6.0f);
+        float iy = deriv->dy[k]*(1.0f/6.0f);
+        float it = deriv->dt[k]*(1.0f/9.0f);
+
+        fine->diag_u[k] = ix*ix+4.0f*fine->alpha;
+        fine->diag_v[k] = iy*iy+4.0f*fine->alpha;
+        fine->a12[k] = ix*iy;
+        fine->b1[k] = -ix*it;
+        fine->b2[k] = -iy*it;
+    }
+    horn_schunck_coefficients(fine);
+
+    //the data terms of the coarse levels are averages of the finer ones
+    for (uint l = 1; l < HS_LEVELS; l++)
+    {
+        hs_level_t *finer = &levels[l-1];
+        hs_level_t *level = &levels[l];
+        int finer_width = finer->width;
+
+        for (int y = 0; y < level->height; y++)
+        {
+            for (int x = 0; x < level->width; x++)
+            {
+                uint k = 2*y*finer_width+2*x;
+                float a11 = finer->diag_u[k]+finer->diag_u[k+1]+finer->diag_u[k+finer_width]+finer->diag_u[k+finer_width+1];
+                float a22 = finer->diag_v[k]+finer->diag_v[k+1]+finer->diag_v[k+finer_width]+finer->diag_v[k+finer_width+1];
+                float a12 = finer->a12[k]+finer->a12[k+1]+finer->a12[k+finer_width]+finer->a12[k+finer_width+1];
+
+                //the smoothness part of the finer diagonal is removed
+                level->diag_u[y*level->width+x] = 0.25f*a11-4.0f*finer->alpha+4.0f*level->alpha;
+                level->diag_v[y*level->width+x] = 0.25f*a22-4.0f*finer->alpha+4.0f*level->alpha;
+                level->a12[y*level->width+x] = 0.25f*a12;
+            }
+        }
+        horn_schunck_coefficients(level);
+    }
+
+    horn_schunck_vcycle(levels, 0);
+}
+
+//solves a*x = b by gaussian elimination with partial pivoting, a is n*n row major, the solution is written in b
+//returns 0 if the system is singular
+uint solve_linear_system(double *a, double *b, uint n){
+    for (uint col = 0; col < n; col++)
+    {
+        uint pivot = col;
+        for (uint r = col+1; r < n; r++)
+        {
+            if(fabs(a[r*n+col]) > fabs(a[pivot*n+col])){
+                pivot = r;
+            }
+        }
+
+        if(fabs(a[pivot*n+col]) < 1e-9){
+            return 0;
+        }
+
+        if(pivot != col){
+            for (uint c = 0; c < n; c++)
+            {
+                double tmp = a[col*n+c];
+                a[col*n+c] = a[pivot*n+c];
+                a[pivot*n+c] = tmp;
+            }
+            double tmp = b[col];
+            b[col] = b[pivot];
+            b[pivot] = tmp;
+        }
+
+        for (uint r = col+1; r < n; r++)
+        {
+            double factor = a[r*n+col]/a[col*n+col];
+            for (uint c = col; c < n; c++)
+            {
+                a[r*n+c] -= factor*a[col*n+c];
+            }
+            b[r] -= factor*b[col];
+        }
+    }
+
+    for (int r = n-1; r >= 0; r--)
+    {
+        double val = b[r];
+        for (uint c = r+1; c < n; c++)
+        {
+            val -= a[r*n+c]*b[c];
+        }
+        b[r] = val/a[r*n+r];
+    }
+
+    return 1;
+}
+
+//least squares fit of the model on the given vectors (src -> dst), exact for a minimal sample
+//the homography is fixed with h[8] = 1, so both models are linear in their parameters
+//returns 0 if the vectors are degenerate (collinear sample)
+uint fit_motion_model(float *src_x, float *src_y, float *dst_x, float *dst_y, uint *indices, uint nb, uint model, float *h){
+    uint n = model == GM_MODEL_HOMOGRAPHY ? 8 : 6;
+
+    //normal equations
+    double ata[8*8] = {0};
+    double atb[8] = {0};
+
+    for (uint k = 0; k < nb; k++)
+    {
+        double x = src_x[indices[k]];
+        double y = src_y[indices[k]];
+        double tx = dst_x[indices[k]];
+        double ty = dst_y[indices[k]];
+
+        //one equation per coordinate, the last two columns are only used by the homography
+        double row_x[8] = {x, y, 1, 0, 0, 0, -x*tx, -y*tx};
+        double row_y[8] = {0, 0, 0, x, y, 1, -x*ty, -y*ty};
+
+        //upper triangle only, the matrix is symmetric
+        for (uint r = 0; r < n; r++)
+        {
+            for (uint c = r; c < n; c++)
+            {
+                ata[r*n+c] += row_x[r]*row_x[c]+row_y[r]*row_y[c];
+            }
+            atb[r] += row_x[r]*tx+row_y[r]*ty;
+        }
+    }
+
+    for (uint r = 1; r < n; r++)
+    {
+        for (uint c = 0; c < r; c++)
+        {
+            ata[r*n+c] = ata[c*n+r];
+        }
+    }
+
+    if(!solve_linear_system(ata, atb, n)){
+        return 0;
+    }
+
+    for (uint r = 0; r < n; r++)
+    {
+        h[r] = atb[r];
+    }
+    if(model != GM_MODEL_HOMOGRAPHY){
+        h[6] = 0;
+        h[7] = 0;
+    }
+    h[8] = 1;
+
+    return 1;
+}
+
+//counts the vectors whose end is within threshold of the model, the division by w is avoided by comparing
+//|(h0 x+h1 y+h2, h3 x+h4 y+h5) - dst*w|^2 with threshold^2*w^2 (points with w <= 0 are outliers)
+//the count stops (returning 0) as soon as the remaining vectors cannot give more than best inliers
+//inlier_mask can be NULL, it is only complete if the count did not stop early
+uint count_motion_inliers(float *h, float *src_x, float *src_y, float *dst_x, float *dst_y, uint nb, float threshold, uint best, uint8_t *inlier_mask){
+    #define GM_CHUNK 64
+    float threshold_sq = threshold*threshold;
+    uint nb_inliers = 0;
+
+    uint k = 0;
+    while(k < nb){
+        uint chunk_end = k+GM_CHUNK < nb ? k+GM_CHUNK : nb;
+
+#ifdef __ARM_NEON
+        uint32x4_t count = vdupq_n_u32(0);
+        for (; k+4 <= chunk_end; k+=4)
+        {
+            float32x4_t x = vld1q_f32(&src_x[k]);
+            float32x4_t y = vld1q_f32(&src_y[k]);
+            float32x4_t tx = vld1q_f32(&dst_x[k]);
+            float32x4_t ty = vld1q_f32(&dst_y[k]);
+
+            float32x4_t px = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(h[2]), x, h[0]), y, h[1]);
+            float32x4_t py = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(h[5]), x, h[3]), y, h[4]);
+            float32x4_t w = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(h[8]), x, h[6]), y, h[7]);
+
+            float32x4_t err_x = vmlsq_f32(px, tx, w);
+            float32x4_t err_y = vmlsq_f32(py, ty, w);
+            float32x4_t err = vmlaq_f32(vmulq_f32(err_x, err_x), err_y, err_y);
+            float32x4_t limit = vmulq_n_f32(vmulq_f32(w, w), threshold_sq);
+
+            //lanes are all ones for an inlier, subtracting them counts the inliers
+            uint32x4_t inlier = vandq_u32(vcltq_f32(err, limit), vcgtq_f32(w, vdupq_n_f32(0)));
+            count = vsubq_u32(count, inlier);
+
+            if(inlier_mask != NULL){
+                uint32_t lanes[4];
+                vst1q_u32(lanes, inlier);
+                for (uint l = 0; l < 4; l++)
+                {
+                    inlier_mask[k+l] = lanes[l]&1;
+                }
+            }
+        }
+        uint64x2_t total = vpaddlq_u32(count);
+        nb_inliers += vgetq_lane_u64(total, 0)+vgetq_lane_u64(total, 1);
+#endif
+        for (; k < chunk_end; k++)
+        {
+            float w = h[6]*src_x[k]+h[7]*src_y[k]+h[8];
+            float err_x = h[0]*src_x[k]+h[1]*src_y[k]+h[2]-dst_x[k]*w;
+            float err_y = h[3]*src_x[k]+h[4]*src_y[k]+h[5]-dst_y[k]*w;
+            uint inlier = w > 0 && err_x*err_x+err_y*err_y < threshold_sq*w*w;
+
+            nb_inliers += inlier;
+            if(inlier_mask != NULL){
+                inlier_mask[k] = inlier;
+            }
+        }
+
+        if(nb_inliers+(nb-k) <= best){
+            return 0;
+        }
+    }
+
+    return nb_inliers;
+}
+
+//fits the camera motion (affine or homography) on the flow vectors with ransac
+//the number of hypotheses adapts to the best inlier ratio found so far, and the best model is refined on its inliers
+//inlier_mask receives 1 for the vectors following the camera motion, 0 for the others (moving objects, wrong vectors)
+//returns 0 if no model could be found
+uint estimate_global_motion(float *pos_x, float *pos_y, float *u_x, float *u_y, uint nb_vectors, uint model, global_motion_t *motion, uint8_t *inlier_mask){
+    uint sample_size = model == GM_MODEL_HOMOGRAPHY ? 4 : 3;
+
+    if(nb_vectors < GM_MIN_VECTORS){
+        return 0;
+    }
+
+    //coordinates are centred and scaled to about 1, for the conditioning of the systems
+    float mean_x = 0;
+    float mean_y = 0;
+    for (uint k = 0; k < nb_vectors; k++)
+    {
+        mean_x += pos_x[k];
+        mean_y += pos_y[k];
+    }
+    mean_x /= nb_vectors;
+    mean_y /= nb_vectors;
+
+    float scale = 0;
+    for (uint k = 0; k < nb_vectors; k++)
+    {
+        scale += fabsf(pos_x[k]-mean_x)+fabsf(pos_y[k]-mean_y);
+    }
+    scale /= nb_vectors;
+    if(scale < 1.0f){
+        scale = 1.0f;
+    }
+    float inv_scale = 1.0f/scale;
+
+    //structure of arrays for the vectorised residuals
+    //the vectors are bounded by the grid, the buffers are on the stack like the vectors of the caller (no allocation per frame)
+    float coords[4*nb_vectors];
+    float *src_x = &coords[0];
+    float *src_y = &coords[nb_vectors];
+    float *dst_x = &coords[2*nb_vectors];
+    float *dst_y = &coords[3*nb_vectors];
+    for (uint k = 0; k < nb_vectors; k++)
+    {
+        src_x[k] = (pos_x[k]-mean_x)*inv_scale;
+        src_y[k] = (pos_y[k]-mean_y)*inv_scale;
+        dst_x[k] = (pos_x[k]+u_x[k]-mean_x)*inv_scale;
+        dst_y[k] = (pos_y[k]+u_y[k]-mean_y)*inv_scale;
+    }
+    float threshold = GM_INLIER_THRESHOLD*inv_scale;
+
+    float best_h[9];
+    uint best_inliers = 0;
+    uint nb_iterations = GM_MAX_ITERATIONS;
+
+    //fixed seed, the result of a frame does not depend on the previous ones
+    uint32_t seed = 0x2545F491;
+
+    for (uint it = 0; it < nb_iterations; it++)
+    {
+        //minimal sample of distinct vectors
+        uint sample[4];
+        for (uint k = 0; k < sample_size; k++)
+        {
+            uint duplicate;
+            do{
+                seed = seed*1664525+1013904223;
+                sample[k] = (seed>>8)%nb_vectors;
+                duplicate = 0;
+                for (uint l = 0; l < k; l++)
+                {
+                    duplicate |= sample[l] == sample[k];
+                }
+            } while(duplicate);
+        }
+
+        float h[9];
+        if(!fit_motion_model(src_x, src_y, dst_x, dst_y, sample, sample_size, model, h)){
+            continue;
+        }
+
+        uint nb_inliers = count_motion_inliers(h, src_x, src_y, dst_x, dst_y, nb_vectors, threshold, best_inliers, NULL);
+        if(nb_inliers > best_inliers){
+            best_inliers = nb_inliers;
+            memcpy(best_h, h, sizeof(best_h));
+
+            //enough iterations to draw a sample without outliers with a probability of GM_CONFIDENCE
+            float p_good_sample = powf((float)nb_inliers/nb_vectors, sample_size);
+            if(p_good_sample >= 1.0f){
+                break;
+            }
+            float needed = logf(1.0f-GM_CONFIDENCE)/logf(1.0f-p_good_sample);
+            if(needed < nb_iterations){
+                nb_iterations = needed+1;
+            }
+        }
+    }
+
+    if(best_inliers <= sample_size){
+        return 0;
+    }
+
+    //least squares on all the inliers, kept if it does not lose any
+    uint indices[nb_vectors];
+    count_motion_inliers(best_h, src_x, src_y, dst_x, dst_y, nb_vectors, threshold, 0, inlier_mask);
+    uint nb_indices = 0;
+    for (uint k = 0; k < nb_vectors; k++)
+    {
+        if(inlier_mask[k]){
+            indices[nb_indices] = k;
+            nb_indices++;
+        }
+    }
+
+    float h[9];
+    if(fit_motion_model(src_x, src_y, dst_x, dst_y, indices, nb_indices, model, h)
+        && count_motion_inliers(h, src_x, src_y, dst_x, dst_y, nb_vectors, threshold, 0, NULL) >= best_inliers){
+        memcpy(best_h, h, sizeof(best_h));
+    }
+    motion->nb_inliers = count_motion_inliers(best_h, src_x, src_y, dst_x, dst_y, nb_vectors, threshold, 0, inlier_mask);
+
+    //back to pixel coordinates: h = t^-1 * best_h * t, with t the normalisation p -> (p-mean)*inv_scale
+    float t[9] = {inv_scale, 0, -mean_x*inv_scale, 0, inv_scale, -mean_y*inv_scale, 0, 0, 1};
+    float t_inv[9] = {scale, 0, mean_x, 0, scale, mean_y, 0, 0, 1};
+    float tmp[9];
+    for (uint r = 0; r < 3; r++)
+    {
+        for (uint c = 0; c < 3; c++)
+        {
+            tmp[r*3+c] = best_h[r*3]*t[c]+best_h[r*3+1]*t[3+c]+best_h[r*3+2]*t[6+c];
+        }
+    }
+    for (uint r = 0; r < 3; r++)
+    {
+        for (uint c = 0; c < 3; c++)
+        {
+            motion->h[r*3+c] = t_inv[r*3]*tmp[c]+t_inv[r*3+1]*tmp[3+c]+t_inv[r*3+2]*tmp[6+c];
+        }
+    }
+    for (uint k = 0; k < 9; k++)
+    {
+        motion->h[k] /= motion->h[8];
+    }
+
+    return 1;
+}
+
+//displacement of the point (pos_x, pos_y) of the previous image given by the camera motion
+void global_motion_at(global_motion_t *motion, float pos_x, float pos_y, float *u_x, float *u_y){
+    float *h = motion->h;
+    float w = h[6]*pos_x+h[7]*pos_y+h[8];
+    *u_x = (h[0]*pos_x+h[1]*pos_y+h[2])/w-pos_x;
+    *u_y = (h[3]*pos_x+h[4]*pos_y+h[5])/w-pos_y;
+}
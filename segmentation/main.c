@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
@@ -8,8 +9,14 @@
 #include <semaphore.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 
-//camera/mmal/raspberry specific libraries
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+//camera/mmal/raspberry specific libraries, not needed by a replay only build (-DFRAME_SOURCE_NO_CAMERA)
+#ifndef FRAME_SOURCE_NO_CAMERA
 #include "bcm_host.h"
 #include "mmal.h"
 #include "util/mmal_default_components.h"
@@ -19,8 +26,12 @@
 #include "interface/vcos/vcos.h"
 
 #include "../common/camera_mmal.h"
+#endif
+
 #include "../common/image.h"
 #include "../common/edge_detect.h"
+#include "../common/connected_components.h"
+#include "../common/frame_source.h"
 
 //will affect framerate, it seems that if framerate is higher than possible shutter speed, it will be automatically lowered
 #define CAMERA_SHUTTER_SPEED 25000
@@ -33,33 +44,90 @@
 #define CAMERA_RESOLUTION_X 640
 #define CAMERA_RESOLUTION_Y 480
 
+//points of the k-means: colour of the pixels only, or colour and normalised position
+//slic: superpixels, hundreds of rgbxy centroids each compared only to the pixels around it
+#define KMEANS_MODE_RGB 0
+#define KMEANS_MODE_RGBXY 1
+#define KMEANS_MODE_SLIC 2
+#define KMEANS_MODE KMEANS_MODE_RGBXY
+
+//the centroids are fitted on one pixel out of KMEANS_FIT_SUBSAMPLE in each direction (1/16 of the pixels),
+//then every pixel is assigned once, 1 fits on the full image
+#define KMEANS_FIT_SUBSAMPLE 4
+
+//integer distances of the assignment, colours and normalised positions are in fixed point with this many fractional bits
+//the largest squared distance (5 channels of 255<<6) still fits in 32bits
+#define KMEANS_FIXED_BITS 6
+#define KMEANS_MAX_CLUSTERS 16
+//bound of the rounding error between two fixed point distances (pixel and centroid rounded to half a unit on 5 channels)
+#define KMEANS_TIE_MARGIN (2*5*(2*(255<<KMEANS_FIXED_BITS)+1))
+
+//hamerly bounds: each pixel keeps an upper bound of the distance to its centroid and a lower bound of the distance to the others
+//the distances are only computed when the bounds can't prove that the label is unchanged
+//the bounds are kept between iterations and frames, loosened by the moves of the centroids and the colour change of the pixel
+#define KMEANS_BOUNDS 1
+
+//rgb mode only: the k-means runs on a histogram of the colours quantised to KMEANS_HIST_BITS per channel (32x32x32 bins),
+//each occupied bin weighted by its number of pixels, then the pixels are labelled with a lookup table of the bins
+//the cost of the cycles depends on the number of distinct colours and not on the resolution
+#define KMEANS_HISTOGRAM 1
+#define KMEANS_HIST_BITS 5
+#define KMEANS_HIST_NB_BINS (1<<(3*KMEANS_HIST_BITS))
+#define KMEANS_USE_HISTOGRAM (KMEANS_MODE == KMEANS_MODE_RGB && KMEANS_HISTOGRAM)
+
+//the assignment, the sums of the centroids and the incremental update are split in stripes of rows between this many threads (the cores of the pi)
+//each thread keeps its own sums, merged in the order of the stripes
+//kmeans_nb_threads can lower it at run time (the benchmark compares with a single thread)
+#define KMEANS_NB_THREADS 4
+
+//slic: about SLIC_NB_SUPERPIXELS centroids seeded on a grid of step S, each compared to the pixels of a 2S window around it
+//the compactness weights the distance in pixels (relative to S) against the colour distance
+//after the cycles, the pixels disconnected from the main part of their superpixel, or in a superpixel smaller than
+//S*S/SLIC_MIN_SIZE_DIVISOR, are merged in a neighbouring superpixel
+#define SLIC_NB_SUPERPIXELS 400
+#define SLIC_COMPACTNESS 10.0f
+#define SLIC_MIN_SIZE_DIVISOR 4
+
+//k-means++ seeding on one pixel out of KMEANS_SEED_STEP in each direction (1200 pixels at 640x480)
+//the same sample detects the empty or collapsed centroids (closer than KMEANS_COLLAPSE_DISTANCE to another one),
+//re-seeded on the pixel of the sample the farthest from the other centroids,
+//and the scene changes: all the centroids are re-seeded when the mean distance of the sample to its closest centroid
+//grows by KMEANS_SCENE_CHANGE_RATIO since the last frame (and above KMEANS_SCENE_CHANGE_MIN_ERROR)
+#define KMEANS_SEED_STEP 16
+#define KMEANS_COLLAPSE_DISTANCE 4.0f
+#define KMEANS_SCENE_CHANGE_RATIO 1.25f
+#define KMEANS_SCENE_CHANGE_MIN_ERROR 8.0f
+
+//incremental k-means for a static camera: between full updates (every kmeans_incremental_refresh frames, KMEANS_INCREMENTAL_REFRESH by default, and on scene changes),
+//only the pixels whose colour changed by more than KMEANS_CHANGE_TOLERANCE on a channel are assigned again,
+//and the sums of the centroids are updated by removing the old contribution of these pixels and adding the new one
+//the labels of the other pixels are only checked again by a full update, made as soon as a centroid moved by more than
+//KMEANS_INCREMENTAL_MAX_DRIFT since the last one or a centroid is re-seeded
+#define KMEANS_INCREMENTAL 1
+#define KMEANS_INCREMENTAL_REFRESH 30
+#define KMEANS_CHANGE_TOLERANCE 8
+#define KMEANS_INCREMENTAL_MAX_DRIFT 4.0f
+
+//clusters of the k-means and cycles per frame (slic: cycles only)
+#define KMEANS_NB_CLUSTERS 8
+#define KMEANS_NB_CYCLES 8
+
+//regions of the k-means: connected components of the label plane, the bounding boxes of the big ones are drawn
+//with slic the regions are the segments (superpixels split in connected parts), the big ones are those on flat areas
+//a segment stays in the 2S window of its centroid, under 4*S*S pixels (about 3000 at 640x480), so its threshold is lower
+#define DRAW_REGIONS 1
+#define REGION_MIN_AREA 2000
+#define SLIC_REGION_MIN_AREA 1500
+
 char *fbp;
 uint32_t screen_size_x = 0;
 uint32_t screen_size_y = 0;
 
 static int cur_sec;
 
-extern sem_t semaphore_cam_buffer;
-
 void init_time_keeping();
 float get_cur_time();
 
-typedef struct cluster_point_t{
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-
-    //normalised positions
-    float x_norm;
-    float y_norm;
-
-    //real position in the image
-    uint x;
-    uint y;
-
-    uint cluster_id;
-} cluster_point_t;
-
 typedef struct centroid_t{
     float r;
     float g;
@@ -71,22 +139,172 @@ typedef struct centroid_t{
     uint cluster_id;
 } centroid_t;
 
-float assign_points_to_centroid(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids);
-float assign_points_to_centroid_xy(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids);
-float calculate_new_centroids(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids);
-float calculate_new_centroids_xy(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids);
-void draw_rgb_clusters(image_rgb_t *img_draw, cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids);
-void k_means_clustering(image_rgb_t *img_in, image_rgb_t *img_out, uint nb_cluster, uint nb_cycles);
-
-void main(void){
-    MMAL_PORT_T *video_port;
-    MMAL_POOL_T *pool;
-    MMAL_BUFFER_HEADER_T *buffer;
-
+//label plane of an image clustered by k-means, and the normalised positions of its columns and rows in fixed point
+//with KMEANS_BOUNDS, the bounds of each pixel (distances in fixed point), and the pixels and centroids they were computed for
+typedef struct kmeans_buffers_t{
+    uint8_t *labels;
+    uint16_t *pos_x;
+    uint16_t *pos_y;
+
+    uint16_t *upper_bounds;
+    uint16_t *lower_bounds;
+    uint8_t *bounds_img;
+    centroid_t bounds_centroids[KMEANS_MAX_CLUSTERS];
+    uint nb_bounds_centroids; //0 until the bounds are valid
+} kmeans_buffers_t;
+
+//how far each centroid moved since the bounds were computed (rounded up)
+//and half the distance from each centroid to the closest other one (rounded down), in fixed point
+typedef struct kmeans_bounds_moves_t{
+    uint32_t centroid_move[KMEANS_MAX_CLUSTERS];
+    uint32_t max_move;
+    uint32_t half_gap[KMEANS_MAX_CLUSTERS];
+} kmeans_bounds_moves_t;
+
+//sums of the pixels assigned to a centroid
+typedef struct centroid_sums_t{
+    uint total_r;
+    uint total_g;
+    uint total_b;
+    uint total_x;
+    uint total_y;
+    uint nb_points_in_cluster;
+} centroid_sums_t;
+
+//frame the sums and the labels of the incremental k-means were computed for, and the sums of each centroid over the image
+typedef struct kmeans_incremental_t{
+    uint8_t *prev_img;
+    centroid_sums_t sums[KMEANS_MAX_CLUSTERS];
+    centroid_t centroids[KMEANS_MAX_CLUSTERS]; //of the last full update, to measure the drift
+    uint nb_frames; //since the last full update
+} kmeans_incremental_t;
+
+//work on the image split in stripes of rows, each thread only writes its rows and its own results
+typedef struct kmeans_job_t{
+    void (*function)(struct kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end);
+    image_rgb_t *img;
+    kmeans_buffers_t *buffers;
+    centroid_t *lst_centroids;
+    uint nb_centroids;
+    kmeans_bounds_moves_t *moves;
+    kmeans_incremental_t *incremental;
+
+    uint nb_threads; //set by kmeans_run_job
+    uint nb_distances[KMEANS_NB_THREADS]; //incremental update: pixels assigned again
+    centroid_sums_t sums[KMEANS_NB_THREADS][KMEANS_MAX_CLUSTERS]; //incremental update: changes of the sums
+} kmeans_job_t;
+
+//persistent threads, started with the first job
+typedef struct kmeans_thread_t{
+    pthread_t thread;
+    sem_t start;
+    uint idx;
+} kmeans_thread_t;
+
+static kmeans_thread_t kmeans_threads[KMEANS_NB_THREADS];
+static sem_t kmeans_threads_done;
+static kmeans_job_t *kmeans_cur_job = NULL;
+static uint kmeans_threads_started = 1; //the calling thread
+uint kmeans_nb_threads = KMEANS_NB_THREADS;
+uint kmeans_incremental_refresh = KMEANS_INCREMENTAL_REFRESH; //0: full update on every frame
+
+//label of each pixel with the superpixel centroids and the distance to it during the cycles,
+//then the connected superpixels (segments) after the connectivity pass
+typedef struct slic_buffers_t{
+    uint step;
+    uint16_t *labels;
+    float *distances;
+    uint16_t *segments;
+    uint nb_segments;
+    uint max_segments;
+    uint32_t *queue;
+    centroid_sums_t *sums;
+} slic_buffers_t;
+
+//sums of the pixels falling in a bin of the colour histogram, their mean is the point of the bin in the k-means
+typedef struct histogram_bin_t{
+    uint32_t nb_pixels;
+    uint32_t total_r;
+    uint32_t total_g;
+    uint32_t total_b;
+} histogram_bin_t;
+
+//only the occupied bins are listed, and cleared before the next frame
+typedef struct kmeans_histogram_t{
+    histogram_bin_t *bins;
+    uint16_t *occupied;
+    uint nb_occupied;
+    uint8_t *bin_labels;
+} kmeans_histogram_t;
+
+void kmeans_buffers_init(kmeans_buffers_t *buffers, uint width, uint height);
+void subsample_rgb_image(image_rgb_t *src, image_rgb_t *dest, uint step);
+void kmeans_run_job(kmeans_job_t *job);
+void *kmeans_thread_loop(void *arg);
+uint assign_labels(image_rgb_t *img, kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids);
+void assign_labels_rows(kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end);
+void kmeans_histogram_init(kmeans_histogram_t *histogram);
+void kmeans_histogram_build(image_rgb_t *img, kmeans_histogram_t *histogram);
+void kmeans_histogram_assign(kmeans_histogram_t *histogram, centroid_t *lst_centroids, uint nb_centroids);
+float kmeans_histogram_new_centroids(kmeans_histogram_t *histogram, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes);
+void kmeans_histogram_labels(image_rgb_t *img, kmeans_histogram_t *histogram, uint8_t *labels);
+float pixel_centroid_distance_sq(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *centroid);
+float pixel_centroid_distance(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *centroid);
+float centroid_distance(centroid_t *centroid_a, centroid_t *centroid_b);
+uint closest_centroid_bounds(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *lst_centroids, uint nb_centroids, float *best_dist, float *second_dist);
+void kmeans_bounds_prepare(kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids, kmeans_bounds_moves_t *moves);
+uint assign_labels_bounds(image_rgb_t *img, kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids, kmeans_bounds_moves_t *moves, uint y_start, uint y_end);
+float assign_points_to_centroid(image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids, uint y_start, uint y_end);
+uint closest_centroid_xy_float(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *lst_centroids, uint nb_centroids);
+void assign_labels_xy(image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids, uint16_t *pos_x, uint16_t *pos_y, uint y_start, uint y_end);
+void accumulate_centroid_sums(kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end);
+void sum_centroids(image_rgb_t *img, uint8_t *labels, uint nb_centroids, centroid_sums_t *lst_sums);
+float calculate_new_centroids(image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes);
+float centroids_from_sums(image_rgb_t *img, centroid_sums_t *lst_sums, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes);
+void kmeans_incremental_reset(kmeans_incremental_t *incremental, image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids);
+uint kmeans_incremental_update(image_rgb_t *img, kmeans_incremental_t *incremental, kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids);
+void kmeans_incremental_rows(kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end);
+float kmeans_incremental_drift(kmeans_incremental_t *incremental, centroid_t *lst_centroids, uint nb_centroids);
+void centroid_from_pixel(image_rgb_t *img, uint x, uint y, centroid_t *centroid);
+void kmeans_seed_plus_plus(image_rgb_t *img, centroid_t *lst_centroids, uint nb_centroids, uint32_t *seed);
+float kmeans_sample_error(image_rgb_t *img, centroid_t *lst_centroids, uint nb_centroids);
+uint kmeans_reseed_degenerate(image_rgb_t *img, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes);
+void draw_rgb_clusters(image_rgb_t *img_draw, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids);
+uint8_t *k_means_clustering(image_rgb_t *img_in, image_rgb_t *img_out, uint nb_cluster, uint nb_cycles);
+void draw_regions(connected_components_t *regions, image_rgb_t *img_draw, uint min_area);
+void slic_buffers_init(slic_buffers_t *buffers, uint width, uint height, uint nb_superpixels);
+uint slic_seed_centroids(image_rgb_t *img, uint step, centroid_t *lst_centroids);
+void slic_assign_labels(image_rgb_t *img, slic_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids);
+float slic_new_centroids(image_rgb_t *img, slic_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids);
+void slic_enforce_connectivity(image_rgb_t *img, slic_buffers_t *buffers);
+void draw_slic_segments(image_rgb_t *img, image_rgb_t *img_draw, slic_buffers_t *buffers);
+uint16_t *slic_superpixels(image_rgb_t *img_in, image_rgb_t *img_out, uint nb_cycles);
+void process_frame(image_rgb_t *img, image_rgb_t *img_cluster, connected_components_t *regions);
+
+void main(int argc, char **argv){
+#ifndef FRAME_SOURCE_NO_CAMERA
     //sets up the framebuffer, will draw
     framebuffer_init(&fbp, &screen_size_x, &screen_size_y);
-
-    camera_mmal_init(&video_port, &pool, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#endif
+
+    //frames from the camera, or replayed in a loop from a raw rgb sequence given as argument
+    //at the camera framerate or the one given after the sequence (0: as fast as possible)
+    //a replay only build needs the sequence and displays nothing
+    frame_source_t source;
+    if(argc > 1){
+        float framerate = argc > 2 ? atof(argv[2]) : MAX_CAMERA_FRAMERATE;
+        if(frame_source_replay_init(&source, argv[1], CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, 3, framerate, 1) != 0){
+            exit(1);
+        }
+    }
+    else{
+#ifndef FRAME_SOURCE_NO_CAMERA
+        frame_source_camera_init(&source, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#else
+        fprintf(stderr, "usage: %s sequence.raw [framerate]\n\r", argv[0]);
+        exit(1);
+#endif
+    }
 
     float time_since_report = 0.0f;
     int count_frames = 0;
@@ -102,29 +320,32 @@ void main(void){
     img.width = CAMERA_RESOLUTION_X;
     img.height = CAMERA_RESOLUTION_Y;
 
+    //output image allocated once
     image_rgb_t img_cluster;
+    img_cluster.width = img.width;
+    img_cluster.height = img.height;
+    img_cluster.img = malloc(img.width*img.height*3);
+
+    //regions of the label plane, buffers allocated once
+    connected_components_t regions;
+    connected_components_init(&regions, img.width, img.height);
 
     while(1){
         start_time = get_cur_time();
 
-        //wait until a buffer has been received
-        sem_wait(&semaphore_cam_buffer);
+        img.img = frame_source_get(&source);
 
-        buffer = mmal_queue_get(pool->queue);
-
-        img.img = buffer->data;
-
-        const uint NB_CLUSTERS = 8;
-        const uint NB_CYCLES = 8;
-        k_means_clustering(&img, &img_cluster, NB_CLUSTERS, NB_CYCLES);
+        process_frame(&img, &img_cluster, &regions);
 
         // save to raw file
         // save_image_rgb_to_file(&img_cluster, "img_cluster.raw");
 
-        //Send back the buffer to the port to be filled with an image again
-        mmal_port_send_buffer(video_port, buffer);
+        //gives back the frame, the camera can fill its buffer with an image again
+        frame_source_release(&source);
 
+#ifndef FRAME_SOURCE_NO_CAMERA
         image_draw(&img_cluster, fbp, screen_size_x);
+#endif
 
 
         end_time = get_cur_time();
@@ -140,13 +361,35 @@ void main(void){
         }
 
         // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
-
-        free(img_cluster.img);
     }
 
     //todo free the mmal and framebuffer ressources cleanly
 }
 
+//work of the main loop on a frame, the clusters (and the regions) of img are drawn in img_cluster
+void process_frame(image_rgb_t *img, image_rgb_t *img_cluster, connected_components_t *regions){
+#if KMEANS_MODE == KMEANS_MODE_SLIC
+    //more than 256 segments, 16bits plane
+    image_grayscale16_t img_labels;
+    img_labels.img = slic_superpixels(img, img_cluster, KMEANS_NB_CYCLES);
+#else
+    image_grayscale_t img_labels;
+    img_labels.img = k_means_clustering(img, img_cluster, KMEANS_NB_CLUSTERS, KMEANS_NB_CYCLES);
+#endif
+
+#if DRAW_REGIONS
+    img_labels.width = img->width;
+    img_labels.height = img->height;
+#if KMEANS_MODE == KMEANS_MODE_SLIC
+    connected_components_label16(&img_labels, COMPONENTS_NO_BACKGROUND, 4, regions);
+    draw_regions(regions, img_cluster, SLIC_REGION_MIN_AREA);
+#else
+    connected_components_label(&img_labels, COMPONENTS_NO_BACKGROUND, 4, regions);
+    draw_regions(regions, img_cluster, REGION_MIN_AREA);
+#endif
+#endif
+}
+
 //clock_gettime is a better time keeping mechanism than other on the raspberry pi
 void init_time_keeping(){
     struct timespec time_read;
@@ -160,134 +403,660 @@ float get_cur_time(){
     return (time_read.tv_sec-cur_sec)+time_read.tv_nsec/1000000000.0f;
 }
 
-void k_means_clustering(image_rgb_t *img_in, image_rgb_t *img_out, uint nb_cluster, uint nb_cycles){
-    img_out->width = img_in->width;
-    img_out->height = img_in->height;
-
-    //create a list of all "points" to cluster that is pixels
-    uint number_points = img_in->width*img_in->height;
-    cluster_point_t *lst_points = malloc(number_points*sizeof(cluster_point_t));
-
+//the pixels are read directly in the rgb image, only their labels are kept (between frames as well)
+//the centroids are fitted on a subsampled image, then all the pixels are assigned once
+//img_out must already hold width*height rgb pixels
+//returns the label plane, valid until the next call
+uint8_t *k_means_clustering(image_rgb_t *img_in, image_rgb_t *img_out, uint nb_cluster, uint nb_cycles){
     //keep centroids between frames
     static centroid_t *lst_centroids = NULL;
 
-    uint current_cluster_point_idx = 0;
+    static kmeans_buffers_t buffers;
+#if KMEANS_USE_HISTOGRAM
+    static kmeans_histogram_t histogram;
+#elif KMEANS_FIT_SUBSAMPLE > 1
+    static image_rgb_t img_fit;
+    static kmeans_buffers_t buffers_fit;
+#endif
+    static uint32_t seed = 1;
+    static float last_error = 0;
+#if KMEANS_INCREMENTAL
+    static kmeans_incremental_t incremental;
+#endif
 
-    //initialise each point a value (rgb)
-    for (size_t y = 0; y < img_in->height; y++)
-    {
-        for (size_t x = 0; x < img_in->width; x++)
-        {
-            cluster_point_t pt;
-            pt.x = x;
-            pt.y = y;
-            pt.r = image_get(img_in, x, y, 0);
-            pt.g = image_get(img_in, x, y, 1);
-            pt.b = image_get(img_in, x, y, 2);
+    if(lst_centroids == NULL){
+        kmeans_buffers_init(&buffers, img_in->width, img_in->height);
+
+#if KMEANS_INCREMENTAL
+        incremental.prev_img = malloc(img_in->width*img_in->height*3);
+        //full update on the first frame
+        incremental.nb_frames = kmeans_incremental_refresh;
+#endif
+
+#if KMEANS_USE_HISTOGRAM
+        kmeans_histogram_init(&histogram);
+#elif KMEANS_FIT_SUBSAMPLE > 1
+        img_fit.width = img_in->width/KMEANS_FIT_SUBSAMPLE;
+        img_fit.height = img_in->height/KMEANS_FIT_SUBSAMPLE;
+        img_fit.img = malloc(img_fit.width*img_fit.height*3);
+        kmeans_buffers_init(&buffers_fit, img_fit.width, img_fit.height);
+#endif
+    }
 
-            //normalise the positions in a similar way to the colours
-            pt.x_norm = (float)x/(float)img_in->width*255;
-            pt.y_norm = (float)y/(float)img_in->height*255;
+    //keep centroid values between images, since they shouldn't move that much between two frames
+    if(lst_centroids == NULL){
+        lst_centroids = malloc(nb_cluster*sizeof(centroid_t));
+        kmeans_seed_plus_plus(img_in, lst_centroids, nb_cluster, &seed);
+    }
+    else if(kmeans_sample_error(img_in, lst_centroids, nb_cluster) > KMEANS_SCENE_CHANGE_RATIO*last_error + KMEANS_SCENE_CHANGE_MIN_ERROR){
+        //scene change, the centroids of the last frame are a bad start
+        kmeans_seed_plus_plus(img_in, lst_centroids, nb_cluster, &seed);
+#if KMEANS_INCREMENTAL
+        incremental.nb_frames = kmeans_incremental_refresh;
+#endif
+    }
 
-            pt.cluster_id = 0;
+    uint cluster_sizes[KMEANS_MAX_CLUSTERS];
 
-            lst_points[current_cluster_point_idx] = pt;
+#if KMEANS_INCREMENTAL
+    //between the full updates, only the pixels that changed are assigned again, their bounds are kept valid
+    if(incremental.nb_frames < kmeans_incremental_refresh){
+        kmeans_incremental_update(img_in, &incremental, &buffers, lst_centroids, nb_cluster);
+        centroids_from_sums(img_in, incremental.sums, lst_centroids, nb_cluster, cluster_sizes);
 
-            current_cluster_point_idx++;
+        //the pixels that didn't change may now be closer to another centroid, and a re-seeded centroid has no pixel yet:
+        //both need a full update, made on this frame from the labels, bounds and centroids of the incremental update
+        if(kmeans_reseed_degenerate(img_in, lst_centroids, nb_cluster, cluster_sizes) == 0 && kmeans_incremental_drift(&incremental, lst_centroids, nb_cluster) <= KMEANS_INCREMENTAL_MAX_DRIFT){
+            incremental.nb_frames++;
+
+            last_error = kmeans_sample_error(img_in, lst_centroids, nb_cluster);
+            draw_rgb_clusters(img_out, buffers.labels, lst_centroids, nb_cluster);
+            return buffers.labels;
         }
     }
+#endif
 
-    //keep centroid values between images, since they shouldn't move that much between two frames
-    if(lst_centroids == NULL){
-        lst_centroids = malloc(nb_cluster*sizeof(centroid_t));
+#if KMEANS_USE_HISTOGRAM
+    kmeans_histogram_build(img_in, &histogram);
 
-        //assign each centroid a random value
-        for (size_t i = 0; i < nb_cluster; i++)
-        {
-            uint8_t r = 128;
-            uint8_t g = 128;
-            uint8_t b = 128;
-            uint x = img_in->width/2;
-            uint y = img_in->height/2;
-            centroid_t pt;
-            pt.r = r;
-            pt.g = g;
-            pt.b = b;
-            pt.x = img_in->width/2;
-            pt.y = img_in->height/2;
-            lst_centroids[i] = pt;
-
-            //uint8_t will take care of the modulo
-            r+=15;
-            g+=85;
-            b+=155;
-            x = (x+22)%img_in->width;
-            y = (y+33)%img_in->height;
+    for (size_t i = 0; i < nb_cycles; i++)
+    {
+        kmeans_histogram_assign(&histogram, lst_centroids, nb_cluster);
+
+        float centroid_move = kmeans_histogram_new_centroids(&histogram, lst_centroids, nb_cluster, cluster_sizes);
+
+        //if move not significant and no centroid re-seeded, stop
+        if(kmeans_reseed_degenerate(img_in, lst_centroids, nb_cluster, cluster_sizes) == 0 && centroid_move < 1.0f){
+            break;
         }
     }
 
+    //the labels of the bins with the last centroids, then of the pixels through their bin
+    kmeans_histogram_assign(&histogram, lst_centroids, nb_cluster);
+    kmeans_histogram_labels(img_in, &histogram, buffers.labels);
+#else
+#if KMEANS_FIT_SUBSAMPLE > 1
+    subsample_rgb_image(img_in, &img_fit, KMEANS_FIT_SUBSAMPLE);
+    image_rgb_t *img_cycles = &img_fit;
+    kmeans_buffers_t *buffers_cycles = &buffers_fit;
+#else
+    image_rgb_t *img_cycles = img_in;
+    kmeans_buffers_t *buffers_cycles = &buffers;
+#endif
+
     float centroid_move = 0;
 
     for (size_t i = 0; i < nb_cycles; i++)
     {
-        // assign_points_to_centroid(lst_points, number_points, lst_centroids, nb_cluster);
-        assign_points_to_centroid_xy(lst_points, number_points, lst_centroids, nb_cluster);
+        assign_labels(img_cycles, buffers_cycles, lst_centroids, nb_cluster);
 
-        // centroid_move = calculate_new_centroids(lst_points, number_points, lst_centroids, nb_cluster);
-        centroid_move = calculate_new_centroids_xy(lst_points, number_points, lst_centroids, nb_cluster);
+        centroid_move = calculate_new_centroids(img_cycles, buffers_cycles->labels, lst_centroids, nb_cluster, cluster_sizes);
 
-        //if move not significant, stop
-        if(centroid_move < 1.0f){
+        //if move not significant and no centroid re-seeded, stop
+        if(kmeans_reseed_degenerate(img_in, lst_centroids, nb_cluster, cluster_sizes) == 0 && centroid_move < 1.0f){
             break;
         }
     }
 
-    img_out->img = malloc(img_in->width*img_in->height*3);
+#if KMEANS_FIT_SUBSAMPLE > 1
+    //the labels of the full image with the fitted centroids
+    assign_labels(img_in, &buffers, lst_centroids, nb_cluster);
+#endif
+#endif
+
+#if KMEANS_INCREMENTAL
+    kmeans_incremental_reset(&incremental, img_in, buffers.labels, lst_centroids, nb_cluster);
+#endif
 
-    draw_rgb_clusters(img_out, lst_points, number_points, lst_centroids, nb_cluster);
+    //reference for the scene change detection of the next frame
+    last_error = kmeans_sample_error(img_in, lst_centroids, nb_cluster);
 
-    free(lst_points);
+    draw_rgb_clusters(img_out, buffers.labels, lst_centroids, nb_cluster);
+
+    return buffers.labels;
 }
 
-float assign_points_to_centroid(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids){
-    float avg_distance = 0;
+//bounding box and centroid of the regions with at least min_area pixels
+void draw_regions(connected_components_t *regions, image_rgb_t *img_draw, uint min_area){
+    uint colour[3] = {255, 255, 255};
 
-    //for each point, find closest centroid and assign point to it
+    for (size_t i = 0; i < regions->nb_components; i++)
+    {
+        component_t *region = &regions->components[i];
+        if(region->area < min_area){
+            continue;
+        }
+
+        draw_line(region->min_x, region->min_y, region->max_x, region->min_y, img_draw, colour);
+        draw_line(region->max_x, region->min_y, region->max_x, region->max_y, img_draw, colour);
+        draw_line(region->max_x, region->max_y, region->min_x, region->max_y, img_draw, colour);
+        draw_line(region->min_x, region->max_y, region->min_x, region->min_y, img_draw, colour);
+
+        //draw_circle doesn't clip
+        const uint radius = 3;
+        if(region->centroid_x >= radius && region->centroid_y >= radius && region->centroid_x+radius < img_draw->width && region->centroid_y+radius < img_draw->height){
+            draw_circle(region->centroid_x, region->centroid_y, radius, img_draw);
+        }
+    }
+}
+
+//label plane and normalised positions of the columns and rows in fixed point for assign_labels_xy
+void kmeans_buffers_init(kmeans_buffers_t *buffers, uint width, uint height){
+    buffers->labels = calloc(width*height, 1);
+    buffers->pos_x = malloc(width*sizeof(uint16_t));
+    buffers->pos_y = malloc(height*sizeof(uint16_t));
+
+    //same normalisation as the float positions, x/width*255
+    for (size_t x = 0; x < width; x++)
+    {
+        buffers->pos_x[x] = ((x*255)<<KMEANS_FIXED_BITS)/(float)width+0.5f;
+    }
+    for (size_t y = 0; y < height; y++)
+    {
+        buffers->pos_y[y] = ((y*255)<<KMEANS_FIXED_BITS)/(float)height+0.5f;
+    }
+
+#if KMEANS_BOUNDS && !KMEANS_USE_HISTOGRAM
+    buffers->upper_bounds = malloc(width*height*sizeof(uint16_t));
+    buffers->lower_bounds = malloc(width*height*sizeof(uint16_t));
+    buffers->bounds_img = malloc(width*height*3);
+    buffers->nb_bounds_centroids = 0;
+#endif
+}
+
+//one pixel out of step in each direction, dest must already be allocated with the reduced size
+//the normalised positions of the kept pixels are the same in both images
+void subsample_rgb_image(image_rgb_t *src, image_rgb_t *dest, uint step){
+    for (size_t y = 0; y < dest->height; y++)
+    {
+        uint8_t *src_row = &src->img[y*step*src->width*3];
+        uint8_t *dest_row = &dest->img[y*dest->width*3];
+        for (size_t x = 0; x < dest->width; x++)
+        {
+            dest_row[x*3] = src_row[x*step*3];
+            dest_row[x*3+1] = src_row[x*step*3+1];
+            dest_row[x*3+2] = src_row[x*step*3+2];
+        }
+    }
+}
+
+void kmeans_histogram_init(kmeans_histogram_t *histogram){
+    histogram->bins = calloc(KMEANS_HIST_NB_BINS, sizeof(histogram_bin_t));
+    histogram->occupied = malloc(KMEANS_HIST_NB_BINS*sizeof(uint16_t));
+    histogram->nb_occupied = 0;
+    histogram->bin_labels = calloc(KMEANS_HIST_NB_BINS, 1);
+}
+
+//bin of a colour, the high bits of r, g and b
+#define HIST_BIN(r, g, b) ((((r)>>(8-KMEANS_HIST_BITS))<<(2*KMEANS_HIST_BITS)) | (((g)>>(8-KMEANS_HIST_BITS))<<KMEANS_HIST_BITS) | ((b)>>(8-KMEANS_HIST_BITS)))
+
+//one pass on the image, the bins of the previous frame are cleared through the list of occupied bins
+void kmeans_histogram_build(image_rgb_t *img, kmeans_histogram_t *histogram){
+    for (size_t i = 0; i < histogram->nb_occupied; i++)
+    {
+        histogram_bin_t *bin = &histogram->bins[histogram->occupied[i]];
+        bin->nb_pixels = 0;
+        bin->total_r = 0;
+        bin->total_g = 0;
+        bin->total_b = 0;
+    }
+    histogram->nb_occupied = 0;
+
+    uint nb_points = img->width*img->height;
     for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
     {
+        uint8_t r = img->img[pt_idx*3];
+        uint8_t g = img->img[pt_idx*3+1];
+        uint8_t b = img->img[pt_idx*3+2];
+        uint bin_idx = HIST_BIN(r, g, b);
+        histogram_bin_t *bin = &histogram->bins[bin_idx];
+
+        if(bin->nb_pixels == 0){
+            histogram->occupied[histogram->nb_occupied++] = bin_idx;
+        }
+        bin->nb_pixels++;
+        bin->total_r += r;
+        bin->total_g += g;
+        bin->total_b += b;
+    }
+}
+
+//closest centroid of the mean colour of each occupied bin
+void kmeans_histogram_assign(kmeans_histogram_t *histogram, centroid_t *lst_centroids, uint nb_centroids){
+    for (size_t i = 0; i < histogram->nb_occupied; i++)
+    {
+        uint bin_idx = histogram->occupied[i];
+        histogram_bin_t *bin = &histogram->bins[bin_idx];
+        float inv_nb_pixels = 1.0f/bin->nb_pixels;
+        float r = bin->total_r*inv_nb_pixels;
+        float g = bin->total_g*inv_nb_pixels;
+        float b = bin->total_b*inv_nb_pixels;
+
+        //squared distances, the order is the same as with sqrt
         float min_dist_to_centroid = 10000000000; //safe max value
         uint selected_centroid = 0;
 
-        for (size_t i = 0; i < nb_centroids; i++)
+        for (size_t c = 0; c < nb_centroids; c++)
         {
             float dist_to_centroid = 0;
 
-            dist_to_centroid += (lst_points[pt_idx].r-lst_centroids[i].r)*(lst_points[pt_idx].r-lst_centroids[i].r);
-            dist_to_centroid += (lst_points[pt_idx].g-lst_centroids[i].g)*(lst_points[pt_idx].g-lst_centroids[i].g);
-            dist_to_centroid += (lst_points[pt_idx].b-lst_centroids[i].b)*(lst_points[pt_idx].b-lst_centroids[i].b);
-
-            dist_to_centroid = sqrt(dist_to_centroid);
+            dist_to_centroid += (r-lst_centroids[c].r)*(r-lst_centroids[c].r);
+            dist_to_centroid += (g-lst_centroids[c].g)*(g-lst_centroids[c].g);
+            dist_to_centroid += (b-lst_centroids[c].b)*(b-lst_centroids[c].b);
 
             if(dist_to_centroid < min_dist_to_centroid)
             {
                 min_dist_to_centroid = dist_to_centroid;
-                selected_centroid = i;
+                selected_centroid = c;
             }
         }
 
-        avg_distance += min_dist_to_centroid/nb_points;
-        lst_points[pt_idx].cluster_id = selected_centroid;
+        histogram->bin_labels[bin_idx] = selected_centroid;
     }
+}
 
-    return avg_distance;
+//same update as calculate_new_centroids, the sums of the bins already hold the sums of their pixels
+//cluster_sizes receives the number of pixels of each centroid
+float kmeans_histogram_new_centroids(kmeans_histogram_t *histogram, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes){
+    histogram_bin_t totals[KMEANS_MAX_CLUSTERS];
+    float total_move = 0;
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        totals[i].nb_pixels = 0;
+        totals[i].total_r = 0;
+        totals[i].total_g = 0;
+        totals[i].total_b = 0;
+    }
+
+    for (size_t i = 0; i < histogram->nb_occupied; i++)
+    {
+        uint bin_idx = histogram->occupied[i];
+        histogram_bin_t *bin = &histogram->bins[bin_idx];
+        histogram_bin_t *total = &totals[histogram->bin_labels[bin_idx]];
+
+        total->nb_pixels += bin->nb_pixels;
+        total->total_r += bin->total_r;
+        total->total_g += bin->total_g;
+        total->total_b += bin->total_b;
+    }
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        uint nb_points_in_cluster = totals[i].nb_pixels;
+        cluster_sizes[i] = nb_points_in_cluster;
+        if(nb_points_in_cluster > 0)
+        {
+            float old_r = lst_centroids[i].r;
+            float old_g = lst_centroids[i].g;
+            float old_b = lst_centroids[i].b;
+            lst_centroids[i].r = (float)totals[i].total_r/(float)nb_points_in_cluster;
+            lst_centroids[i].g = (float)totals[i].total_g/(float)nb_points_in_cluster;
+            lst_centroids[i].b = (float)totals[i].total_b/(float)nb_points_in_cluster;
+
+            total_move += (old_r-lst_centroids[i].r)*(old_r-lst_centroids[i].r);
+            total_move += (old_g-lst_centroids[i].g)*(old_g-lst_centroids[i].g);
+            total_move += (old_b-lst_centroids[i].b)*(old_b-lst_centroids[i].b);
+        }
+    }
+
+    return total_move;
 }
 
-float assign_points_to_centroid_xy(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids){
+//one lookup per pixel in the labels of the bins
+void kmeans_histogram_labels(image_rgb_t *img, kmeans_histogram_t *histogram, uint8_t *labels){
+    uint nb_points = img->width*img->height;
+    for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
+    {
+        labels[pt_idx] = histogram->bin_labels[HIST_BIN(img->img[pt_idx*3], img->img[pt_idx*3+1], img->img[pt_idx*3+2])];
+    }
+}
+
+//stripe i of the rows of the image for thread i, the calling thread takes the first one
+//the threads are started when first needed and synchronised by semaphores, the results of a job are complete when it returns
+//with a single thread the job runs on the whole image without synchronisation
+void kmeans_run_job(kmeans_job_t *job){
+    uint height = job->img->height;
+    uint nb_threads = kmeans_nb_threads;
+    if(nb_threads < 1){
+        nb_threads = 1;
+    }
+    else if(nb_threads > KMEANS_NB_THREADS){
+        nb_threads = KMEANS_NB_THREADS;
+    }
+    job->nb_threads = nb_threads;
+
+    if(nb_threads == 1){
+        job->function(job, 0, 0, height);
+        return;
+    }
+
+    if(kmeans_threads_started == 1){
+        sem_init(&kmeans_threads_done, 0, 0);
+    }
+    for (size_t i = kmeans_threads_started; i < nb_threads; i++)
+    {
+        kmeans_threads[i].idx = i;
+        sem_init(&kmeans_threads[i].start, 0, 0);
+        pthread_create(&kmeans_threads[i].thread, NULL, kmeans_thread_loop, &kmeans_threads[i]);
+        kmeans_threads_started = i+1;
+    }
+
+    kmeans_cur_job = job;
+    for (size_t i = 1; i < nb_threads; i++)
+    {
+        sem_post(&kmeans_threads[i].start);
+    }
+
+    job->function(job, 0, 0, height/nb_threads);
+
+    for (size_t i = 1; i < nb_threads; i++)
+    {
+        sem_wait(&kmeans_threads_done);
+    }
+}
+
+void *kmeans_thread_loop(void *arg){
+    kmeans_thread_t *thread = arg;
+
+    while(1){
+        sem_wait(&thread->start);
+
+        kmeans_job_t *job = kmeans_cur_job;
+        uint height = job->img->height;
+        job->function(job, thread->idx, height*thread->idx/job->nb_threads, height*(thread->idx+1)/job->nb_threads);
+
+        sem_post(&kmeans_threads_done);
+    }
+
+    return NULL;
+}
+
+//returns the number of distances computed between a pixel and a centroid
+uint assign_labels(image_rgb_t *img, kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids){
+    kmeans_job_t job;
+    job.function = assign_labels_rows;
+    job.img = img;
+    job.buffers = buffers;
+    job.lst_centroids = lst_centroids;
+    job.nb_centroids = nb_centroids;
+
+#if KMEANS_BOUNDS
+    kmeans_bounds_moves_t moves;
+    kmeans_bounds_prepare(buffers, lst_centroids, nb_centroids, &moves);
+    job.moves = &moves;
+#endif
+
+    kmeans_run_job(&job);
+
+#if KMEANS_BOUNDS
+    //the bounds now hold for these centroids
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        buffers->bounds_centroids[i] = lst_centroids[i];
+    }
+    buffers->nb_bounds_centroids = nb_centroids;
+#endif
+
+    uint nb_distances = 0;
+    for (size_t i = 0; i < job.nb_threads; i++)
+    {
+        nb_distances += job.nb_distances[i];
+    }
+    return nb_distances;
+}
+
+void assign_labels_rows(kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end){
+#if KMEANS_BOUNDS
+    job->nb_distances[thread_idx] = assign_labels_bounds(job->img, job->buffers, job->lst_centroids, job->nb_centroids, job->moves, y_start, y_end);
+#else
+#if KMEANS_MODE == KMEANS_MODE_RGB
+    assign_points_to_centroid(job->img, job->buffers->labels, job->lst_centroids, job->nb_centroids, y_start, y_end);
+#else
+    assign_labels_xy(job->img, job->buffers->labels, job->lst_centroids, job->nb_centroids, job->buffers->pos_x, job->buffers->pos_y, y_start, y_end);
+#endif
+    job->nb_distances[thread_idx] = job->img->width*(y_end-y_start)*job->nb_centroids;
+#endif
+}
+
+//squared float distance, summed in the same order as assign_points_to_centroid and closest_centroid_xy_float
+//the position only counts in rgbxy mode
+float pixel_centroid_distance_sq(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *centroid){
+    float dist_to_centroid = 0;
+
+    dist_to_centroid += (r-centroid->r)*(r-centroid->r);
+    dist_to_centroid += (g-centroid->g)*(g-centroid->g);
+    dist_to_centroid += (b-centroid->b)*(b-centroid->b);
+#if KMEANS_MODE == KMEANS_MODE_RGBXY
+    dist_to_centroid += (x_norm-centroid->x)*(x_norm-centroid->x);
+    dist_to_centroid += (y_norm-centroid->y)*(y_norm-centroid->y);
+#endif
+
+    return dist_to_centroid;
+}
+
+//float distance with sqrt, as compared in assign_points_to_centroid and closest_centroid_xy_float
+float pixel_centroid_distance(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *centroid){
+    return sqrt(pixel_centroid_distance_sq(r, g, b, x_norm, y_norm, centroid));
+}
+
+float centroid_distance(centroid_t *centroid_a, centroid_t *centroid_b){
+    float dist = 0;
+
+    dist += (centroid_a->r-centroid_b->r)*(centroid_a->r-centroid_b->r);
+    dist += (centroid_a->g-centroid_b->g)*(centroid_a->g-centroid_b->g);
+    dist += (centroid_a->b-centroid_b->b)*(centroid_a->b-centroid_b->b);
+#if KMEANS_MODE == KMEANS_MODE_RGBXY
+    dist += (centroid_a->x-centroid_b->x)*(centroid_a->x-centroid_b->x);
+    dist += (centroid_a->y-centroid_b->y)*(centroid_a->y-centroid_b->y);
+#endif
+
+    return sqrt(dist);
+}
+
+//closest centroid with the distances to the closest and second closest centroids
+//compared without sqrt, which gives the same label unless the two closest have the same distance after the sqrt,
+//then the labels are decided with the sqrt as in the other versions (ties keep the first centroid)
+uint closest_centroid_bounds(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *lst_centroids, uint nb_centroids, float *best_dist, float *second_dist){
+    float min_dist_to_centroid = 10000000000; //safe max value
+    float second_min_dist = 10000000000;
+    uint selected_centroid = 0;
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        float dist_to_centroid = pixel_centroid_distance_sq(r, g, b, x_norm, y_norm, &lst_centroids[i]);
+
+        if(dist_to_centroid < min_dist_to_centroid)
+        {
+            second_min_dist = min_dist_to_centroid;
+            min_dist_to_centroid = dist_to_centroid;
+            selected_centroid = i;
+        }
+        else if(dist_to_centroid < second_min_dist)
+        {
+            second_min_dist = dist_to_centroid;
+        }
+    }
+
+    *best_dist = sqrt(min_dist_to_centroid);
+    *second_dist = sqrt(second_min_dist);
+
+    if(*best_dist == *second_dist){
+        for (size_t i = 0; i < nb_centroids; i++)
+        {
+            if(pixel_centroid_distance(r, g, b, x_norm, y_norm, &lst_centroids[i]) == *best_dist){
+                return i;
+            }
+        }
+    }
+
+    return selected_centroid;
+}
+
+//moves of the centroids since the bounds were computed, and their distances, for assign_labels_bounds
+void kmeans_bounds_prepare(kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids, kmeans_bounds_moves_t *moves){
+    const float fixed_scale = 1<<KMEANS_FIXED_BITS;
+
+    //how far each centroid moved since the bounds were computed, rounded up
+    moves->max_move = 0;
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        if(buffers->nb_bounds_centroids == nb_centroids){
+            //a centroid that didn't move doesn't loosen the bounds, they don't erode in a static scene
+            float move = centroid_distance(&lst_centroids[i], &buffers->bounds_centroids[i]);
+            moves->centroid_move[i] = move > 0 ? move*fixed_scale+2 : 0;
+        }
+        else{
+            //no valid bounds yet, the saturated bounds force the computation of all the distances
+            moves->centroid_move[i] = UINT16_MAX;
+        }
+
+        if(moves->centroid_move[i] > moves->max_move){
+            moves->max_move = moves->centroid_move[i];
+        }
+    }
+
+    //half the distance from each centroid to the closest other one, rounded down
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        float min_gap = 10000000000; //safe max value
+        for (size_t j = 0; j < nb_centroids; j++)
+        {
+            if(j != i){
+                float gap = centroid_distance(&lst_centroids[i], &lst_centroids[j]);
+                if(gap < min_gap){
+                    min_gap = gap;
+                }
+            }
+        }
+        float half = min_gap*0.5f*fixed_scale-1;
+        moves->half_gap[i] = half > 0 ? (half < UINT16_MAX ? half : UINT16_MAX) : 0;
+    }
+}
+
+//hamerly assignment, same labels as assign_points_to_centroid and assign_labels_xy
+//the bounds are in fixed point with KMEANS_FIXED_BITS, the upper bounds rounded up and the lower bounds rounded down
+//since the pixels change between frames, the bounds are kept for the colour of the pixel when they were last tightened,
+//and are loosened by the distance from that colour at the test (the noise of the camera doesn't accumulate in the bounds)
+//a pixel keeps its label when its upper bound is strictly below its lower bound or half the distance from its centroid to the closest other
+//centroid: its centroid is then strictly the closest, and the tie rule can't change the label
+//otherwise the distance to its centroid tightens the upper bound, and only if that isn't enough all the distances are computed
+//rows [y_start, y_end) of the image, the moves are computed before by kmeans_bounds_prepare
+//returns the number of distances computed
+uint assign_labels_bounds(image_rgb_t *img, kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids, kmeans_bounds_moves_t *moves, uint y_start, uint y_end){
+    uint width = img->width;
+    uint height = img->height;
+    const float fixed_scale = 1<<KMEANS_FIXED_BITS;
+    uint32_t *centroid_move = moves->centroid_move;
+    uint32_t max_move = moves->max_move;
+    uint32_t *half_gap = moves->half_gap;
+
+    uint nb_distances = 0;
+
+    for (size_t y = y_start; y < y_end; y++)
+    {
+        uint8_t *row = &img->img[y*width*3];
+        uint8_t *row_prev = &buffers->bounds_img[y*width*3];
+        uint8_t *row_labels = &buffers->labels[y*width];
+        uint16_t *row_upper = &buffers->upper_bounds[y*width];
+        uint16_t *row_lower = &buffers->lower_bounds[y*width];
+        float y_norm = (float)y/(float)height*255;
+
+        for (size_t x = 0; x < width; x++)
+        {
+            uint8_t r = row[x*3];
+            uint8_t g = row[x*3+1];
+            uint8_t b = row[x*3+2];
+
+            //the bounds are for the colour the pixel had when they were last tightened, so the noise doesn't accumulate
+            //the squared colour change is compared, its sqrt is only needed when the bounds are updated
+            int32_t diff_r = r-row_prev[x*3];
+            int32_t diff_g = g-row_prev[x*3+1];
+            int32_t diff_b = b-row_prev[x*3+2];
+            uint32_t pixel_move_sq = (diff_r*diff_r + diff_g*diff_g + diff_b*diff_b)<<(2*KMEANS_FIXED_BITS);
+
+            uint label = row_labels[x];
+            uint32_t upper = row_upper[x] + centroid_move[label];
+            uint32_t lower = row_lower[x] > max_move ? row_lower[x]-max_move : 0;
+
+            //the label can't change if upper+pixel_move < half_gap or upper+pixel_move < lower-pixel_move
+            uint keep_label = 0;
+            if(half_gap[label] > upper){
+                uint64_t gap = half_gap[label]-upper;
+                keep_label |= (uint64_t)pixel_move_sq < gap*gap;
+            }
+            if(lower > upper){
+                uint64_t gap = lower-upper;
+                keep_label |= (uint64_t)pixel_move_sq*4 < gap*gap;
+            }
+
+            if(!keep_label){
+                //the bounds now hold for the current colour
+                uint32_t pixel_move = sqrtf(pixel_move_sq)+1;
+                lower = lower > pixel_move ? lower-pixel_move : 0;
+                uint32_t bound = lower > half_gap[label] ? lower : half_gap[label];
+                row_prev[x*3] = r;
+                row_prev[x*3+1] = g;
+                row_prev[x*3+2] = b;
+
+                //tighten the upper bound with the distance to the current centroid
+                float x_norm = (float)x/(float)width*255;
+                upper = pixel_centroid_distance(r, g, b, x_norm, y_norm, &lst_centroids[label])*fixed_scale+2;
+                nb_distances++;
+
+                if(upper >= bound){
+                    float best_dist;
+                    float second_dist;
+                    label = closest_centroid_bounds(r, g, b, x_norm, y_norm, lst_centroids, nb_centroids, &best_dist, &second_dist);
+                    nb_distances += nb_centroids;
+
+                    row_labels[x] = label;
+                    upper = best_dist*fixed_scale+2;
+                    float second = second_dist*fixed_scale-1;
+                    lower = second > 0 ? (second < UINT16_MAX ? second : UINT16_MAX) : 0;
+                }
+            }
+
+            row_upper[x] = upper < UINT16_MAX ? upper : UINT16_MAX;
+            row_lower[x] = lower;
+        }
+    }
+
+    return nb_distances;
+}
+
+//rows [y_start, y_end) of the image
+float assign_points_to_centroid(image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids, uint y_start, uint y_end){
     float avg_distance = 0;
+    uint nb_points = img->width*img->height;
 
     //for each point, find closest centroid and assign point to it
-    for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
+    for (size_t pt_idx = y_start*img->width; pt_idx < y_end*img->width; pt_idx++)
     {
+        uint8_t r = img->img[pt_idx*3];
+        uint8_t g = img->img[pt_idx*3+1];
+        uint8_t b = img->img[pt_idx*3+2];
+
         float min_dist_to_centroid = 10000000000; //safe max value
         uint selected_centroid = 0;
 
@@ -295,11 +1064,9 @@ float assign_points_to_centroid_xy(cluster_point_t *lst_points, uint nb_points,
         {
             float dist_to_centroid = 0;
 
-            dist_to_centroid += (lst_points[pt_idx].r-lst_centroids[i].r)*(lst_points[pt_idx].r-lst_centroids[i].r);
-            dist_to_centroid += (lst_points[pt_idx].g-lst_centroids[i].g)*(lst_points[pt_idx].g-lst_centroids[i].g);
-            dist_to_centroid += (lst_points[pt_idx].b-lst_centroids[i].b)*(lst_points[pt_idx].b-lst_centroids[i].b);
-            dist_to_centroid += (lst_points[pt_idx].x_norm-lst_centroids[i].x)*(lst_points[pt_idx].x_norm-lst_centroids[i].x);
-            dist_to_centroid += (lst_points[pt_idx].y_norm-lst_centroids[i].y)*(lst_points[pt_idx].y_norm-lst_centroids[i].y);
+            dist_to_centroid += (r-lst_centroids[i].r)*(r-lst_centroids[i].r);
+            dist_to_centroid += (g-lst_centroids[i].g)*(g-lst_centroids[i].g);
+            dist_to_centroid += (b-lst_centroids[i].b)*(b-lst_centroids[i].b);
 
             dist_to_centroid = sqrt(dist_to_centroid);
 
@@ -309,148 +1076,997 @@ float assign_points_to_centroid_xy(cluster_point_t *lst_points, uint nb_points,
                 selected_centroid = i;
             }
         }
+
         avg_distance += min_dist_to_centroid/nb_points;
-        lst_points[pt_idx].cluster_id = selected_centroid;
+        labels[pt_idx] = selected_centroid;
     }
 
     return avg_distance;
 }
 
+//float distance between a pixel and the centroids (with the position normalised as x/width*255), with sqrt as in the rgb version
+//used for the pixels where the integer distances of assign_labels_xy are too close to decide
+uint closest_centroid_xy_float(uint8_t r, uint8_t g, uint8_t b, float x_norm, float y_norm, centroid_t *lst_centroids, uint nb_centroids){
+    float min_dist_to_centroid = 10000000000; //safe max value
+    uint selected_centroid = 0;
 
-float calculate_new_centroids(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids){
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        float dist_to_centroid = 0;
 
-    struct intermediate_centroid_t{
-        uint total_r;
-        uint total_g;
-        uint total_b;
-        uint nb_points_in_cluster;
-    };
+        dist_to_centroid += (r-lst_centroids[i].r)*(r-lst_centroids[i].r);
+        dist_to_centroid += (g-lst_centroids[i].g)*(g-lst_centroids[i].g);
+        dist_to_centroid += (b-lst_centroids[i].b)*(b-lst_centroids[i].b);
+        dist_to_centroid += (x_norm-lst_centroids[i].x)*(x_norm-lst_centroids[i].x);
+        dist_to_centroid += (y_norm-lst_centroids[i].y)*(y_norm-lst_centroids[i].y);
 
-    //keep accumulation values in a list for each centroid
-    struct intermediate_centroid_t *lst_intermediate_centroid = malloc(nb_centroids*sizeof(struct intermediate_centroid_t));
-    float total_move = 0;
+        dist_to_centroid = sqrt(dist_to_centroid);
 
+        if(dist_to_centroid < min_dist_to_centroid)
+        {
+            min_dist_to_centroid = dist_to_centroid;
+            selected_centroid = i;
+        }
+    }
+
+    return selected_centroid;
+}
+
+//same labels as closest_centroid_xy_float, with integer squared distances (no sqrt, the order is the same)
+//the pixels are read in the rgb image, pos_x and pos_y are the normalised positions of the columns and rows in fixed point
+//with neon, 8 pixels are deinterleaved and compared to each centroid at a time, the differences in int16 and the squares in int32
+//when the two closest centroids are within the rounding error of the fixed point, the float distances decide
+//rows [y_start, y_end) of the image
+void assign_labels_xy(image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids, uint16_t *pos_x, uint16_t *pos_y, uint y_start, uint y_end){
+    uint width = img->width;
+    uint height = img->height;
+
+    //centroids in the same fixed point as the pixels
+    int16_t cent_r[KMEANS_MAX_CLUSTERS];
+    int16_t cent_g[KMEANS_MAX_CLUSTERS];
+    int16_t cent_b[KMEANS_MAX_CLUSTERS];
+    int16_t cent_x[KMEANS_MAX_CLUSTERS];
+    int16_t cent_y[KMEANS_MAX_CLUSTERS];
     for (size_t i = 0; i < nb_centroids; i++)
     {
-        lst_intermediate_centroid[i].total_r = 0;
-        lst_intermediate_centroid[i].total_g = 0;
-        lst_intermediate_centroid[i].total_b = 0;
-        lst_intermediate_centroid[i].nb_points_in_cluster = 0;
+        cent_r[i] = lst_centroids[i].r*(1<<KMEANS_FIXED_BITS)+0.5f;
+        cent_g[i] = lst_centroids[i].g*(1<<KMEANS_FIXED_BITS)+0.5f;
+        cent_b[i] = lst_centroids[i].b*(1<<KMEANS_FIXED_BITS)+0.5f;
+        cent_x[i] = lst_centroids[i].x*(1<<KMEANS_FIXED_BITS)+0.5f;
+        cent_y[i] = lst_centroids[i].y*(1<<KMEANS_FIXED_BITS)+0.5f;
     }
 
+    for (size_t y = y_start; y < y_end; y++)
+    {
+        //the distance along y is the same for the whole row
+        int32_t dist_y[KMEANS_MAX_CLUSTERS];
+        for (size_t i = 0; i < nb_centroids; i++)
+        {
+            dist_y[i] = (pos_y[y]-cent_y[i])*(pos_y[y]-cent_y[i]);
+        }
+
+        uint8_t *row = &img->img[y*width*3];
+        uint8_t *row_labels = &labels[y*width];
+        float y_norm = (float)y/(float)height*255;
+
+        size_t x = 0;
+#ifdef __ARM_NEON
+        for (; x+8 <= width; x+=8)
+        {
+            uint8x8x3_t rgb = vld3_u8(&row[x*3]);
+            int16x8_t r = vreinterpretq_s16_u16(vshll_n_u8(rgb.val[0], KMEANS_FIXED_BITS));
+            int16x8_t g = vreinterpretq_s16_u16(vshll_n_u8(rgb.val[1], KMEANS_FIXED_BITS));
+            int16x8_t b = vreinterpretq_s16_u16(vshll_n_u8(rgb.val[2], KMEANS_FIXED_BITS));
+            int16x8_t px = vreinterpretq_s16_u16(vld1q_u16(&pos_x[x]));
+
+            uint32x4_t best_lo = vdupq_n_u32(UINT32_MAX);
+            uint32x4_t best_hi = vdupq_n_u32(UINT32_MAX);
+            uint32x4_t second_lo = vdupq_n_u32(UINT32_MAX);
+            uint32x4_t second_hi = vdupq_n_u32(UINT32_MAX);
+            uint32x4_t label_lo = vdupq_n_u32(0);
+            uint32x4_t label_hi = vdupq_n_u32(0);
+
+            for (size_t i = 0; i < nb_centroids; i++)
+            {
+                int16x8_t diff_r = vsubq_s16(r, vdupq_n_s16(cent_r[i]));
+                int16x8_t diff_g = vsubq_s16(g, vdupq_n_s16(cent_g[i]));
+                int16x8_t diff_b = vsubq_s16(b, vdupq_n_s16(cent_b[i]));
+                int16x8_t diff_x = vsubq_s16(px, vdupq_n_s16(cent_x[i]));
+
+                int32x4_t dist_lo = vdupq_n_s32(dist_y[i]);
+                int32x4_t dist_hi = dist_lo;
+                dist_lo = vmlal_s16(dist_lo, vget_low_s16(diff_r), vget_low_s16(diff_r));
+                dist_hi = vmlal_s16(dist_hi, vget_high_s16(diff_r), vget_high_s16(diff_r));
+                dist_lo = vmlal_s16(dist_lo, vget_low_s16(diff_g), vget_low_s16(diff_g));
+                dist_hi = vmlal_s16(dist_hi, vget_high_s16(diff_g), vget_high_s16(diff_g));
+                dist_lo = vmlal_s16(dist_lo, vget_low_s16(diff_b), vget_low_s16(diff_b));
+                dist_hi = vmlal_s16(dist_hi, vget_high_s16(diff_b), vget_high_s16(diff_b));
+                dist_lo = vmlal_s16(dist_lo, vget_low_s16(diff_x), vget_low_s16(diff_x));
+                dist_hi = vmlal_s16(dist_hi, vget_high_s16(diff_x), vget_high_s16(diff_x));
+
+                //strictly smaller, so ties keep the first centroid
+                uint32x4_t udist_lo = vreinterpretq_u32_s32(dist_lo);
+                uint32x4_t udist_hi = vreinterpretq_u32_s32(dist_hi);
+                uint32x4_t closer_lo = vcltq_u32(udist_lo, best_lo);
+                uint32x4_t closer_hi = vcltq_u32(udist_hi, best_hi);
+                second_lo = vbslq_u32(closer_lo, best_lo, vminq_u32(second_lo, udist_lo));
+                second_hi = vbslq_u32(closer_hi, best_hi, vminq_u32(second_hi, udist_hi));
+                best_lo = vbslq_u32(closer_lo, udist_lo, best_lo);
+                best_hi = vbslq_u32(closer_hi, udist_hi, best_hi);
+                label_lo = vbslq_u32(closer_lo, vdupq_n_u32(i), label_lo);
+                label_hi = vbslq_u32(closer_hi, vdupq_n_u32(i), label_hi);
+            }
+
+            uint16x8_t label = vcombine_u16(vmovn_u32(label_lo), vmovn_u32(label_hi));
+            vst1_u8(&row_labels[x], vmovn_u16(label));
+
+            //pixels whose two closest centroids are too close to be decided in fixed point
+            uint32x4_t margin = vdupq_n_u32(KMEANS_TIE_MARGIN);
+            uint16x8_t undecided = vcombine_u16(vmovn_u32(vcltq_u32(vsubq_u32(second_lo, best_lo), margin)), vmovn_u32(vcltq_u32(vsubq_u32(second_hi, best_hi), margin)));
+            uint8x8_t undecided_8 = vmovn_u16(undecided);
+            if(vget_lane_u64(vreinterpret_u64_u8(undecided_8), 0) != 0){
+                uint8_t lanes[8];
+                vst1_u8(lanes, undecided_8);
+                for (size_t l = 0; l < 8; l++)
+                {
+                    if(lanes[l]){
+                        row_labels[x+l] = closest_centroid_xy_float(row[(x+l)*3], row[(x+l)*3+1], row[(x+l)*3+2], (float)(x+l)/(float)width*255, y_norm, lst_centroids, nb_centroids);
+                    }
+                }
+            }
+        }
+#endif
+        for (; x < width; x++)
+        {
+            int32_t r = row[x*3]<<KMEANS_FIXED_BITS;
+            int32_t g = row[x*3+1]<<KMEANS_FIXED_BITS;
+            int32_t b = row[x*3+2]<<KMEANS_FIXED_BITS;
+            int32_t px = pos_x[x];
+
+            uint32_t min_dist_to_centroid = UINT32_MAX;
+            uint32_t second_dist = UINT32_MAX;
+            uint selected_centroid = 0;
+
+            for (size_t i = 0; i < nb_centroids; i++)
+            {
+                uint32_t dist_to_centroid = dist_y[i];
+                dist_to_centroid += (r-cent_r[i])*(r-cent_r[i]);
+                dist_to_centroid += (g-cent_g[i])*(g-cent_g[i]);
+                dist_to_centroid += (b-cent_b[i])*(b-cent_b[i]);
+                dist_to_centroid += (px-cent_x[i])*(px-cent_x[i]);
+
+                if(dist_to_centroid < min_dist_to_centroid)
+                {
+                    second_dist = min_dist_to_centroid;
+                    min_dist_to_centroid = dist_to_centroid;
+                    selected_centroid = i;
+                }
+                else if(dist_to_centroid < second_dist)
+                {
+                    second_dist = dist_to_centroid;
+                }
+            }
+
+            if(second_dist-min_dist_to_centroid < KMEANS_TIE_MARGIN){
+                selected_centroid = closest_centroid_xy_float(row[x*3], row[x*3+1], row[x*3+2], (float)x/(float)width*255, y_norm, lst_centroids, nb_centroids);
+            }
+
+            row_labels[x] = selected_centroid;
+        }
+    }
+}
+
+//sums of the pixels of each centroid in the rows [y_start, y_end), accumulated in the sums of the thread
+void accumulate_centroid_sums(kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end){
+    image_rgb_t *img = job->img;
+    uint8_t *labels = job->buffers->labels;
+
+    //local sums, the threads don't write in the same cache lines
+    centroid_sums_t lst_sums[KMEANS_MAX_CLUSTERS];
+    for (size_t i = 0; i < job->nb_centroids; i++)
+    {
+        lst_sums[i].total_r = 0;
+        lst_sums[i].total_g = 0;
+        lst_sums[i].total_b = 0;
+        lst_sums[i].total_x = 0;
+        lst_sums[i].total_y = 0;
+        lst_sums[i].nb_points_in_cluster = 0;
+    }
 
     //for each point, add their value in their respective centroid
-    for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
+    for (size_t y = y_start; y < y_end; y++)
+    {
+        uint pt_idx = y*img->width;
+        for (size_t x = 0; x < img->width; x++)
+        {
+            centroid_sums_t *sums = &lst_sums[labels[pt_idx]];
+
+            sums->total_r += img->img[pt_idx*3];
+            sums->total_g += img->img[pt_idx*3+1];
+            sums->total_b += img->img[pt_idx*3+2];
+#if KMEANS_MODE == KMEANS_MODE_RGBXY
+            sums->total_x += x;
+            sums->total_y += y;
+#endif
+            sums->nb_points_in_cluster++;
+
+            pt_idx++;
+        }
+    }
+
+    for (size_t i = 0; i < job->nb_centroids; i++)
     {
-        uint centroid_idx = lst_points[pt_idx].cluster_id;
+        job->sums[thread_idx][i] = lst_sums[i];
+    }
+}
+
+//sums of the pixels of each centroid over the image, computed by the threads
+//the sums of the threads are merged in the order of the stripes (integers, the result doesn't depend on the threads)
+void sum_centroids(image_rgb_t *img, uint8_t *labels, uint nb_centroids, centroid_sums_t *lst_sums){
+    kmeans_buffers_t buffers;
+    buffers.labels = labels;
+
+    kmeans_job_t job;
+    job.function = accumulate_centroid_sums;
+    job.img = img;
+    job.buffers = &buffers;
+    job.nb_centroids = nb_centroids;
 
-        lst_intermediate_centroid[centroid_idx].total_r += lst_points[pt_idx].r;
-        lst_intermediate_centroid[centroid_idx].total_g += lst_points[pt_idx].g;
-        lst_intermediate_centroid[centroid_idx].total_b += lst_points[pt_idx].b;
-        lst_intermediate_centroid[centroid_idx].nb_points_in_cluster++;
+    kmeans_run_job(&job);
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        lst_sums[i] = job.sums[0][i];
+        for (size_t t = 1; t < job.nb_threads; t++)
+        {
+            lst_sums[i].total_r += job.sums[t][i].total_r;
+            lst_sums[i].total_g += job.sums[t][i].total_g;
+            lst_sums[i].total_b += job.sums[t][i].total_b;
+            lst_sums[i].total_x += job.sums[t][i].total_x;
+            lst_sums[i].total_y += job.sums[t][i].total_y;
+            lst_sums[i].nb_points_in_cluster += job.sums[t][i].nb_points_in_cluster;
+        }
     }
+}
+
+//cluster_sizes receives the number of pixels of each centroid
+//returns the sum of the squared moves of the centroids
+float calculate_new_centroids(image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes){
+    centroid_sums_t lst_sums[KMEANS_MAX_CLUSTERS];
+    sum_centroids(img, labels, nb_centroids, lst_sums);
+
+    return centroids_from_sums(img, lst_sums, lst_centroids, nb_centroids, cluster_sizes);
+}
+
+//each centroid with pixels becomes their mean, returns the sum of the squared moves of the centroids
+float centroids_from_sums(image_rgb_t *img, centroid_sums_t *lst_sums, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes){
+    float total_move = 0;
 
     //for each centroid, update their value by calculating the mean
     for (size_t i = 0; i < nb_centroids; i++)
     {
-        uint nb_points_in_cluster = lst_intermediate_centroid[i].nb_points_in_cluster;
+        centroid_sums_t sums = lst_sums[i];
+
+        uint nb_points_in_cluster = sums.nb_points_in_cluster;
+        cluster_sizes[i] = nb_points_in_cluster;
         if(nb_points_in_cluster > 0)
         {
             float old_r = lst_centroids[i].r;
             float old_g = lst_centroids[i].g;
             float old_b = lst_centroids[i].b;
-            lst_centroids[i].r = (float)lst_intermediate_centroid[i].total_r/(float)nb_points_in_cluster;
-            lst_centroids[i].g = (float)lst_intermediate_centroid[i].total_g/(float)nb_points_in_cluster;
-            lst_centroids[i].b = (float)lst_intermediate_centroid[i].total_b/(float)nb_points_in_cluster;
+            lst_centroids[i].r = (float)sums.total_r/(float)nb_points_in_cluster;
+            lst_centroids[i].g = (float)sums.total_g/(float)nb_points_in_cluster;
+            lst_centroids[i].b = (float)sums.total_b/(float)nb_points_in_cluster;
 
             total_move += (old_r-lst_centroids[i].r)*(old_r-lst_centroids[i].r);
             total_move += (old_g-lst_centroids[i].g)*(old_g-lst_centroids[i].g);
             total_move += (old_b-lst_centroids[i].b)*(old_b-lst_centroids[i].b);
+
+#if KMEANS_MODE == KMEANS_MODE_RGBXY
+            float old_x = lst_centroids[i].x;
+            float old_y = lst_centroids[i].y;
+            //normalise the positions in a similar way to the colours
+            lst_centroids[i].x = (float)sums.total_x/(float)nb_points_in_cluster/(float)img->width*255;
+            lst_centroids[i].y = (float)sums.total_y/(float)nb_points_in_cluster/(float)img->height*255;
+
+            total_move += (old_x-lst_centroids[i].x)*(old_x-lst_centroids[i].x);
+            total_move += (old_y-lst_centroids[i].y)*(old_y-lst_centroids[i].y);
+#endif
         }
     }
 
-    free(lst_intermediate_centroid);
-
     return total_move;
 }
 
-float calculate_new_centroids_xy(cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids){
+//after a full update, the sums of the centroids, the frame and the centroids they were computed for
+void kmeans_incremental_reset(kmeans_incremental_t *incremental, image_rgb_t *img, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids){
+    memcpy(incremental->prev_img, img->img, img->width*img->height*3);
+    sum_centroids(img, labels, nb_centroids, incremental->sums);
+    memcpy(incremental->centroids, lst_centroids, nb_centroids*sizeof(centroid_t));
+    incremental->nb_frames = 0;
+}
+
+//largest move of a centroid since the last full update
+float kmeans_incremental_drift(kmeans_incremental_t *incremental, centroid_t *lst_centroids, uint nb_centroids){
+    float max_drift = 0;
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        float drift = centroid_distance(&lst_centroids[i], &incremental->centroids[i]);
+        if(drift > max_drift){
+            max_drift = drift;
+        }
+    }
+    return max_drift;
+}
+
+//assigns again the pixels whose colour changed by more than KMEANS_CHANGE_TOLERANCE on a channel since they were last assigned
+//the rows are split between the threads, each one keeps the changes of the sums of its stripe, added to the sums in the order of the stripes
+//(integers, the result doesn't depend on the threads)
+//returns the number of pixels assigned again
+uint kmeans_incremental_update(image_rgb_t *img, kmeans_incremental_t *incremental, kmeans_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids){
+    kmeans_job_t job;
+    job.function = kmeans_incremental_rows;
+    job.img = img;
+    job.buffers = buffers;
+    job.lst_centroids = lst_centroids;
+    job.nb_centroids = nb_centroids;
+    job.incremental = incremental;
+
+#if KMEANS_BOUNDS && !KMEANS_USE_HISTOGRAM
+    kmeans_bounds_moves_t moves;
+    kmeans_bounds_prepare(buffers, lst_centroids, nb_centroids, &moves);
+    job.moves = &moves;
+#endif
+
+    kmeans_run_job(&job);
+
+    uint nb_changed = 0;
+    for (size_t t = 0; t < job.nb_threads; t++)
+    {
+        nb_changed += job.nb_distances[t];
+        for (size_t i = 0; i < nb_centroids; i++)
+        {
+            //the changes wrap around like the sums, their total is exact
+            centroid_sums_t *sums = &incremental->sums[i];
+            sums->total_r += job.sums[t][i].total_r;
+            sums->total_g += job.sums[t][i].total_g;
+            sums->total_b += job.sums[t][i].total_b;
+            sums->total_x += job.sums[t][i].total_x;
+            sums->total_y += job.sums[t][i].total_y;
+            sums->nb_points_in_cluster += job.sums[t][i].nb_points_in_cluster;
+        }
+    }
 
-    struct intermediate_centroid_t{
-        uint total_r;
-        uint total_g;
-        uint total_b;
-        float total_x;
-        float total_y;
-        uint nb_points_in_cluster;
-    };
+    return nb_changed;
+}
 
-    //keep accumulation values in a list for each centroid
-    struct intermediate_centroid_t *lst_intermediate_centroid = malloc(nb_centroids*sizeof(struct intermediate_centroid_t));
-    float total_move = 0;
+//rows [y_start, y_end) of the incremental update
+//with neon, blocks of 16 pixels are compared at once and skipped when none changed
+//the pixel is moved from the sums of its old centroid to the sums of its new one, with its new colour
+//with KMEANS_BOUNDS, its bounds are written for its new colour and for the centroids the bounds of the other pixels
+//were computed for (those of the last full update), loosened by the moves of the centroids since
+void kmeans_incremental_rows(kmeans_job_t *job, uint thread_idx, uint y_start, uint y_end){
+    image_rgb_t *img = job->img;
+    kmeans_buffers_t *buffers = job->buffers;
+    centroid_t *lst_centroids = job->lst_centroids;
+    uint nb_centroids = job->nb_centroids;
+    uint width = img->width;
+    uint height = img->height;
+    uint8_t *labels = buffers->labels;
+    uint8_t *prev_img = job->incremental->prev_img;
+    uint nb_changed = 0;
+
+#if KMEANS_BOUNDS && !KMEANS_USE_HISTOGRAM
+    const float fixed_scale = 1<<KMEANS_FIXED_BITS;
+    kmeans_bounds_moves_t *moves = job->moves;
+#endif
+
+    //local changes of the sums, the threads don't write in the same cache lines
+    centroid_sums_t lst_sums[KMEANS_MAX_CLUSTERS];
+    memset(lst_sums, 0, nb_centroids*sizeof(centroid_sums_t));
+
+    for (size_t y = y_start; y < y_end; y++)
+    {
+        uint8_t *row = &img->img[y*width*3];
+        uint8_t *prev_row = &prev_img[y*width*3];
+        uint8_t *row_labels = &labels[y*width];
+        float y_norm = (float)y/(float)height*255;
+
+        for (size_t x = 0; x < width; x+=16)
+        {
+            uint block_end = x+16 < width ? x+16 : width;
+
+#ifdef __ARM_NEON
+            if(block_end == x+16){
+                uint8x16_t diff_0 = vabdq_u8(vld1q_u8(&row[x*3]), vld1q_u8(&prev_row[x*3]));
+                uint8x16_t diff_1 = vabdq_u8(vld1q_u8(&row[x*3+16]), vld1q_u8(&prev_row[x*3+16]));
+                uint8x16_t diff_2 = vabdq_u8(vld1q_u8(&row[x*3+32]), vld1q_u8(&prev_row[x*3+32]));
+                uint8x16_t max_diff = vmaxq_u8(vmaxq_u8(diff_0, diff_1), diff_2);
+                uint64x2_t changed = vreinterpretq_u64_u8(vcgtq_u8(max_diff, vdupq_n_u8(KMEANS_CHANGE_TOLERANCE)));
+                if((vgetq_lane_u64(changed, 0) | vgetq_lane_u64(changed, 1)) == 0){
+                    continue;
+                }
+            }
+#endif
+
+            for (size_t k = x; k < block_end; k++)
+            {
+                uint8_t *pixel = &row[k*3];
+                uint8_t *prev = &prev_row[k*3];
+                if(abs(pixel[0]-prev[0]) <= KMEANS_CHANGE_TOLERANCE && abs(pixel[1]-prev[1]) <= KMEANS_CHANGE_TOLERANCE && abs(pixel[2]-prev[2]) <= KMEANS_CHANGE_TOLERANCE){
+                    continue;
+                }
+
+                centroid_sums_t *sums = &lst_sums[row_labels[k]];
+                sums->total_r -= prev[0];
+                sums->total_g -= prev[1];
+                sums->total_b -= prev[2];
+#if KMEANS_MODE == KMEANS_MODE_RGBXY
+                sums->total_x -= k;
+                sums->total_y -= y;
+#endif
+                sums->nb_points_in_cluster--;
+
+                float best_dist;
+                float second_dist;
+                uint label = closest_centroid_bounds(pixel[0], pixel[1], pixel[2], (float)k/(float)width*255, y_norm, lst_centroids, nb_centroids, &best_dist, &second_dist);
+
+                sums = &lst_sums[label];
+                sums->total_r += pixel[0];
+                sums->total_g += pixel[1];
+                sums->total_b += pixel[2];
+#if KMEANS_MODE == KMEANS_MODE_RGBXY
+                sums->total_x += k;
+                sums->total_y += y;
+#endif
+                sums->nb_points_in_cluster++;
+
+                row_labels[k] = label;
+                prev[0] = pixel[0];
+                prev[1] = pixel[1];
+                prev[2] = pixel[2];
+                nb_changed++;
+
+#if KMEANS_BOUNDS && !KMEANS_USE_HISTOGRAM
+                //distance to the old centroid at most the current one plus its move, to the others at least minus the largest move
+                uint idx = y*width+k;
+                uint32_t upper = best_dist*fixed_scale+2+moves->centroid_move[label];
+                float lower = second_dist*fixed_scale-1-(float)moves->max_move;
+                buffers->upper_bounds[idx] = upper < UINT16_MAX ? upper : UINT16_MAX;
+                buffers->lower_bounds[idx] = lower > 0 ? (lower < UINT16_MAX ? lower : UINT16_MAX) : 0;
+                buffers->bounds_img[idx*3] = pixel[0];
+                buffers->bounds_img[idx*3+1] = pixel[1];
+                buffers->bounds_img[idx*3+2] = pixel[2];
+#endif
+            }
+        }
+    }
 
     for (size_t i = 0; i < nb_centroids; i++)
     {
-        lst_intermediate_centroid[i].total_r = 0;
-        lst_intermediate_centroid[i].total_g = 0;
-        lst_intermediate_centroid[i].total_b = 0;
-        lst_intermediate_centroid[i].total_x = 0;
-        lst_intermediate_centroid[i].total_y = 0;
-        lst_intermediate_centroid[i].nb_points_in_cluster = 0;
+        job->sums[thread_idx][i] = lst_sums[i];
     }
+    job->nb_distances[thread_idx] = nb_changed;
+}
+
+void centroid_from_pixel(image_rgb_t *img, uint x, uint y, centroid_t *centroid){
+    uint8_t *pixel = &img->img[(y*img->width+x)*3];
+    centroid->r = pixel[0];
+    centroid->g = pixel[1];
+    centroid->b = pixel[2];
+    centroid->x = (float)x/(float)img->width*255;
+    centroid->y = (float)y/(float)img->height*255;
+}
+
+//k-means++: the first centroid is a random pixel of the sample, each next one is a pixel of the sample
+//drawn with a probability proportional to its squared distance to the closest centroid already chosen
+void kmeans_seed_plus_plus(image_rgb_t *img, centroid_t *lst_centroids, uint nb_centroids, uint32_t *seed){
+    uint sample_width = img->width/KMEANS_SEED_STEP;
+    uint sample_height = img->height/KMEANS_SEED_STEP;
+    uint nb_samples = sample_width*sample_height;
+    float *min_dist_sq = malloc(nb_samples*sizeof(float));
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        uint chosen = 0;
+        *seed = *seed*1664525+1013904223;
+
+        if(i == 0){
+            chosen = (*seed>>8)%nb_samples;
+        }
+        else{
+            double total = 0;
+            for (size_t k = 0; k < nb_samples; k++)
+            {
+                total += min_dist_sq[k];
+            }
+
+            //all the pixels of the sample are on a centroid (flat image), any of them
+            double target = (*seed>>8)/(double)(1<<24)*total;
+            chosen = (*seed>>8)%nb_samples;
+            if(total > 0){
+                double cumul = 0;
+                for (size_t k = 0; k < nb_samples; k++)
+                {
+                    cumul += min_dist_sq[k];
+                    if(cumul > target){
+                        chosen = k;
+                        break;
+                    }
+                }
+            }
+        }
+
+        centroid_from_pixel(img, chosen%sample_width*KMEANS_SEED_STEP, chosen/sample_width*KMEANS_SEED_STEP, &lst_centroids[i]);
+        lst_centroids[i].cluster_id = i;
+
+        for (size_t k = 0; k < nb_samples; k++)
+        {
+            uint x = k%sample_width*KMEANS_SEED_STEP;
+            uint y = k/sample_width*KMEANS_SEED_STEP;
+            uint8_t *pixel = &img->img[(y*img->width+x)*3];
+            float dist_sq = pixel_centroid_distance_sq(pixel[0], pixel[1], pixel[2], (float)x/(float)img->width*255, (float)y/(float)img->height*255, &lst_centroids[i]);
+            if(i == 0 || dist_sq < min_dist_sq[k]){
+                min_dist_sq[k] = dist_sq;
+            }
+        }
+    }
+
+    free(min_dist_sq);
+}
+
+//mean distance of the pixels of the sample to their closest centroid
+float kmeans_sample_error(image_rgb_t *img, centroid_t *lst_centroids, uint nb_centroids){
+    float total = 0;
+    uint nb_samples = 0;
+
+    for (size_t y = 0; y+KMEANS_SEED_STEP <= img->height; y+=KMEANS_SEED_STEP)
+    {
+        for (size_t x = 0; x+KMEANS_SEED_STEP <= img->width; x+=KMEANS_SEED_STEP)
+        {
+            uint8_t *pixel = &img->img[(y*img->width+x)*3];
+            float best_dist;
+            float second_dist;
+            closest_centroid_bounds(pixel[0], pixel[1], pixel[2], (float)x/(float)img->width*255, (float)y/(float)img->height*255, lst_centroids, nb_centroids, &best_dist, &second_dist);
+            total += best_dist;
+            nb_samples++;
+        }
+    }
+
+    return total/nb_samples;
+}
+
+//the centroids without pixels, or closer than KMEANS_COLLAPSE_DISTANCE to a previous centroid, are moved to the pixel
+//of the sample the farthest from its closest valid centroid (deterministic, the farthest point of k-means++)
+//unless all the pixels of the sample are already close to a centroid
+//returns the number of centroids re-seeded
+uint kmeans_reseed_degenerate(image_rgb_t *img, centroid_t *lst_centroids, uint nb_centroids, uint *cluster_sizes){
+    uint8_t degenerate[KMEANS_MAX_CLUSTERS];
+    uint nb_degenerate = 0;
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        degenerate[i] = cluster_sizes[i] == 0;
+        for (size_t j = 0; j < i && !degenerate[i]; j++)
+        {
+            degenerate[i] = !degenerate[j] && centroid_distance(&lst_centroids[i], &lst_centroids[j]) < KMEANS_COLLAPSE_DISTANCE;
+        }
+        nb_degenerate += degenerate[i];
+    }
+
+    if(nb_degenerate == 0 || nb_degenerate == nb_centroids){
+        return 0;
+    }
+
+    uint sample_width = img->width/KMEANS_SEED_STEP;
+    uint sample_height = img->height/KMEANS_SEED_STEP;
+    uint nb_samples = sample_width*sample_height;
+    float *min_dist_sq = malloc(nb_samples*sizeof(float));
+
+    for (size_t k = 0; k < nb_samples; k++)
+    {
+        uint x = k%sample_width*KMEANS_SEED_STEP;
+        uint y = k/sample_width*KMEANS_SEED_STEP;
+        uint8_t *pixel = &img->img[(y*img->width+x)*3];
+        min_dist_sq[k] = 10000000000; //safe max value
+        for (size_t i = 0; i < nb_centroids; i++)
+        {
+            if(!degenerate[i]){
+                float dist_sq = pixel_centroid_distance_sq(pixel[0], pixel[1], pixel[2], (float)x/(float)img->width*255, (float)y/(float)img->height*255, &lst_centroids[i]);
+                if(dist_sq < min_dist_sq[k]){
+                    min_dist_sq[k] = dist_sq;
+                }
+            }
+        }
+    }
+
+    uint nb_reseeded = 0;
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        if(!degenerate[i]){
+            continue;
+        }
+
+        uint farthest = 0;
+        for (size_t k = 1; k < nb_samples; k++)
+        {
+            if(min_dist_sq[k] > min_dist_sq[farthest]){
+                farthest = k;
+            }
+        }
+
+        //every pixel of the sample is already close to a centroid (few colours in the image), it would collapse again
+        if(min_dist_sq[farthest] < KMEANS_COLLAPSE_DISTANCE*KMEANS_COLLAPSE_DISTANCE){
+            break;
+        }
+        nb_reseeded++;
+
+        uint x = farthest%sample_width*KMEANS_SEED_STEP;
+        uint y = farthest/sample_width*KMEANS_SEED_STEP;
+        centroid_from_pixel(img, x, y, &lst_centroids[i]);
+
+        //the next re-seeded centroids go away from this one
+        for (size_t k = 0; k < nb_samples; k++)
+        {
+            uint8_t *pixel = &img->img[(k/sample_width*KMEANS_SEED_STEP*img->width+k%sample_width*KMEANS_SEED_STEP)*3];
+            float dist_sq = pixel_centroid_distance_sq(pixel[0], pixel[1], pixel[2], (float)(k%sample_width*KMEANS_SEED_STEP)/(float)img->width*255, (float)(k/sample_width*KMEANS_SEED_STEP)/(float)img->height*255, &lst_centroids[i]);
+            if(dist_sq < min_dist_sq[k]){
+                min_dist_sq[k] = dist_sq;
+            }
+        }
+    }
+
+    free(min_dist_sq);
+    return nb_reseeded;
+}
+
+void draw_rgb_clusters(image_rgb_t *img_draw, uint8_t *labels, centroid_t *lst_centroids, uint nb_centroids){
+    //colour of each centroid, computed once
+    uint8_t colours[KMEANS_MAX_CLUSTERS*3];
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        colours[i*3] = lst_centroids[i].r;
+        colours[i*3+1] = lst_centroids[i].g;
+        colours[i*3+2] = lst_centroids[i].b;
+    }
+
+    //each pixel takes the rgb value of its centroid
+    for (size_t pt_idx = 0; pt_idx < img_draw->width*img_draw->height; pt_idx++)
+    {
+        uint8_t *colour = &colours[labels[pt_idx]*3];
+        img_draw->img[pt_idx*3] = colour[0];
+        img_draw->img[pt_idx*3+1] = colour[1];
+        img_draw->img[pt_idx*3+2] = colour[2];
+    }
+}
+
+//superpixels with the centroids kept between frames, seeded on a grid for the first frame
+//img_out must already hold width*height rgb pixels, each segment is drawn with its mean colour
+//returns the segment plane, valid until the next call
+uint16_t *slic_superpixels(image_rgb_t *img_in, image_rgb_t *img_out, uint nb_cycles){
+    static centroid_t *lst_centroids = NULL;
+    static uint nb_centroids;
+    static slic_buffers_t buffers;
+
+    if(lst_centroids == NULL){
+        slic_buffers_init(&buffers, img_in->width, img_in->height, SLIC_NB_SUPERPIXELS);
+        //the grid has at most (width/step+1)*(height/step+1) cells
+        lst_centroids = malloc((img_in->width/buffers.step+1)*(img_in->height/buffers.step+1)*sizeof(centroid_t));
+        nb_centroids = slic_seed_centroids(img_in, buffers.step, lst_centroids);
+    }
+
+    for (size_t i = 0; i < nb_cycles; i++)
+    {
+        slic_assign_labels(img_in, &buffers, lst_centroids, nb_centroids);
+
+        //if move not significant, stop
+        if(slic_new_centroids(img_in, &buffers, lst_centroids, nb_centroids) < 1.0f){
+            break;
+        }
+    }
+
+    slic_enforce_connectivity(img_in, &buffers);
+    draw_slic_segments(img_in, img_out, &buffers);
+
+    return buffers.segments;
+}
+
+void slic_buffers_init(slic_buffers_t *buffers, uint width, uint height, uint nb_superpixels){
+    uint nb_points = width*height;
+
+    buffers->step = sqrtf((float)nb_points/nb_superpixels)+0.5f;
+    buffers->labels = calloc(nb_points, sizeof(uint16_t));
+    buffers->distances = malloc(nb_points*sizeof(float));
+    buffers->segments = malloc(nb_points*sizeof(uint16_t));
+    buffers->nb_segments = 0;
+    buffers->queue = malloc(nb_points*sizeof(uint32_t));
+
+    //every segment kept by the connectivity pass is bigger than the minimum size, except the first one
+    buffers->max_segments = nb_points/(buffers->step*buffers->step/SLIC_MIN_SIZE_DIVISOR)+1;
+    uint nb_sums = (width/buffers->step+1)*(height/buffers->step+1);
+    if(nb_sums < buffers->max_segments){
+        nb_sums = buffers->max_segments;
+    }
+    buffers->sums = malloc(nb_sums*sizeof(centroid_sums_t));
+}
+
+//one centroid at the centre of each cell of the grid, moved to the lowest gradient of its 3x3 neighbourhood
+//so that it doesn't start on an edge, returns the number of centroids
+uint slic_seed_centroids(image_rgb_t *img, uint step, centroid_t *lst_centroids){
+    uint width = img->width;
+    uint height = img->height;
+    uint nb_centroids = 0;
+
+    for (size_t cell_y = step/2; cell_y < height; cell_y+=step)
+    {
+        for (size_t cell_x = step/2; cell_x < width; cell_x+=step)
+        {
+            uint best_x = cell_x;
+            uint best_y = cell_y;
+            uint min_gradient = UINT32_MAX;
+
+            for (int y = (int)cell_y-1; y <= (int)cell_y+1; y++)
+            {
+                for (int x = (int)cell_x-1; x <= (int)cell_x+1; x++)
+                {
+                    if(x < 1 || y < 1 || x >= (int)width-1 || y >= (int)height-1){
+                        continue;
+                    }
+
+                    uint gradient = 0;
+                    for (size_t c = 0; c < 3; c++)
+                    {
+                        int diff_x = img->img[(y*width+x+1)*3+c] - img->img[(y*width+x-1)*3+c];
+                        int diff_y = img->img[((y+1)*width+x)*3+c] - img->img[((y-1)*width+x)*3+c];
+                        gradient += diff_x*diff_x + diff_y*diff_y;
+                    }
+
+                    if(gradient < min_gradient){
+                        min_gradient = gradient;
+                        best_x = x;
+                        best_y = y;
+                    }
+                }
+            }
+
+            centroid_t *centroid = &lst_centroids[nb_centroids];
+            uint8_t *pixel = &img->img[(best_y*width+best_x)*3];
+            centroid->r = pixel[0];
+            centroid->g = pixel[1];
+            centroid->b = pixel[2];
+            //same normalisation as the rgbxy k-means
+            centroid->x = (float)best_x/(float)width*255;
+            centroid->y = (float)best_y/(float)height*255;
+            centroid->cluster_id = nb_centroids;
+            nb_centroids++;
+        }
+    }
+
+    return nb_centroids;
+}
+
+//each centroid is compared to the pixels of the 2S window around it, each pixel keeps the closest centroid
+//the spatial distance is in pixels, so the superpixels are square whatever the aspect ratio of the image
+void slic_assign_labels(image_rgb_t *img, slic_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids){
+    uint width = img->width;
+    uint height = img->height;
+    uint nb_points = width*height;
+    int step = buffers->step;
+
+    //(compactness/S)^2, weight of the squared distance in pixels
+    float spatial_weight = SLIC_COMPACTNESS*SLIC_COMPACTNESS/(float)(step*step);
 
-    //for each point, add their value in their respective centroid
     for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
     {
-        uint centroid_idx = lst_points[pt_idx].cluster_id;
+        buffers->distances[pt_idx] = 10000000000; //safe max value
+    }
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        centroid_t *centroid = &lst_centroids[i];
+        float centre_x = centroid->x*width/255.0f;
+        float centre_y = centroid->y*height/255.0f;
+
+        int x_start = centre_x-step < 0 ? 0 : centre_x-step;
+        int x_end = centre_x+step+1 > width ? width : centre_x+step+1;
+        int y_start = centre_y-step < 0 ? 0 : centre_y-step;
+        int y_end = centre_y+step+1 > height ? height : centre_y+step+1;
+
+        for (int y = y_start; y < y_end; y++)
+        {
+            float dist_y = (y-centre_y)*(y-centre_y)*spatial_weight;
+            uint8_t *row = &img->img[y*width*3];
+            float *row_distances = &buffers->distances[y*width];
+            uint16_t *row_labels = &buffers->labels[y*width];
+
+            for (int x = x_start; x < x_end; x++)
+            {
+                float dist = dist_y;
+                dist += (x-centre_x)*(x-centre_x)*spatial_weight;
+                dist += (row[x*3]-centroid->r)*(row[x*3]-centroid->r);
+                dist += (row[x*3+1]-centroid->g)*(row[x*3+1]-centroid->g);
+                dist += (row[x*3+2]-centroid->b)*(row[x*3+2]-centroid->b);
+
+                if(dist < row_distances[x]){
+                    row_distances[x] = dist;
+                    row_labels[x] = i;
+                }
+            }
+        }
+    }
+}
+
+//mean of the pixels of each centroid, the pixels out of every window are not counted
+//returns the sum of the squared moves of the centroids
+float slic_new_centroids(image_rgb_t *img, slic_buffers_t *buffers, centroid_t *lst_centroids, uint nb_centroids){
+    centroid_sums_t *lst_sums = buffers->sums;
+    float total_move = 0;
+
+    for (size_t i = 0; i < nb_centroids; i++)
+    {
+        lst_sums[i].total_r = 0;
+        lst_sums[i].total_g = 0;
+        lst_sums[i].total_b = 0;
+        lst_sums[i].total_x = 0;
+        lst_sums[i].total_y = 0;
+        lst_sums[i].nb_points_in_cluster = 0;
+    }
 
-        lst_intermediate_centroid[centroid_idx].total_r += lst_points[pt_idx].r;
-        lst_intermediate_centroid[centroid_idx].total_g += lst_points[pt_idx].g;
-        lst_intermediate_centroid[centroid_idx].total_b += lst_points[pt_idx].b;
-        lst_intermediate_centroid[centroid_idx].total_x += lst_points[pt_idx].x_norm;
-        lst_intermediate_centroid[centroid_idx].total_y += lst_points[pt_idx].y_norm;
-        lst_intermediate_centroid[centroid_idx].nb_points_in_cluster++;
+    uint pt_idx = 0;
+    for (size_t y = 0; y < img->height; y++)
+    {
+        for (size_t x = 0; x < img->width; x++)
+        {
+            if(buffers->distances[pt_idx] < 10000000000){
+                centroid_sums_t *sums = &lst_sums[buffers->labels[pt_idx]];
+                sums->total_r += img->img[pt_idx*3];
+                sums->total_g += img->img[pt_idx*3+1];
+                sums->total_b += img->img[pt_idx*3+2];
+                sums->total_x += x;
+                sums->total_y += y;
+                sums->nb_points_in_cluster++;
+            }
+            pt_idx++;
+        }
     }
 
-    //for each centroid, update their value by calculating the mean
     for (size_t i = 0; i < nb_centroids; i++)
     {
-        uint nb_points_in_cluster = lst_intermediate_centroid[i].nb_points_in_cluster;
+        uint nb_points_in_cluster = lst_sums[i].nb_points_in_cluster;
         if(nb_points_in_cluster > 0)
         {
-            float old_r = lst_centroids[i].r;
-            float old_g = lst_centroids[i].g;
-            float old_b = lst_centroids[i].b;
-            float old_x = lst_centroids[i].x;
-            float old_y = lst_centroids[i].y;
+            centroid_t old = lst_centroids[i];
+            lst_centroids[i].r = (float)lst_sums[i].total_r/(float)nb_points_in_cluster;
+            lst_centroids[i].g = (float)lst_sums[i].total_g/(float)nb_points_in_cluster;
+            lst_centroids[i].b = (float)lst_sums[i].total_b/(float)nb_points_in_cluster;
+            lst_centroids[i].x = (float)lst_sums[i].total_x/(float)nb_points_in_cluster/(float)img->width*255;
+            lst_centroids[i].y = (float)lst_sums[i].total_y/(float)nb_points_in_cluster/(float)img->height*255;
+
+            total_move += (old.r-lst_centroids[i].r)*(old.r-lst_centroids[i].r);
+            total_move += (old.g-lst_centroids[i].g)*(old.g-lst_centroids[i].g);
+            total_move += (old.b-lst_centroids[i].b)*(old.b-lst_centroids[i].b);
+            total_move += (old.x-lst_centroids[i].x)*(old.x-lst_centroids[i].x);
+            total_move += (old.y-lst_centroids[i].y)*(old.y-lst_centroids[i].y);
+        }
+    }
 
+    //average move, the number of centroids doesn't change the stop criterion
+    return total_move/nb_centroids;
+}
 
-            lst_centroids[i].r = (float)lst_intermediate_centroid[i].total_r/(float)nb_points_in_cluster;
-            lst_centroids[i].g = (float)lst_intermediate_centroid[i].total_g/(float)nb_points_in_cluster;
-            lst_centroids[i].b = (float)lst_intermediate_centroid[i].total_b/(float)nb_points_in_cluster;
-            lst_centroids[i].x = (float)lst_intermediate_centroid[i].total_x/(float)nb_points_in_cluster;
-            lst_centroids[i].y = (float)lst_intermediate_centroid[i].total_y/(float)nb_points_in_cluster;
+//each 4-connected group of pixels with the same label becomes a segment, found by a flood fill in raster order
+//groups smaller than the minimum size are merged into the segment of the pixel before them (left or above)
+void slic_enforce_connectivity(image_rgb_t *img, slic_buffers_t *buffers){
+    uint width = img->width;
+    uint height = img->height;
+    uint nb_points = width*height;
+    uint min_size = buffers->step*buffers->step/SLIC_MIN_SIZE_DIVISOR;
+    uint16_t *segments = buffers->segments;
+    uint32_t *queue = buffers->queue;
+    const uint16_t NO_SEGMENT = UINT16_MAX;
 
-            total_move += (old_r-lst_centroids[i].r)*(old_r-lst_centroids[i].r);
-            total_move += (old_g-lst_centroids[i].g)*(old_g-lst_centroids[i].g);
-            total_move += (old_b-lst_centroids[i].b)*(old_b-lst_centroids[i].b);
-            total_move += (old_x-lst_centroids[i].x)*(old_x-lst_centroids[i].x);
-            total_move += (old_y-lst_centroids[i].y)*(old_y-lst_centroids[i].y);
-        }
+    for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
+    {
+        segments[pt_idx] = NO_SEGMENT;
     }
 
-    free(lst_intermediate_centroid);
+    uint nb_segments = 0;
 
-    return total_move;
+    for (size_t start = 0; start < nb_points; start++)
+    {
+        if(segments[start] != NO_SEGMENT){
+            continue;
+        }
+
+        //segment of an already visited neighbour, to absorb a small group
+        uint start_x = start%width;
+        uint16_t neighbour_segment = NO_SEGMENT;
+        if(start_x > 0){
+            neighbour_segment = segments[start-1];
+        }
+        else if(start >= width){
+            neighbour_segment = segments[start-width];
+        }
+
+        uint16_t label = buffers->labels[start];
+        uint queue_start = 0;
+        uint queue_end = 0;
+        queue[queue_end++] = start;
+        segments[start] = nb_segments;
+
+        while(queue_start < queue_end){
+            uint pt_idx = queue[queue_start++];
+            uint x = pt_idx%width;
+
+            //4 neighbours
+            uint32_t neighbours[4];
+            uint nb_neighbours = 0;
+            if(x > 0) neighbours[nb_neighbours++] = pt_idx-1;
+            if(x+1 < width) neighbours[nb_neighbours++] = pt_idx+1;
+            if(pt_idx >= width) neighbours[nb_neighbours++] = pt_idx-width;
+            if(pt_idx+width < nb_points) neighbours[nb_neighbours++] = pt_idx+width;
+
+            for (size_t n = 0; n < nb_neighbours; n++)
+            {
+                uint32_t neighbour = neighbours[n];
+                if(segments[neighbour] == NO_SEGMENT && buffers->labels[neighbour] == label){
+                    segments[neighbour] = nb_segments;
+                    queue[queue_end++] = neighbour;
+                }
+            }
+        }
+
+        //the queue holds all the pixels of the group
+        if(queue_end < min_size && neighbour_segment != NO_SEGMENT){
+            for (size_t i = 0; i < queue_end; i++)
+            {
+                segments[queue[i]] = neighbour_segment;
+            }
+        }
+        else{
+            nb_segments++;
+        }
+    }
+
+    buffers->nb_segments = nb_segments;
 }
 
-void draw_rgb_clusters(image_rgb_t *img_draw, cluster_point_t *lst_points, uint nb_points, centroid_t *lst_centroids, uint nb_centroids){
+//each segment takes the mean colour of its pixels
+void draw_slic_segments(image_rgb_t *img, image_rgb_t *img_draw, slic_buffers_t *buffers){
+    uint nb_points = img->width*img->height;
+    centroid_sums_t *lst_sums = buffers->sums;
+
+    for (size_t i = 0; i < buffers->nb_segments; i++)
+    {
+        lst_sums[i].total_r = 0;
+        lst_sums[i].total_g = 0;
+        lst_sums[i].total_b = 0;
+        lst_sums[i].nb_points_in_cluster = 0;
+    }
 
-    //for each point retrieve the x,y values and the linked centroid rgb value
     for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
     {
-        image_set(img_draw, lst_points[pt_idx].x, lst_points[pt_idx].y, 0, lst_centroids[lst_points[pt_idx].cluster_id].r);
-        image_set(img_draw, lst_points[pt_idx].x, lst_points[pt_idx].y, 1, lst_centroids[lst_points[pt_idx].cluster_id].g);
-        image_set(img_draw, lst_points[pt_idx].x, lst_points[pt_idx].y, 2, lst_centroids[lst_points[pt_idx].cluster_id].b);
+        centroid_sums_t *sums = &lst_sums[buffers->segments[pt_idx]];
+        sums->total_r += img->img[pt_idx*3];
+        sums->total_g += img->img[pt_idx*3+1];
+        sums->total_b += img->img[pt_idx*3+2];
+        sums->nb_points_in_cluster++;
     }
-}
\ No newline at end of file
+
+    for (size_t i = 0; i < buffers->nb_segments; i++)
+    {
+        uint nb_points_in_segment = lst_sums[i].nb_points_in_cluster;
+        lst_sums[i].total_r /= nb_points_in_segment;
+        lst_sums[i].total_g /= nb_points_in_segment;
+        lst_sums[i].total_b /= nb_points_in_segment;
+    }
+
+    for (size_t pt_idx = 0; pt_idx < nb_points; pt_idx++)
+    {
+        centroid_sums_t *sums = &lst_sums[buffers->segments[pt_idx]];
+        img_draw->img[pt_idx*3] = sums->total_r;
+        img_draw->img[pt_idx*3+1] = sums->total_g;
+        img_draw->img[pt_idx*3+2] = sums->total_b;
+    }
+}
@@ -9,7 +9,8 @@
 #include <time.h>
 #include <math.h>
 
-//camera/mmal/raspberry specific libraries
+//camera/mmal/raspberry specific libraries, not needed by a replay only build (-DFRAME_SOURCE_NO_CAMERA)
+#ifndef FRAME_SOURCE_NO_CAMERA
 #include "bcm_host.h"
 #include "mmal.h"
 #include "util/mmal_default_components.h"
@@ -19,8 +20,11 @@
 #include "interface/vcos/vcos.h"
 
 #include "../common/camera_mmal.h"
+#endif
+
 #include "../common/image.h"
 #include "../common/edge_detect.h"
+#include "../common/frame_source.h"
 
 //will affect framerate, it seems that if framerate is higher than possible shutter speed, it will be automatically lowered
 #define CAMERA_SHUTTER_SPEED 24000
@@ -33,7 +37,9 @@
 #define CAMERA_RESOLUTION_X 800
 #define CAMERA_RESOLUTION_Y 600
 
+#ifndef FRAME_SOURCE_NO_CAMERA
 #define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n\r");}
+#endif
 
 char *fbp;
 uint32_t screen_size_x = 0;
@@ -41,23 +47,36 @@ uint32_t screen_size_y = 0;
 
 static int cur_sec;
 
-extern sem_t semaphore_cam_buffer;
-
 void init_time_keeping();
 float get_cur_time();
 
 void sobel_edge_detect(image_grayscale_t *img_in, image_grayscale_t *out);
 void edge_thinning(image_grayscale_t *img_in, image_grayscale_t *out);
 
-void main(void){
+void main(int argc, char **argv){
+#ifndef FRAME_SOURCE_NO_CAMERA
     //sets up the framebuffer, will draw
     framebuffer_init(&fbp, &screen_size_x, &screen_size_y);
-
-    MMAL_PORT_T *video_port;
-    MMAL_POOL_T *pool;
-    MMAL_BUFFER_HEADER_T *buffer;
-
-    camera_mmal_init(&video_port, &pool, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#endif
+
+    //frames from the camera, or replayed in a loop from a raw rgb sequence given as argument
+    //at the camera framerate or the one given after the sequence (0: as fast as possible)
+    //a replay only build needs the sequence and displays nothing
+    frame_source_t source;
+    if(argc > 1){
+        float framerate = argc > 2 ? atof(argv[2]) : MAX_CAMERA_FRAMERATE;
+        if(frame_source_replay_init(&source, argv[1], CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, 3, framerate, 1) != 0){
+            exit(1);
+        }
+    }
+    else{
+#ifndef FRAME_SOURCE_NO_CAMERA
+        frame_source_camera_init(&source, CAMERA_RESOLUTION_X, CAMERA_RESOLUTION_Y, CAMERA_SHUTTER_SPEED, MAX_CAMERA_FRAMERATE, MMAL_PARAM_AWBMODE_INCANDESCENT);
+#else
+        fprintf(stderr, "usage: %s sequence.raw [framerate]\n\r", argv[0]);
+        exit(1);
+#endif
+    }
 
     float time_since_report = 0.0f;
     int count_frames = 0;
@@ -79,12 +98,7 @@ void main(void){
     while(1){
         start_time = get_cur_time();
 
-        //wait until a buffer has been received
-        sem_wait(&semaphore_cam_buffer);
-
-        buffer = mmal_queue_get(pool->queue);
-
-        img.img = buffer->data;
+        img.img = frame_source_get(&source);
 
         image_convert_to_grayscale(&img, &img_gray);
 
@@ -93,10 +107,12 @@ void main(void){
         // save to raw file
         // save_image_grayscale_to_file(&img_edge, "img.raw");
 
-        //Send back the buffer to the port to be filled with an image again
-        mmal_port_send_buffer(video_port, buffer);
+        //gives back the frame, the camera can fill its buffer with an image again
+        frame_source_release(&source);
 
+#ifndef FRAME_SOURCE_NO_CAMERA
         image_draw_grayscale(&img_edge, fbp, screen_size_x);
+#endif
 
 
         end_time = get_cur_time();
@@ -113,6 +129,7 @@ void main(void){
 
         // printf("profiling time: %f\n\r", end_profiling_time-start_profiling_time);
 
+        free(img_gray.img);
         free(img_edge.img);
     }
 